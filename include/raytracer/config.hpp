@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <optional>
+#include <string_view>
 
 constexpr double fov_degrees = 90.;
 
@@ -11,7 +12,17 @@ constexpr double reflection_bias = 1e-4;
 constexpr double refraction_bias = 1e-4;
 
 constexpr std::size_t samples_per_pixel = 1;
+constexpr std::size_t packet_size = 4;
 constexpr std::size_t max_ray_depth = 5;
 constexpr std::size_t diffuse_reflection_ray_count = 0;
 
+// The simplified level of detail of the deep diffuse and shadow rays.
+constexpr bool use_lod = diffuse_reflection_ray_count > 0;
+constexpr std::size_t lod_ray_depth = 1;
+constexpr double lod_triangle_ratio = .25;
+constexpr std::size_t lod_min_triangle_count = 1'000;
+
+constexpr std::string_view accel_cache_directory = ".accel_cache";
+constexpr bool collect_mailbox_stats = false;
+
 constexpr std::optional fixed_rng_seed = std::make_optional(42);
@@ -40,6 +40,15 @@ struct aabb3 {
         max.z = std::max(max.z, other.max.z);
     }
 
+    // The box shared by both, which is inverted (empty) if they don't intersect.
+    [[nodiscard]] constexpr aabb3<F> intersection(const aabb3<F>& other) const noexcept {
+        aabb3<F> box;
+        box.min = {std::max(min.x, other.min.x), std::max(min.y, other.min.y), std::max(min.z, other.min.z)};
+        box.max = {std::min(max.x, other.max.x), std::min(max.y, other.max.y), std::min(max.z, other.max.z)};
+
+        return box;
+    }
+
     [[nodiscard]] constexpr std::pair<aabb3<F>, aabb3<F>> split(const uint32_t axis) const noexcept {
         assert(axis == 0 || axis == 1 || axis == 2);
         [[assume(axis == 0 || axis == 1 || axis == 2)]];
@@ -50,15 +59,27 @@ struct aabb3 {
 
         const F mid = min[axis] + ((max[axis] - min[axis]) / static_cast<F>(2.));
 
+        return split(axis, mid);
+    }
+
+    [[nodiscard]] constexpr std::pair<aabb3<F>, aabb3<F>> split(const uint32_t axis, const F position) const noexcept {
+        assert(axis == 0 || axis == 1 || axis == 2);
+        [[assume(axis == 0 || axis == 1 || axis == 2)]];
+
         aabb3<F> aabb0(*this);
         aabb3<F> aabb1(*this);
 
-        aabb0.max[axis] = mid;
-        aabb1.min[axis] = mid;
+        aabb0.max[axis] = position;
+        aabb1.min[axis] = position;
 
         return std::make_pair(aabb0, aabb1);
     }
 
+    [[nodiscard]] constexpr F surface_area() const noexcept {
+        const vec3<F> extent = max - min;
+        return static_cast<F>(2.) * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
     [[nodiscard]] constexpr bool contains(const vec3<F>& point) const noexcept {
         return (min.x <= point.x && point.x <= max.x) &&
                (min.y <= point.y && point.y <= max.y) &&
@@ -76,10 +97,11 @@ struct aabb3 {
         F t_max = std::numeric_limits<F>::max();
 
         for (std::size_t axis = 0; axis < 3; ++axis) {
-            const auto [t1, t2] = std::minmax((min[axis] - ray.origin[axis]) * ray.inv_direction[axis], (max[axis] - ray.origin[axis]) * ray.inv_direction[axis]);
+            const F t1 = (min[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+            const F t2 = (max[axis] - ray.origin[axis]) * ray.inv_direction[axis];
 
-            t_min = std::max(t_min, t1);
-            t_max = std::min(t_max, t2);
+            t_min = std::max(t_min, std::min(t1, t2));
+            t_max = std::min(t_max, std::max(t1, t2));
 
             if (t_max < t_min) {
                 return std::nullopt;
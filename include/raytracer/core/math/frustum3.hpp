@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+
+#include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/core/math/vec3.hpp>
+
+// Pyramid around rays with a shared origin, bounded by the ranges of the ray
+// slopes along the two minor axes u and v, relative to the dominant axis d.
+// The slopes are padded by MARGIN, so that rounding can't cull anything a ray
+// grazes. A point p is inside if (p - origin)[d] * sign is non-negative and
+// its slopes are within the ranges.
+template <typename F>
+struct frustum3 {
+    static constexpr F MARGIN = static_cast<F>(1e-4);
+    static constexpr F MAX_F = std::numeric_limits<F>::max();
+
+    vec3<F> origin;
+    uint32_t d, u, v;
+    F sign;
+    F min_u_slope = MAX_F, max_u_slope = -MAX_F;
+    F min_v_slope = MAX_F, max_v_slope = -MAX_F;
+
+    // The frustum around rays from origin in the given directions, along the
+    // dominant axis of the first one. There is none if the directions don't
+    // all point to the same side along that axis.
+    [[nodiscard]] static constexpr std::optional<frustum3> around(const vec3<F>& origin, std::span<const vec3<F>> directions) noexcept {
+        if (directions.empty()) {
+            return std::nullopt;
+        }
+
+        uint32_t d = 0;
+        for (uint32_t axis = 1; axis < 3; ++axis) {
+            if (std::abs(directions[0][d]) < std::abs(directions[0][axis])) {
+                d = axis;
+            }
+        }
+
+        frustum3 frustum{origin, d, (d + 1) % 3, (d + 2) % 3, std::signbit(directions[0][d]) ? static_cast<F>(-1.) : static_cast<F>(1.)};
+        for (const auto& direction : directions) {
+            if (!(static_cast<F>(0.) < frustum.sign * direction[d])) {
+                return std::nullopt;
+            }
+
+            frustum.expand(direction);
+        }
+
+        return frustum;
+    }
+
+    constexpr void expand(const vec3<F>& direction) noexcept {
+        const F u_slope = direction[u] / (sign * direction[d]);
+        const F v_slope = direction[v] / (sign * direction[d]);
+
+        min_u_slope = std::min(min_u_slope, u_slope - MARGIN * (static_cast<F>(1.) + std::abs(u_slope)));
+        max_u_slope = std::max(max_u_slope, u_slope + MARGIN * (static_cast<F>(1.) + std::abs(u_slope)));
+        min_v_slope = std::min(min_v_slope, v_slope - MARGIN * (static_cast<F>(1.) + std::abs(v_slope)));
+        max_v_slope = std::max(max_v_slope, v_slope + MARGIN * (static_cast<F>(1.) + std::abs(v_slope)));
+    }
+
+    // Whether the box lies fully behind the apex or fully outside one of the
+    // four side planes, so no ray inside the frustum can enter it. As the
+    // tests are linear, it is enough to test the corners.
+    [[nodiscard]] constexpr bool excludes(const aabb3<F>& box) const noexcept {
+        bool behind = true;
+        bool outside_min_u = true, outside_max_u = true;
+        bool outside_min_v = true, outside_max_v = true;
+
+        for (std::size_t corner = 0; corner < 8; ++corner) {
+            const vec3<F> point{
+                (corner & 1) ? box.max.x : box.min.x,
+                (corner & 2) ? box.max.y : box.min.y,
+                (corner & 4) ? box.max.z : box.min.z
+            };
+
+            const F along_d = sign * (point[d] - origin[d]);
+            const F along_u = point[u] - origin[u];
+            const F along_v = point[v] - origin[v];
+
+            behind = behind && along_d < static_cast<F>(0.);
+            outside_min_u = outside_min_u && along_u < min_u_slope * along_d;
+            outside_max_u = outside_max_u && max_u_slope * along_d < along_u;
+            outside_min_v = outside_min_v && along_v < min_v_slope * along_d;
+            outside_max_v = outside_max_v && max_v_slope * along_d < along_v;
+        }
+
+        return behind || outside_min_u || outside_max_u || outside_min_v || outside_max_v;
+    }
+};
@@ -58,3 +58,27 @@ vec3<F> operator*(const mat3<F>& lhs, const vec3<F>& rhs) {
         lhs[2, 0] * rhs.x + lhs[2, 1] * rhs.y + lhs[2, 2] * rhs.z
     };
 }
+
+template <typename F>
+F determinant(const mat3<F>& m) noexcept {
+    return m[0, 0] * (m[1, 1] * m[2, 2] - m[1, 2] * m[2, 1]) -
+           m[0, 1] * (m[1, 0] * m[2, 2] - m[1, 2] * m[2, 0]) +
+           m[0, 2] * (m[1, 0] * m[2, 1] - m[1, 1] * m[2, 0]);
+}
+
+template <typename F>
+mat3<F> inverse(const mat3<F>& m) noexcept {
+    const F inv_det = static_cast<F>(1.) / determinant(m);
+
+    return {{
+        (m[1, 1] * m[2, 2] - m[1, 2] * m[2, 1]) * inv_det,
+        (m[0, 2] * m[2, 1] - m[0, 1] * m[2, 2]) * inv_det,
+        (m[0, 1] * m[1, 2] - m[0, 2] * m[1, 1]) * inv_det,
+        (m[1, 2] * m[2, 0] - m[1, 0] * m[2, 2]) * inv_det,
+        (m[0, 0] * m[2, 2] - m[0, 2] * m[2, 0]) * inv_det,
+        (m[0, 2] * m[1, 0] - m[0, 0] * m[1, 2]) * inv_det,
+        (m[1, 0] * m[2, 1] - m[1, 1] * m[2, 0]) * inv_det,
+        (m[0, 1] * m[2, 0] - m[0, 0] * m[2, 1]) * inv_det,
+        (m[0, 0] * m[1, 1] - m[0, 1] * m[1, 0]) * inv_det
+    }};
+}
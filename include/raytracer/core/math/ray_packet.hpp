@@ -0,0 +1,18 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#include <raytracer/core/math/vec3.hpp>
+#include <raytracer/core/math/ray3.hpp>
+
+template <typename F, std::size_t P>
+struct ray_packet {
+    std::array<vec3<F>, P> origins;
+    std::array<vec3<F>, P> directions;
+    std::array<bool, P> active;
+
+    [[nodiscard]] constexpr ray3<F> ray(const std::size_t lane) const noexcept {
+        return {origins[lane], directions[lane]};
+    }
+};
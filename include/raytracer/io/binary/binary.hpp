@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// Raw binary I/O of trivially copyable values in the native byte order, for
+// files which are only read back on the same machine (e.g. caches).
+
+template <typename T>
+requires std::is_trivially_copyable_v<T>
+void write_binary(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+requires std::is_trivially_copyable_v<T>
+void write_binary(std::ostream& out, std::span<const T> values) {
+    write_binary(out, static_cast<std::uint64_t>(values.size()));
+    out.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size_bytes()));
+}
+
+template <typename T>
+requires std::is_trivially_copyable_v<T>
+[[nodiscard]] bool read_binary(std::istream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+// Reads a vector written by write_binary. The element count is checked
+// against the rest of the stream first, so a truncated or corrupt file
+// can't cause a huge allocation.
+template <typename T>
+requires std::is_trivially_copyable_v<T>
+[[nodiscard]] bool read_binary(std::istream& in, std::vector<T>& values) {
+    std::uint64_t count;
+    if (!read_binary(in, count)) {
+        return false;
+    }
+
+    const auto position = in.tellg();
+    in.seekg(0, std::ios::end);
+    const auto remaining = static_cast<std::uint64_t>(in.tellg() - position);
+    in.seekg(position);
+
+    if (!in || remaining / sizeof(T) < count) {
+        return false;
+    }
+
+    values.resize(count);
+
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(count * sizeof(T))));
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <format>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include <raytracer/render/accel/stats.hpp>
+
+// Quotes the string as a JSON string, escaping the characters JSON requires.
+inline std::string json_string(const std::string_view value) {
+    std::string quoted = "\"";
+    for (const char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            quoted += std::format("\\u{:04x}", static_cast<unsigned char>(c));
+        } else {
+            quoted += c;
+        }
+    }
+
+    return quoted + '"';
+}
+
+// Writes the build stats of the named structure over the scene as a JSON
+// object, with the derived ratios spelled out, so reports of different
+// builds can be compared directly.
+inline void write_accel_stats(const accel_stats& stats, const std::string_view scene_name, const std::string_view structure_name, std::ostream& out) {
+    out << "{\n";
+    out << std::format("  \"scene\": {},\n", json_string(scene_name));
+    out << std::format("  \"structure\": {},\n", json_string(structure_name));
+    out << std::format("  \"triangles\": {},\n", stats.triangle_count);
+    out << std::format("  \"nodes\": {},\n", stats.inner_node_count + stats.leaf_count);
+    out << std::format("  \"inner_nodes\": {},\n", stats.inner_node_count);
+    out << std::format("  \"leaves\": {},\n", stats.leaf_count);
+    out << std::format("  \"empty_leaves\": {},\n", stats.empty_leaf_count);
+    out << std::format("  \"max_depth\": {},\n", stats.max_depth());
+    out << std::format("  \"average_leaf_depth\": {},\n", stats.average_leaf_depth());
+
+    out << "  \"leaf_depth_histogram\": [";
+    for (std::size_t depth = 0; depth < stats.leaf_depth_histogram.size(); ++depth) {
+        out << (depth == 0 ? "" : ", ") << stats.leaf_depth_histogram[depth];
+    }
+    out << "],\n";
+
+    out << std::format("  \"triangle_references\": {},\n", stats.triangle_reference_count);
+    out << std::format("  \"duplication_factor\": {},\n", stats.duplication_factor());
+    out << std::format("  \"packets\": {},\n", stats.packet_count);
+    out << std::format("  \"packet_width\": {},\n", stats.packet_width);
+    out << std::format("  \"lane_occupancy\": {},\n", stats.lane_occupancy());
+    out << std::format("  \"sah_cost\": {},\n", stats.sah_cost);
+
+    out << "  \"memory_bytes\": {\n";
+    for (const auto& [name, bytes] : stats.memory_bytes) {
+        out << std::format("    {}: {},\n", json_string(name), bytes);
+    }
+    out << std::format("    \"total\": {}\n", stats.total_memory_bytes());
+    out << "  }\n";
+    out << "}\n";
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <filesystem>
 
 #include <simdjson.h>
@@ -105,23 +107,44 @@ texture_variant<F> load_texture(simdjson::dom::object&& obj) {
     }
 }
 
+// The ray types set to false in a mesh's visibility object don't see the
+// mesh, e.g. "visibility": {"camera": false} hides it from the camera only.
+inline ray_type_mask load_visibility(simdjson::dom::object&& obj) {
+    ray_type_mask visibility = all_ray_types_mask;
+
+    for (const ray_type type : all_ray_types) {
+        if (auto visible = obj[ray_type_name(type)].get_bool(); !visible.error() && !visible.value()) {
+            visibility &= static_cast<ray_type_mask>(~ray_type_bit(type));
+        }
+    }
+
+    return visibility;
+}
+
 template <typename F>
 material_variant<F> load_material(simdjson::dom::object&& obj) {
     std::string_view type = obj["type"];
 
+    bool back_face_culling = false;
+    if (auto back_face_culling_json = obj["back_face_culling"].get_bool(); !back_face_culling_json.error()) {
+        back_face_culling = back_face_culling_json.value();
+    }
+
     if (type == "diffuse") {
         simdjson::dom::element albedo = obj["albedo"];
 
         if (albedo.type() == simdjson::dom::element_type::ARRAY) {
             return diffuse_material<F>{
                 load_color<F>(obj["albedo"]),
-                obj["smooth_shading"]
+                obj["smooth_shading"],
+                back_face_culling
             };
         } else if (albedo.type() == simdjson::dom::element_type::STRING) {
             std::string_view texture_name = obj["albedo"];
             return texture_material<F>{
                 std::string{texture_name},
-                obj["smooth_shading"]
+                obj["smooth_shading"],
+                back_face_culling
             };
         } else {
             throw std::invalid_argument("albedo neither array nor string");
@@ -129,17 +152,20 @@ material_variant<F> load_material(simdjson::dom::object&& obj) {
     } else if (type == "reflective") {
         return reflective_material<F>{
             load_color<F>(obj["albedo"]),
-            obj["smooth_shading"]
+            obj["smooth_shading"],
+            back_face_culling
         };
     } else if (type == "refractive") {
         return refractive_material<F>{
             load_f<F>(obj["ior"]),
-            obj["smooth_shading"]
+            obj["smooth_shading"],
+            back_face_culling
         };
     } else if (type == "constant") {
         return constant_material<F>{
             load_color<F>(obj["albedo"]),
-            obj["smooth_shading"]
+            obj["smooth_shading"],
+            back_face_culling
         };
     } else {
         throw std::invalid_argument("material type unknown");
@@ -147,7 +173,7 @@ material_variant<F> load_material(simdjson::dom::object&& obj) {
 }
 
 template <typename F>
-mesh_object<F> load_mesh(simdjson::dom::object&& obj, std::size_t object_idx) {
+mesh_object<F> load_mesh(simdjson::dom::object&& obj) {
     std::size_t material_index = obj["material_index"];
 
     std::vector<vec3<F>> vertices;
@@ -191,29 +217,22 @@ mesh_object<F> load_mesh(simdjson::dom::object&& obj, std::size_t object_idx) {
         }
     }
 
-    std::vector<triangle<F>> triangles;
-    std::vector<std::size_t> triangle_buffer;
+    std::vector<std::array<vertex_index, 3>> triangles;
+    std::vector<std::uint64_t> triangle_buffer;
     for (auto triangle_index : obj["triangles"]) {
         triangle_buffer.push_back(triangle_index);
 
         if (triangle_buffer.size() == 3) {
-            vec3<vec2<F>> triangle_uvs{};
-
-            if (!uvs.empty()) {
-                triangle_uvs = vec3<vec2<F>>{
-                    uvs[triangle_buffer[0]],
-                    uvs[triangle_buffer[1]],
-                    uvs[triangle_buffer[2]]
-                };
+            for (const std::uint64_t vertex_idx : triangle_buffer) {
+                if (vertices.size() <= vertex_idx) {
+                    throw std::invalid_argument("triangle vertex index out of range");
+                }
             }
 
-            triangles.push_back(triangle<F>{
-                vertices[triangle_buffer[0]],
-                vertices[triangle_buffer[1]],
-                vertices[triangle_buffer[2]],
-                {triangle_buffer[0], triangle_buffer[1], triangle_buffer[2]},
-                object_idx,
-                triangle_uvs 
+            triangles.push_back({
+                static_cast<vertex_index>(triangle_buffer[0]),
+                static_cast<vertex_index>(triangle_buffer[1]),
+                static_cast<vertex_index>(triangle_buffer[2])
             });
 
             triangle_buffer.clear();
@@ -224,14 +243,86 @@ mesh_object<F> load_mesh(simdjson::dom::object&& obj, std::size_t object_idx) {
         throw std::invalid_argument("triangle indices not multiple of 3");
     }
 
+    if (!uvs.empty() && uvs.size() < vertices.size()) {
+        throw std::invalid_argument("fewer uvs than vertices");
+    }
+
+    ray_type_mask visibility = all_ray_types_mask;
+    if (!obj["visibility"].get_object().error()) {
+        visibility = load_visibility(obj["visibility"]);
+    }
+
     return mesh_object<F>{
         material_index,
-        vertices,
-        uvs,
-        triangles
+        std::move(vertices),
+        std::move(uvs),
+        std::move(triangles),
+        visibility
     };
 }
 
+// An analytic primitive: a sphere (center and radius), an infinite plane
+// (point and normal) or a disk (center, normal and radius).
+template <typename F>
+primitive_object<F> load_primitive(simdjson::dom::object&& obj) {
+    std::string_view type = obj["type"];
+    std::size_t material_index = obj["material_index"];
+
+    ray_type_mask visibility = all_ray_types_mask;
+    if (!obj["visibility"].get_object().error()) {
+        visibility = load_visibility(obj["visibility"]);
+    }
+
+    if (type == "sphere") {
+        return primitive_object<F>{
+            material_index,
+            sphere<F>{load_vec3<F>(obj["center"]), load_f<F>(obj["radius"])},
+            visibility
+        };
+    } else if (type == "plane") {
+        return primitive_object<F>{
+            material_index,
+            plane<F>{load_vec3<F>(obj["point"]), load_vec3<F>(obj["normal"])},
+            visibility
+        };
+    } else if (type == "disk") {
+        return primitive_object<F>{
+            material_index,
+            disk<F>{load_vec3<F>(obj["center"]), load_vec3<F>(obj["normal"]), load_f<F>(obj["radius"])},
+            visibility
+        };
+    } else {
+        throw std::invalid_argument("primitive type unknown");
+    }
+}
+
+template <typename F>
+mesh_instance<F> load_instance(simdjson::dom::object&& obj, const std::size_t mesh_count) {
+    const std::size_t object_index = obj["object_index"];
+    if (mesh_count <= object_index) {
+        throw std::invalid_argument("instance object index out of range");
+    }
+
+    mat3<F> matrix{{
+        static_cast<F>(1.), static_cast<F>(0.), static_cast<F>(0.),
+        static_cast<F>(0.), static_cast<F>(1.), static_cast<F>(0.),
+        static_cast<F>(0.), static_cast<F>(0.), static_cast<F>(1.)
+    }};
+    if (!obj["matrix"].get_array().error()) {
+        matrix = load_mat3<F>(obj["matrix"]);
+    }
+    if (determinant(matrix) == static_cast<F>(0.)) {
+        throw std::invalid_argument("instance matrix singular");
+    }
+
+    vec3<F> position{};
+    if (!obj["position"].get_array().error()) {
+        position = load_vec3<F>(obj["position"]);
+    }
+
+    return mesh_instance<F>{object_index, matrix, position};
+}
+
 template <typename F>
 scene<F> parse_scene_file(const std::filesystem::path& path) {
     simdjson::dom::parser parser;
@@ -257,8 +348,20 @@ scene<F> parse_scene_file(const std::filesystem::path& path) {
         scene.materials.emplace_back(load_material<F>(material));
     }
 
-    for (auto [object_idx, object] : doc["objects"] | std::ranges::views::enumerate) {
-        scene.meshes.emplace_back(load_mesh<F>(object, object_idx));
+    for (auto object : doc["objects"]) {
+        scene.meshes.emplace_back(load_mesh<F>(object));
+    }
+
+    if (auto instances = doc["instances"].get_array(); !instances.error()) {
+        for (auto instance : instances) {
+            scene.instances.push_back(load_instance<F>(instance, scene.meshes.size()));
+        }
+    }
+
+    if (auto primitives = doc["primitives"].get_array(); !primitives.error()) {
+        for (auto primitive : primitives) {
+            scene.primitives.push_back(load_primitive<F>(primitive));
+        }
     }
 
     return scene;
@@ -1,12 +1,95 @@
 #pragma once
 
+#include <array>
 #include <optional>
 
+#include <raytracer/core/math/frustum3.hpp>
 #include <raytracer/core/math/ray3.hpp>
+#include <raytracer/core/math/ray_packet.hpp>
 #include <raytracer/render/hit.hpp>
+#include <raytracer/scene/scene.hpp>
 
+// intersect<type> returns the closest hit of the ray among the triangles
+// visible to the ray type, skipping the back faces of the meshes whose
+// material culls them (unless it is called with back_face_culling = false).
+// occluded only answers whether the ray hits a triangle visible to shadow
+// rays within (0, t_max), so it can stop at the first one and skip building
+// the hit record.
 template <typename A, typename F>
-concept accelerator = requires(A accel, const ray3<F>& ray) {
-    { accel.template intersect<true>(ray) } -> std::same_as<std::optional<hit<F>>>;
-    { accel.template intersect<false>(ray) } -> std::same_as<std::optional<hit<F>>>;
+concept accelerator = requires(A accel, const ray3<F>& ray, const F t_max) {
+    { accel.template intersect<ray_type::camera>(ray) } -> std::same_as<std::optional<hit<F>>>;
+    { accel.template intersect<ray_type::reflection>(ray) } -> std::same_as<std::optional<hit<F>>>;
+    { accel.template intersect<ray_type::diffuse>(ray) } -> std::same_as<std::optional<hit<F>>>;
+    { accel.occluded(ray, t_max) } -> std::same_as<bool>;
 };
+
+template <typename A, typename F, std::size_t P>
+concept packet_accelerator = accelerator<A, F> && requires(A accel, const ray_packet<F, P>& packet) {
+    { accel.template intersect_packet<ray_type::camera>(packet) } -> std::same_as<std::array<std::optional<hit<F>>, P>>;
+    { accel.template intersect_packet<ray_type::reflection>(packet) } -> std::same_as<std::array<std::optional<hit<F>>, P>>;
+};
+
+// Structures which can start the traversal of all rays inside a frustum (e.g.
+// the camera rays of a tile) below their root. frustum_root is found once for
+// the frustum and passed to the traversals of its rays.
+template <typename A, typename F>
+concept frustum_accelerator = accelerator<A, F> && requires(A accel, const frustum3<F>& frustum, const ray3<F>& ray, const typename A::traversal_root& root) {
+    { accel.frustum_root(frustum) } -> std::same_as<typename A::traversal_root>;
+    { accel.template intersect<ray_type::camera>(ray, root) } -> std::same_as<std::optional<hit<F>>>;
+};
+
+template <typename A, typename F, std::size_t P>
+concept frustum_packet_accelerator = packet_accelerator<A, F, P> && frustum_accelerator<A, F> && requires(A accel, const ray_packet<F, P>& packet, const typename A::traversal_root& root) {
+    { accel.template intersect_packet<ray_type::camera>(packet, root) } -> std::same_as<std::array<std::optional<hit<F>>, P>>;
+};
+
+// Structures with a coarse level of detail next to the detailed one, which is
+// the structure itself (see lod_accel).
+template <typename A, typename F>
+concept lod_accelerator = accelerator<A, F> && accelerator<typename A::level_type, F> && requires(A accel) {
+    { accel.coarse } -> std::convertible_to<const typename A::level_type&>;
+};
+
+// Builds the hit record of a traversal's closest hit, looking up the shading
+// attributes of the triangle in its mesh.
+template <typename F>
+constexpr hit<F> make_triangle_hit(const scene<F>& scene, const triangle_ref ref, const ray3<F>& ray, const F t, const F u, const F v) noexcept {
+    const auto& mesh = scene.meshes[ref.mesh_idx];
+
+    return hit<F>{
+        ray,
+        ray.origin + (t * ray.direction),
+        mesh.shading_normal(ref.triangle_idx, u, v),
+        mesh.triangle_normals[ref.triangle_idx],
+        mesh.triangle_uvs(ref.triangle_idx),
+        t,
+        u,
+        v,
+        static_cast<F>(1.) - u - v,
+        mesh.material_idx
+    };
+}
+
+// Builds the hit record of an analytic primitive. Its uv coordinates are
+// passed as the barycentric coordinates of a triangle with the uvs (0, 0),
+// (1, 0) and (0, 1), so the textures interpolate them back unchanged.
+template <typename F>
+constexpr hit<F> make_primitive_hit(const scene<F>& scene, const std::size_t primitive_idx, const ray3<F>& ray, const F t) noexcept {
+    const auto& primitive = scene.primitives[primitive_idx];
+    const vec3<F> position = ray.origin + (t * ray.direction);
+    const vec3<F> normal = primitive.normal_at(position);
+    const vec2<F> uv = primitive.uv_at(position);
+
+    return hit<F>{
+        ray,
+        position,
+        normal,
+        normal,
+        {{static_cast<F>(0.), static_cast<F>(0.)}, {static_cast<F>(1.), static_cast<F>(0.)}, {static_cast<F>(0.), static_cast<F>(1.)}},
+        t,
+        uv.x,
+        uv.y,
+        static_cast<F>(1.) - uv.x - uv.y,
+        primitive.material_idx
+    };
+}
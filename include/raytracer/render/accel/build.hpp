@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <span>
+#include <thread>
+#include <vector>
+
+struct index_range {
+    std::size_t begin;
+    std::size_t end;
+
+    [[nodiscard]] constexpr std::size_t size() const noexcept {
+        return end - begin;
+    }
+};
+
+// Stack-like arena for the triangle index lists of a tree build. The child
+// lists of a node are pushed on top of the parent's list and popped once both
+// child subtrees are built, so a whole build reuses a single buffer instead of
+// allocating two vectors per node. Lists are referred to by index_range, as a
+// push may reallocate the buffer.
+struct index_arena {
+    std::vector<std::uint32_t> buffer;
+
+    index_arena() = default;
+
+    explicit index_arena(std::span<const std::uint32_t> indices)
+        : buffer(indices.begin(), indices.end()) {}
+
+    [[nodiscard]] constexpr std::span<const std::uint32_t> view(const index_range range) const noexcept {
+        return std::span(buffer).subspan(range.begin, range.size());
+    }
+
+    [[nodiscard]] constexpr std::size_t mark() const noexcept {
+        return buffer.size();
+    }
+
+    constexpr void release(const std::size_t mark) noexcept {
+        buffer.resize(mark);
+    }
+
+    // Appends the indices of the range, for which keep(index) is true, and
+    // returns the range of the newly pushed list.
+    template <typename P>
+    constexpr index_range push_filtered(const index_range range, P&& keep) {
+        const std::size_t begin = buffer.size();
+        buffer.reserve(begin + range.size());
+
+        for (std::size_t i = range.begin; i < range.end; ++i) {
+            if (keep(buffer[i])) {
+                buffer.push_back(buffer[i]);
+            }
+        }
+
+        return {begin, buffer.size()};
+    }
+};
+
+// Subtrees with fewer triangles are never built as separate tasks, as the
+// task overhead would outweigh the work.
+constexpr std::size_t PARALLEL_BUILD_MIN_TRIANGLES = 4096;
+
+// How many levels at the top of a tree build fork their second child into a
+// separate task, so that there are a few tasks for every hardware thread. On a
+// single hardware thread the tasks would only compete for the same caches.
+inline std::size_t parallel_build_depth() noexcept {
+    const std::size_t num_threads = std::thread::hardware_concurrency();
+    if (num_threads <= 1) {
+        return 0;
+    }
+
+    const std::size_t target_tasks = 4 * num_threads;
+
+    std::size_t depth = 0;
+    for (std::size_t tasks = 1; tasks < target_tasks; tasks *= 2) {
+        ++depth;
+    }
+
+    return depth;
+}
+
+// Interleaves the lowest 10 bits of each coordinate into a 30-bit Morton code,
+// so that sorting by the code orders the points along a Z-order curve.
+[[nodiscard]] constexpr std::uint32_t morton_code(const std::uint32_t x, const std::uint32_t y, const std::uint32_t z) noexcept {
+    const auto spread_bits = [](std::uint32_t bits) {
+        bits &= 0x3ffu;
+        bits = (bits | (bits << 16u)) & 0x030000ffu;
+        bits = (bits | (bits << 8u)) & 0x0300f00fu;
+        bits = (bits | (bits << 4u)) & 0x030c30c3u;
+        bits = (bits | (bits << 2u)) & 0x09249249u;
+        return bits;
+    };
+
+    return (spread_bits(x) << 2u) | (spread_bits(y) << 1u) | spread_bits(z);
+}
+
+// Stable LSD radix sort of the values by their 32-bit key(value), one 8-bit
+// digit per pass. Larger inputs are split into a chunk per hardware thread,
+// which count their digits and scatter their values in parallel. Passes in
+// which all keys share the same digit are skipped.
+template <typename T, typename K>
+void parallel_radix_sort(std::vector<T>& values, K&& key) {
+    constexpr std::uint32_t DIGIT_BITS = 8;
+    constexpr std::size_t BUCKETS = std::size_t{1} << DIGIT_BITS;
+
+    const std::size_t chunk_count = values.size() < PARALLEL_BUILD_MIN_TRIANGLES
+        ? 1
+        : std::max<std::size_t>(1, std::thread::hardware_concurrency());
+    const std::size_t chunk_size = (values.size() + chunk_count - 1) / chunk_count;
+
+    const auto for_each_chunk = [&](const auto& work) {
+        std::vector<std::future<void>> futures;
+        for (std::size_t chunk = 1; chunk < chunk_count; ++chunk) {
+            futures.push_back(std::async(std::launch::async, work, chunk, std::min(chunk * chunk_size, values.size()), std::min((chunk + 1) * chunk_size, values.size())));
+        }
+
+        work(0, 0, std::min(chunk_size, values.size()));
+
+        for (auto& future : futures) {
+            future.get();
+        }
+    };
+
+    std::vector<T> scratch(values.size());
+    std::vector<std::array<std::size_t, BUCKETS>> offsets(chunk_count);
+
+    for (std::uint32_t shift = 0; shift < 32; shift += DIGIT_BITS) {
+        const auto digit = [&](const T& value) {
+            return (static_cast<std::uint32_t>(key(value)) >> shift) & (BUCKETS - 1);
+        };
+
+        for_each_chunk([&](const std::size_t chunk, const std::size_t begin, const std::size_t end) {
+            auto& counts = offsets[chunk];
+            counts.fill(0);
+            for (std::size_t i = begin; i < end; ++i) {
+                ++counts[digit(values[i])];
+            }
+        });
+
+        // Each chunk scatters its values of a bucket after the ones of all
+        // lower buckets and of the same bucket in the preceding chunks.
+        bool single_bucket = false;
+        std::size_t offset = 0;
+        for (std::size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            const std::size_t bucket_begin = offset;
+            for (auto& chunk_offsets : offsets) {
+                const std::size_t count = chunk_offsets[bucket];
+                chunk_offsets[bucket] = offset;
+                offset += count;
+            }
+
+            single_bucket = single_bucket || offset - bucket_begin == values.size();
+        }
+
+        if (single_bucket) {
+            continue;
+        }
+
+        for_each_chunk([&](const std::size_t chunk, const std::size_t begin, const std::size_t end) {
+            auto& chunk_offsets = offsets[chunk];
+            for (std::size_t i = begin; i < end; ++i) {
+                scratch[chunk_offsets[digit(values[i])]++] = values[i];
+            }
+        });
+
+        values.swap(scratch);
+    }
+}
@@ -0,0 +1,960 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <experimental/simd>
+
+#include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/render/accel/build.hpp>
+#include <raytracer/render/accel/kd_tree_simd.hpp>
+#include <raytracer/render/accel/primitives.hpp>
+#include <raytracer/render/accel/stats.hpp>
+#include <raytracer/scene/scene.hpp>
+#include <raytracer/utils/fixed_stack.hpp>
+
+namespace stdx = std::experimental;
+
+enum class bvh_build_mode {
+    // Binned SAH splits, plus spatial splits while the duplication budget
+    // lasts.
+    SAH,
+    // Linear BVH over the Morton-sorted triangle centroids, which is much
+    // faster to build but gives a lower quality tree.
+    MORTON
+};
+
+template <typename F,
+          F eps,
+          std::size_t N = 4,
+          std::size_t max_leaf_size = stdx::native_simd<F>::size(),
+          std::size_t W = stdx::native_simd<F>::size(),
+          F spatial_split_budget = static_cast<F>(0.),
+          bvh_build_mode build_mode = bvh_build_mode::SAH>
+struct bvh_wide_accel {
+    static_assert(2 <= N, "a wide BVH node needs at least two children");
+
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+    using simd_n = stdx::fixed_size_simd<F, N>;
+    using simd_n_mask = simd_n::mask_type;
+
+    static constexpr std::size_t EMPTY = std::numeric_limits<std::size_t>::max();
+    static constexpr F MAX_F = std::numeric_limits<F>::max();
+
+    static constexpr std::size_t SAH_BINS = 32;
+    // The builder only compares splits by area and packet count, the costs
+    // are the kd-tree's and only weigh the terms of sah_cost.
+    static constexpr F TRAVERSAL_COST = kd_tree_simd_accel<F, eps>::TRAVERSAL_COST;
+    static constexpr F PACKET_INTERSECTION_COST = kd_tree_simd_accel<F, eps>::PACKET_INTERSECTION_COST;
+    // Spatial splits are only tried where the children of the best object
+    // split overlap by more than this fraction of the root's surface area.
+    static constexpr F SPATIAL_SPLIT_MIN_OVERLAP = static_cast<F>(1e-5);
+
+    // The children of the nodes MAX_DEPTH - 1 levels below the root are all
+    // leaves, however many triangles they get, so the traversal stacks (at
+    // most one node's children per level) fit into a fixed size array.
+    static constexpr std::size_t MAX_DEPTH = 64;
+    static constexpr std::size_t TRAVERSAL_STACK_SIZE = (N - 1) * MAX_DEPTH + 1;
+
+    // The child boxes are stored as SoA, so that all N slabs are tested at
+    // once. Unused lanes keep an inverted (empty) box, which never passes the
+    // ordered near/far slab test. A lane with a non-zero pack_count is a leaf,
+    // whose packets start at child[lane], otherwise child[lane] is a node.
+    struct node {
+        simd_n min_x{MAX_F}, min_y{MAX_F}, min_z{MAX_F};
+        simd_n max_x{-MAX_F}, max_y{-MAX_F}, max_z{-MAX_F};
+
+        std::array<std::size_t, N> child;
+        std::array<std::size_t, N> pack_count;
+    };
+
+    using hit_candidate = packet_hit_candidate<F>;
+
+    struct stack_entry {
+        std::size_t child;
+        std::size_t pack_count;
+        F t_min;
+    };
+
+    // A reference to (the part inside a node of) a triangle. Spatial splits
+    // clip the box of a reference straddling the split plane to both sides,
+    // so the same triangle may be referenced by several leaves.
+    struct reference {
+        std::uint32_t triangle_idx;
+        aabb3<F> box;
+    };
+
+    struct reference_range {
+        std::size_t begin;
+        std::size_t end;
+
+        [[nodiscard]] constexpr std::size_t size() const noexcept {
+            return end - begin;
+        }
+    };
+
+    struct object_split {
+        uint32_t axis;
+        std::size_t bin;
+        F cost;
+        F overlap;
+    };
+
+    struct spatial_split {
+        uint32_t axis;
+        F position;
+        F cost;
+        std::size_t duplicates;
+    };
+
+    struct morton_entry {
+        std::uint32_t code;
+        std::uint32_t triangle_idx;
+    };
+
+    // Reference lists of the children of a spatial split are pushed on top of
+    // the buffer and popped when the node is finished, similar to index_arena.
+    struct build_state {
+        std::vector<reference> references;
+        std::size_t remaining_duplicates;
+        F root_area;
+    };
+
+    std::shared_ptr<const scene<F>> scene_ptr;
+    std::vector<triangle_ref> triangle_refs;
+    std::vector<surface_flags> mesh_flags;
+    std::vector<node> tree;
+    std::vector<triangle_packet<F, W>> triangle_packs;
+
+    std::size_t root_child = EMPTY;
+    std::size_t root_pack_count = 0;
+
+    // The scene's analytic primitives, only gathered by the whole scene
+    // constructor.
+    primitive_set<F, eps> primitives;
+
+    constexpr bvh_wide_accel(std::shared_ptr<const scene<F>> scene_ptr)
+        : bvh_wide_accel(scene_ptr, all_mesh_indices(*scene_ptr)) {
+        primitives = primitive_set<F, eps>(*this->scene_ptr);
+    }
+
+    // Builds the BVH over the given meshes only, e.g. as the bottom level of
+    // an instance_accel.
+    constexpr bvh_wide_accel(std::shared_ptr<const scene<F>> scene_ptr, std::span<const std::size_t> mesh_indices)
+        : scene_ptr(std::move(scene_ptr)) {
+        triangle_refs = gather_triangle_refs(*this->scene_ptr, mesh_indices);
+        mesh_flags = mesh_surface_flags(*this->scene_ptr);
+
+        if (triangle_refs.empty()) {
+            return;
+        }
+
+        if constexpr (build_mode == bvh_build_mode::MORTON) {
+            build_morton();
+        } else {
+            build_sah();
+        }
+    }
+
+    constexpr void build_sah() {
+        build_state state;
+        state.references.reserve(triangle_refs.size());
+        for (std::uint32_t triangle_idx = 0; triangle_idx < triangle_refs.size(); ++triangle_idx) {
+            state.references.push_back({triangle_idx, triangle_box(*scene_ptr, triangle_refs[triangle_idx])});
+        }
+
+        const reference_range root_range{0, state.references.size()};
+        state.remaining_duplicates = static_cast<std::size_t>(spatial_split_budget * static_cast<F>(triangle_refs.size()));
+        state.root_area = bounds(state.references, root_range).surface_area();
+
+        if (root_range.size() <= max_leaf_size) {
+            root_child = build_leaf(state.references, root_range);
+            root_pack_count = triangle_packs.size() - root_child;
+        } else {
+            root_child = build_node(state, root_range, 0);
+        }
+    }
+
+    [[nodiscard]] static constexpr vec3<F> centroid(const aabb3<F>& box) noexcept {
+        return static_cast<F>(0.5) * (box.min + box.max);
+    }
+
+    [[nodiscard]] static constexpr std::size_t packet_count(const std::size_t triangle_count) noexcept {
+        return (triangle_count + W - 1) / W;
+    }
+
+    [[nodiscard]] static constexpr aabb3<F> bounds(const std::vector<reference>& references, const reference_range range) noexcept {
+        aabb3<F> box;
+        for (std::size_t i = range.begin; i < range.end; ++i) {
+            box.unite(references[i].box);
+        }
+
+        return box;
+    }
+
+    [[nodiscard]] static constexpr std::size_t to_bin(const F position, const F min, const F scale) noexcept {
+        const F bin = (position - min) * scale;
+        return std::min(static_cast<std::size_t>(std::max(bin, static_cast<F>(0.))), SAH_BINS - 1);
+    }
+
+    // Bounds of the parts of the referenced triangle on both sides of the
+    // plane, clipped to the reference's current box.
+    [[nodiscard]] constexpr std::pair<aabb3<F>, aabb3<F>> split_reference(const reference& ref, const uint32_t axis, const F position) const noexcept {
+        const std::array<vec3<F>, 3> vertices = triangle_vertices(*scene_ptr, triangle_refs[ref.triangle_idx]);
+
+        aabb3<F> left_box;
+        aabb3<F> right_box;
+        for (std::size_t i = 0; i < 3; ++i) {
+            const vec3<F>& a = vertices[i];
+            const vec3<F>& b = vertices[(i + 1) % 3];
+
+            if (a[axis] <= position) {
+                left_box.expand(a);
+            }
+            if (position <= a[axis]) {
+                right_box.expand(a);
+            }
+
+            // Edges crossing the plane add their intersection point to both.
+            if ((a[axis] < position && position < b[axis]) || (b[axis] < position && position < a[axis])) {
+                const F t = (position - a[axis]) / (b[axis] - a[axis]);
+                vec3<F> point = a + t * (b - a);
+                point[axis] = position;
+
+                left_box.expand(point);
+                right_box.expand(point);
+            }
+        }
+
+        left_box.max[axis] = position;
+        right_box.min[axis] = position;
+
+        return {left_box.intersection(ref.box), right_box.intersection(ref.box)};
+    }
+
+    // Binned SAH over the reference centroids. The cost is counted in packets,
+    // so splits filling whole packets are preferred.
+    [[nodiscard]] constexpr std::optional<object_split> find_object_split(const std::vector<reference>& references, const reference_range range) const noexcept {
+        aabb3<F> centroid_box;
+        for (std::size_t i = range.begin; i < range.end; ++i) {
+            centroid_box.expand(centroid(references[i].box));
+        }
+
+        std::optional<object_split> best_split;
+        const vec3<F> extent = centroid_box.max - centroid_box.min;
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            if (extent[axis] <= static_cast<F>(0.)) {
+                continue;
+            }
+
+            const F scale = static_cast<F>(SAH_BINS) / extent[axis];
+
+            std::array<aabb3<F>, SAH_BINS> bin_boxes;
+            std::array<std::size_t, SAH_BINS> bin_counts{};
+            for (std::size_t i = range.begin; i < range.end; ++i) {
+                const std::size_t bin = to_bin(centroid(references[i].box)[axis], centroid_box.min[axis], scale);
+                bin_boxes[bin].unite(references[i].box);
+                ++bin_counts[bin];
+            }
+
+            std::array<aabb3<F>, SAH_BINS> right_boxes;
+            std::array<std::size_t, SAH_BINS> right_counts{};
+            right_boxes[SAH_BINS - 1] = bin_boxes[SAH_BINS - 1];
+            right_counts[SAH_BINS - 1] = bin_counts[SAH_BINS - 1];
+            for (std::size_t bin = SAH_BINS - 1; 0 < bin; --bin) {
+                right_boxes[bin - 1] = right_boxes[bin];
+                right_boxes[bin - 1].unite(bin_boxes[bin - 1]);
+                right_counts[bin - 1] = right_counts[bin] + bin_counts[bin - 1];
+            }
+
+            aabb3<F> left_box;
+            std::size_t left_count = 0;
+            for (std::size_t bin = 1; bin < SAH_BINS; ++bin) {
+                left_box.unite(bin_boxes[bin - 1]);
+                left_count += bin_counts[bin - 1];
+
+                if (left_count == 0 || right_counts[bin] == 0) {
+                    continue;
+                }
+
+                const aabb3<F>& right_box = right_boxes[bin];
+                const F cost = left_box.surface_area() * static_cast<F>(packet_count(left_count)) +
+                               right_box.surface_area() * static_cast<F>(packet_count(right_counts[bin]));
+
+                if (!best_split || cost < best_split->cost) {
+                    const F overlap = left_box.intersect(right_box) ? left_box.intersection(right_box).surface_area() : static_cast<F>(0.);
+                    best_split = object_split{axis, bin, cost, overlap};
+                }
+            }
+        }
+
+        return best_split;
+    }
+
+    // Binned SAH over the planes inside the node's box, where the references
+    // straddling a plane are clipped and counted on both sides.
+    [[nodiscard]] constexpr std::optional<spatial_split> find_spatial_split(const std::vector<reference>& references, const reference_range range, const aabb3<F>& box) const noexcept {
+        std::optional<spatial_split> best_split;
+        const vec3<F> extent = box.max - box.min;
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            if (extent[axis] <= static_cast<F>(0.)) {
+                continue;
+            }
+
+            const F scale = static_cast<F>(SAH_BINS) / extent[axis];
+            const auto plane_position = [&](const std::size_t plane) {
+                return box.min[axis] + (extent[axis] * static_cast<F>(plane)) / static_cast<F>(SAH_BINS);
+            };
+
+            // Each reference enters the bin where it starts and exits the bin
+            // where it ends, the bins in between get its clipped parts.
+            std::array<aabb3<F>, SAH_BINS> bin_boxes;
+            std::array<std::size_t, SAH_BINS> entries{};
+            std::array<std::size_t, SAH_BINS> exits{};
+            for (std::size_t i = range.begin; i < range.end; ++i) {
+                const std::size_t first_bin = to_bin(references[i].box.min[axis], box.min[axis], scale);
+                const std::size_t last_bin = to_bin(references[i].box.max[axis], box.min[axis], scale);
+
+                reference rest = references[i];
+                for (std::size_t bin = first_bin; bin < last_bin; ++bin) {
+                    const auto [left_box, right_box] = split_reference(rest, axis, plane_position(bin + 1));
+                    bin_boxes[bin].unite(left_box);
+                    rest.box = right_box;
+                }
+                bin_boxes[last_bin].unite(rest.box);
+
+                ++entries[first_bin];
+                ++exits[last_bin];
+            }
+
+            std::array<aabb3<F>, SAH_BINS> right_boxes;
+            std::array<std::size_t, SAH_BINS> right_counts{};
+            right_boxes[SAH_BINS - 1] = bin_boxes[SAH_BINS - 1];
+            right_counts[SAH_BINS - 1] = exits[SAH_BINS - 1];
+            for (std::size_t bin = SAH_BINS - 1; 0 < bin; --bin) {
+                right_boxes[bin - 1] = right_boxes[bin];
+                right_boxes[bin - 1].unite(bin_boxes[bin - 1]);
+                right_counts[bin - 1] = right_counts[bin] + exits[bin - 1];
+            }
+
+            aabb3<F> left_box;
+            std::size_t left_count = 0;
+            for (std::size_t bin = 1; bin < SAH_BINS; ++bin) {
+                left_box.unite(bin_boxes[bin - 1]);
+                left_count += entries[bin - 1];
+
+                const std::size_t right_count = right_counts[bin];
+                if (left_count == 0 || right_count == 0) {
+                    continue;
+                }
+
+                const F cost = left_box.surface_area() * static_cast<F>(packet_count(left_count)) +
+                               right_boxes[bin].surface_area() * static_cast<F>(packet_count(right_count));
+
+                if (!best_split || cost < best_split->cost) {
+                    best_split = spatial_split{axis, plane_position(bin), cost, left_count + right_count - range.size()};
+                }
+            }
+        }
+
+        return best_split;
+    }
+
+    constexpr std::pair<reference_range, reference_range> apply_object_split(std::vector<reference>& references, const reference_range range, const object_split& split) const {
+        aabb3<F> centroid_box;
+        for (std::size_t i = range.begin; i < range.end; ++i) {
+            centroid_box.expand(centroid(references[i].box));
+        }
+
+        const uint32_t axis = split.axis;
+        const F scale = static_cast<F>(SAH_BINS) / (centroid_box.max[axis] - centroid_box.min[axis]);
+
+        const auto middle = std::partition(references.begin() + range.begin, references.begin() + range.end,
+            [&](const reference& ref) {
+                return to_bin(centroid(ref.box)[axis], centroid_box.min[axis], scale) < split.bin;
+            });
+        const std::size_t mid = middle - references.begin();
+
+        return {{range.begin, mid}, {mid, range.end}};
+    }
+
+    // Pushes the reference lists of both sides on top of the buffer, the
+    // references straddling the plane are clipped into both. Returns nothing
+    // (and pushes nothing) if one of the sides would be empty.
+    constexpr std::optional<std::pair<reference_range, reference_range>> apply_spatial_split(build_state& state, const reference_range range, const spatial_split& split) const {
+        auto& references = state.references;
+        const uint32_t axis = split.axis;
+        const F position = split.position;
+
+        const std::size_t left_begin = references.size();
+
+        for (std::size_t i = range.begin; i < range.end; ++i) {
+            if (references[i].box.max[axis] <= position) {
+                references.push_back(references[i]);
+            } else if (references[i].box.min[axis] < position) {
+                references.push_back({references[i].triangle_idx, split_reference(references[i], axis, position).first});
+            }
+        }
+
+        const std::size_t right_begin = references.size();
+        for (std::size_t i = range.begin; i < range.end; ++i) {
+            if (position <= references[i].box.min[axis]) {
+                references.push_back(references[i]);
+            } else if (position < references[i].box.max[axis]) {
+                references.push_back({references[i].triangle_idx, split_reference(references[i], axis, position).second});
+            }
+        }
+
+        const reference_range left{left_begin, right_begin};
+        const reference_range right{right_begin, references.size()};
+        if (left.size() == 0 || right.size() == 0) {
+            references.resize(left_begin);
+            return std::nullopt;
+        }
+
+        const std::size_t duplicates = left.size() + right.size() - range.size();
+        state.remaining_duplicates -= std::min(duplicates, state.remaining_duplicates);
+
+        return std::make_pair(left, right);
+    }
+
+    // Fallback for references whose centroids can't be binned, e.g. because
+    // they all coincide. Splits at the median centroid along the widest axis,
+    // rounded to a multiple of W where possible.
+    constexpr std::pair<reference_range, reference_range> apply_median_split(std::vector<reference>& references, const reference_range range) const {
+        aabb3<F> centroid_box;
+        for (std::size_t i = range.begin; i < range.end; ++i) {
+            centroid_box.expand(centroid(references[i].box));
+        }
+
+        const vec3<F> extent = centroid_box.max - centroid_box.min;
+        std::size_t axis = 0;
+        if (extent[axis] < extent.y) {
+            axis = 1;
+        }
+        if (extent[axis] < extent.z) {
+            axis = 2;
+        }
+
+        std::size_t left_size = ((range.size() / 2 + W - 1) / W) * W;
+        if (range.size() <= left_size) {
+            left_size = range.size() / 2;
+        }
+
+        const auto first = references.begin() + range.begin;
+        std::nth_element(first, first + left_size, references.begin() + range.end,
+            [&](const reference& lhs, const reference& rhs) {
+                return centroid(lhs.box)[axis] < centroid(rhs.box)[axis];
+            });
+
+        return {
+            {range.begin, range.begin + left_size},
+            {range.begin + left_size, range.end}
+        };
+    }
+
+    // Splits the range with the cheaper of the best object and spatial split.
+    // Spatial splits are only considered while the duplication budget lasts
+    // and where the object split's children overlap noticeably, as they mostly
+    // pay off for large or long, thin triangles.
+    constexpr std::pair<reference_range, reference_range> split_range(build_state& state, const reference_range range) const {
+        const auto object = find_object_split(state.references, range);
+
+        const bool try_spatial = state.remaining_duplicates != 0 &&
+            (!object || SPATIAL_SPLIT_MIN_OVERLAP * state.root_area < object->overlap);
+
+        if (try_spatial) {
+            const auto spatial = find_spatial_split(state.references, range, bounds(state.references, range));
+
+            if (spatial && spatial->duplicates <= state.remaining_duplicates && (!object || spatial->cost < object->cost)) {
+                if (const auto split = apply_spatial_split(state, range, *spatial)) {
+                    return *split;
+                }
+            }
+        }
+
+        if (object) {
+            return apply_object_split(state.references, range, *object);
+        }
+
+        return apply_median_split(state.references, range);
+    }
+
+    // Builds the packets of a leaf over the given range of references (or
+    // Morton entries).
+    template <typename R>
+    constexpr std::size_t build_leaf(const std::vector<R>& references, const reference_range range) {
+        const std::size_t first_pack = triangle_packs.size();
+
+        append_packets(triangle_packs, *scene_ptr, triangle_refs, mesh_flags, std::span(references).subspan(range.begin, range.size()) | std::views::transform(&R::triangle_idx));
+
+        return first_pack;
+    }
+
+    constexpr std::size_t build_node(build_state& state, const reference_range range, const std::size_t depth) {
+        const std::size_t mark = state.references.size();
+
+        // Keep splitting the largest child range until the node is full or
+        // every child range fits into a leaf.
+        std::array<reference_range, N> child_ranges;
+        child_ranges[0] = range;
+        std::size_t child_count = 1;
+
+        while (child_count < N) {
+            std::size_t largest = 0;
+            for (std::size_t i = 1; i < child_count; ++i) {
+                if (child_ranges[largest].size() < child_ranges[i].size()) {
+                    largest = i;
+                }
+            }
+
+            if (child_ranges[largest].size() <= max_leaf_size) {
+                break;
+            }
+
+            const auto [left, right] = split_range(state, child_ranges[largest]);
+            child_ranges[largest] = left;
+            child_ranges[child_count++] = right;
+        }
+
+        const std::size_t node_idx = tree.size();
+        tree.emplace_back();
+        tree[node_idx].child.fill(EMPTY);
+        tree[node_idx].pack_count.fill(0);
+
+        for (std::size_t lane = 0; lane < child_count; ++lane) {
+            const reference_range child_range = child_ranges[lane];
+            const aabb3<F> box = bounds(state.references, child_range);
+
+            std::size_t child_idx;
+            std::size_t pack_count = 0;
+            if (child_range.size() <= max_leaf_size || depth + 1 == MAX_DEPTH) {
+                child_idx = build_leaf(state.references, child_range);
+                pack_count = triangle_packs.size() - child_idx;
+            } else {
+                child_idx = build_node(state, child_range, depth + 1);
+            }
+
+            set_child(tree[node_idx], lane, box, child_idx, pack_count);
+        }
+
+        state.references.resize(mark);
+
+        return node_idx;
+    }
+
+    static constexpr void set_child(node& current, const std::size_t lane, const aabb3<F>& box, const std::size_t child_idx, const std::size_t pack_count) noexcept {
+        current.min_x[lane] = box.min.x;
+        current.min_y[lane] = box.min.y;
+        current.min_z[lane] = box.min.z;
+        current.max_x[lane] = box.max.x;
+        current.max_y[lane] = box.max.y;
+        current.max_z[lane] = box.max.z;
+        current.child[lane] = child_idx;
+        current.pack_count[lane] = pack_count;
+    }
+
+    // Sorts the triangles by the Morton codes of their centroids (quantized
+    // to 10 bits per axis of the centroid bounds) and splits the sorted list
+    // at the highest differing code bit. The node boxes are gathered
+    // bottom-up, so every triangle box is only read by its leaf.
+    constexpr void build_morton() {
+        aabb3<F> centroid_box;
+        for (const auto ref : triangle_refs) {
+            centroid_box.expand(centroid(triangle_box(*scene_ptr, ref)));
+        }
+
+        const vec3<F> extent = centroid_box.max - centroid_box.min;
+        const auto quantize = [&](const F position, const std::size_t axis) {
+            if (extent[axis] <= static_cast<F>(0.)) {
+                return std::uint32_t{0};
+            }
+
+            const F scaled = (position - centroid_box.min[axis]) / extent[axis] * static_cast<F>(1023.);
+            return static_cast<std::uint32_t>(std::clamp(scaled, static_cast<F>(0.), static_cast<F>(1023.)));
+        };
+
+        std::vector<morton_entry> entries(triangle_refs.size());
+        for (std::uint32_t triangle_idx = 0; triangle_idx < triangle_refs.size(); ++triangle_idx) {
+            const vec3<F> point = centroid(triangle_box(*scene_ptr, triangle_refs[triangle_idx]));
+            entries[triangle_idx] = {morton_code(quantize(point.x, 0), quantize(point.y, 1), quantize(point.z, 2)), triangle_idx};
+        }
+
+        parallel_radix_sort(entries, [](const morton_entry& entry) {
+            return entry.code;
+        });
+
+        const reference_range root_range{0, entries.size()};
+        if (root_range.size() <= max_leaf_size) {
+            root_child = build_leaf(entries, root_range);
+            root_pack_count = triangle_packs.size() - root_child;
+        } else {
+            root_child = build_morton_node(entries, root_range, 0).first;
+        }
+    }
+
+    // Splits the sorted range where its highest differing code bit becomes
+    // set, or in the middle if all codes are the same.
+    [[nodiscard]] static constexpr std::pair<reference_range, reference_range> split_morton_range(const std::vector<morton_entry>& entries, const reference_range range) noexcept {
+        const std::uint32_t differing = entries[range.begin].code ^ entries[range.end - 1].code;
+
+        std::size_t mid = range.begin + range.size() / 2;
+        if (differing != 0) {
+            const std::uint32_t bit = std::bit_floor(differing);
+            const auto middle = std::partition_point(entries.begin() + range.begin, entries.begin() + range.end,
+                [&](const morton_entry& entry) {
+                    return (entry.code & bit) == 0;
+                });
+            mid = middle - entries.begin();
+        }
+
+        return {{range.begin, mid}, {mid, range.end}};
+    }
+
+    // Returns the index and the box of the new node.
+    constexpr std::pair<std::size_t, aabb3<F>> build_morton_node(const std::vector<morton_entry>& entries, const reference_range range, const std::size_t depth) {
+        std::array<reference_range, N> child_ranges;
+        child_ranges[0] = range;
+        std::size_t child_count = 1;
+
+        while (child_count < N) {
+            std::size_t largest = 0;
+            for (std::size_t i = 1; i < child_count; ++i) {
+                if (child_ranges[largest].size() < child_ranges[i].size()) {
+                    largest = i;
+                }
+            }
+
+            if (child_ranges[largest].size() <= max_leaf_size) {
+                break;
+            }
+
+            const auto [left, right] = split_morton_range(entries, child_ranges[largest]);
+            child_ranges[largest] = left;
+            child_ranges[child_count++] = right;
+        }
+
+        const std::size_t node_idx = tree.size();
+        tree.emplace_back();
+        tree[node_idx].child.fill(EMPTY);
+        tree[node_idx].pack_count.fill(0);
+
+        aabb3<F> node_box;
+        for (std::size_t lane = 0; lane < child_count; ++lane) {
+            const reference_range child_range = child_ranges[lane];
+
+            if (child_range.size() <= max_leaf_size || depth + 1 == MAX_DEPTH) {
+                aabb3<F> box;
+                for (std::size_t i = child_range.begin; i < child_range.end; ++i) {
+                    box.unite(triangle_box(*scene_ptr, triangle_refs[entries[i].triangle_idx]));
+                }
+
+                const std::size_t first_pack = build_leaf(entries, child_range);
+                set_child(tree[node_idx], lane, box, first_pack, triangle_packs.size() - first_pack);
+                node_box.unite(box);
+            } else {
+                const auto [child_idx, box] = build_morton_node(entries, child_range, depth + 1);
+                set_child(tree[node_idx], lane, box, child_idx, 0);
+                node_box.unite(box);
+            }
+        }
+
+        return {node_idx, node_box};
+    }
+
+    [[nodiscard]] static constexpr aabb3<F> child_box(const node& current, const std::size_t lane) noexcept {
+        aabb3<F> box;
+        box.expand(vec3<F>(current.min_x[lane], current.min_y[lane], current.min_z[lane]));
+        box.expand(vec3<F>(current.max_x[lane], current.max_y[lane], current.max_z[lane]));
+
+        return box;
+    }
+
+    [[nodiscard]] constexpr aabb3<F> root_box() const noexcept {
+        aabb3<F> box;
+        if (root_child != EMPTY && root_pack_count == 0) {
+            for (std::size_t lane = 0; lane < N; ++lane) {
+                if (tree[root_child].child[lane] != EMPTY) {
+                    box.unite(child_box(tree[root_child], lane));
+                }
+            }
+        }
+
+        return box;
+    }
+
+    // Expected cost of a random ray through the BVH under the surface area
+    // heuristic, comparable to the kd-tree's. A node costs one traversal step
+    // for all its N child boxes.
+    [[nodiscard]] constexpr F sah_cost() const noexcept {
+        if (root_child == EMPTY) {
+            return static_cast<F>(0.);
+        }
+
+        const F root_area = root_box().surface_area();
+        if (root_pack_count != 0 || root_area <= static_cast<F>(0.)) {
+            return PACKET_INTERSECTION_COST * static_cast<F>(triangle_packs.size());
+        }
+
+        F cost = TRAVERSAL_COST;
+        for (const auto& current : tree) {
+            for (std::size_t lane = 0; lane < N; ++lane) {
+                if (current.child[lane] == EMPTY) {
+                    continue;
+                }
+
+                const F area_ratio = child_box(current, lane).surface_area() / root_area;
+                if (current.pack_count[lane] != 0) {
+                    cost += PACKET_INTERSECTION_COST * static_cast<F>(current.pack_count[lane]) * area_ratio;
+                } else {
+                    cost += TRAVERSAL_COST * area_ratio;
+                }
+            }
+        }
+
+        return cost;
+    }
+
+    // Walks the BVH for the build quality report.
+    [[nodiscard]] accel_stats build_stats() const {
+        accel_stats stats;
+        stats.triangle_count = triangle_refs.size();
+        stats.packet_width = W;
+        stats.sah_cost = static_cast<double>(sah_cost());
+        stats.memory_bytes = {
+            {"nodes", vector_bytes(tree)},
+            {"packets", vector_bytes(triangle_packs)},
+            {"triangle_refs", vector_bytes(triangle_refs)},
+            {"mesh_flags", vector_bytes(mesh_flags)}
+        };
+
+        if (root_child == EMPTY) {
+            return stats;
+        }
+
+        const auto add_leaf = [&](const std::size_t first_pack, const std::size_t pack_count, const std::size_t depth) {
+            std::size_t used = 0;
+            for (std::size_t pack_idx = first_pack; pack_idx < first_pack + pack_count; ++pack_idx) {
+                used += used_lanes(triangle_packs[pack_idx]);
+            }
+
+            stats.add_leaf(depth, pack_count, used);
+        };
+
+        if (root_pack_count != 0) {
+            add_leaf(root_child, root_pack_count, 0);
+            return stats;
+        }
+
+        std::vector<std::pair<std::size_t, std::size_t>> nodes_to_visit{{root_child, 0}};
+        while (!nodes_to_visit.empty()) {
+            const auto [node_idx, depth] = nodes_to_visit.back();
+            nodes_to_visit.pop_back();
+
+            ++stats.inner_node_count;
+            const auto& current = tree[node_idx];
+            for (std::size_t lane = 0; lane < N; ++lane) {
+                if (current.child[lane] == EMPTY) {
+                    continue;
+                }
+
+                if (current.pack_count[lane] != 0) {
+                    add_leaf(current.child[lane], current.pack_count[lane], depth + 1);
+                } else {
+                    nodes_to_visit.emplace_back(current.child[lane], depth + 1);
+                }
+            }
+        }
+
+        return stats;
+    }
+
+    [[nodiscard]] constexpr simd_n_mask intersect_children(const ray3<F>& ray, const node& current, const F best_t, simd_n& t_min) const noexcept {
+        const bool neg_x = ray.inv_direction.x < static_cast<F>(0.);
+        const bool neg_y = ray.inv_direction.y < static_cast<F>(0.);
+        const bool neg_z = ray.inv_direction.z < static_cast<F>(0.);
+
+        const simd_n near_x = ((neg_x ? current.max_x : current.min_x) - ray.origin.x) * ray.inv_direction.x;
+        const simd_n near_y = ((neg_y ? current.max_y : current.min_y) - ray.origin.y) * ray.inv_direction.y;
+        const simd_n near_z = ((neg_z ? current.max_z : current.min_z) - ray.origin.z) * ray.inv_direction.z;
+        const simd_n far_x = ((neg_x ? current.min_x : current.max_x) - ray.origin.x) * ray.inv_direction.x;
+        const simd_n far_y = ((neg_y ? current.min_y : current.max_y) - ray.origin.y) * ray.inv_direction.y;
+        const simd_n far_z = ((neg_z ? current.min_z : current.max_z) - ray.origin.z) * ray.inv_direction.z;
+
+        t_min = stdx::max(stdx::max(near_x, near_y), stdx::max(near_z, simd_n(static_cast<F>(0.))));
+        const simd_n t_max = stdx::min(stdx::min(far_x, far_y), stdx::min(far_z, simd_n(best_t)));
+
+        // The unused lanes hold inverted boxes, which only a ray with NaN
+        // components can hit, so the callers skip EMPTY children as well.
+        return t_min <= t_max;
+    }
+
+    template <ray_type type, bool back_face_culling = true>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect(const ray3<F>& ray) const noexcept {
+        return primitives.template closest_hit<type, back_face_culling>(*scene_ptr, ray, intersect_triangles<type, back_face_culling>(ray));
+    }
+
+    [[nodiscard]] constexpr bool occluded(const ray3<F>& ray, const F max_t) const noexcept {
+        return primitives.occluded(ray, max_t) || occluded_triangles(ray, max_t);
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect_triangles(const ray3<F>& ray) const noexcept {
+        std::optional<hit_candidate> closest_hit;
+
+        if (root_child == EMPTY) {
+            return std::nullopt;
+        }
+
+        fixed_stack<stack_entry, TRAVERSAL_STACK_SIZE> nodes_to_check;
+        nodes_to_check.push({root_child, root_pack_count, static_cast<F>(0.)});
+
+        while (!nodes_to_check.empty()) {
+            const auto entry = nodes_to_check.top();
+            nodes_to_check.pop();
+
+            const F best_t = closest_hit ? closest_hit->t : MAX_F;
+            if (best_t < entry.t_min) {
+                continue;
+            }
+
+            if (entry.pack_count != 0) {
+                const auto new_hit_candidate = intersect_leaf<type, back_face_culling>(ray, entry.child, entry.pack_count);
+
+                if (new_hit_candidate && new_hit_candidate->t < best_t) {
+                    closest_hit = new_hit_candidate;
+                }
+
+                continue;
+            }
+
+            const auto& current = tree[entry.child];
+
+            simd_n t_min;
+            const simd_n_mask mask = intersect_children(ray, current, best_t, t_min);
+
+            if (stdx::none_of(mask)) {
+                continue;
+            }
+
+            // Push the hit children far-to-near, so the nearest one is popped
+            // first and shrinks best_t for its siblings.
+            std::array<stack_entry, N> hit_children;
+            std::size_t hit_count = 0;
+            for (std::size_t lane = 0; lane < N; ++lane) {
+                if (!mask[lane] || current.child[lane] == EMPTY) {
+                    continue;
+                }
+
+                stack_entry child_entry{current.child[lane], current.pack_count[lane], t_min[lane]};
+
+                std::size_t i = hit_count++;
+                for (; 0 < i && hit_children[i - 1].t_min < child_entry.t_min; --i) {
+                    hit_children[i] = hit_children[i - 1];
+                }
+                hit_children[i] = child_entry;
+            }
+
+            for (std::size_t i = 0; i < hit_count; ++i) {
+                nodes_to_check.push(hit_children[i]);
+            }
+        }
+
+        if (!closest_hit) {
+            return std::nullopt;
+        }
+
+        const auto& pack = triangle_packs[closest_hit->pack_idx];
+
+        return make_triangle_hit(*scene_ptr, triangle_refs[pack.triangle_indices[closest_hit->lane]], ray, closest_hit->t, closest_hit->u, closest_hit->v);
+    }
+
+    // Same traversal as intersect, but the children are visited in any order
+    // and it returns at the first leaf with a shadow casting hit.
+    [[nodiscard]] constexpr bool occluded_triangles(const ray3<F>& ray, const F max_t) const noexcept {
+        if (root_child == EMPTY) {
+            return false;
+        }
+
+        fixed_stack<stack_entry, TRAVERSAL_STACK_SIZE> nodes_to_check;
+        nodes_to_check.push({root_child, root_pack_count, static_cast<F>(0.)});
+
+        while (!nodes_to_check.empty()) {
+            const auto entry = nodes_to_check.top();
+            nodes_to_check.pop();
+
+            if (entry.pack_count != 0) {
+                if (occluded_leaf(ray, entry.child, entry.pack_count, max_t)) {
+                    return true;
+                }
+
+                continue;
+            }
+
+            const auto& current = tree[entry.child];
+
+            simd_n t_min;
+            const simd_n_mask mask = intersect_children(ray, current, max_t, t_min);
+
+            for (std::size_t lane = 0; lane < N; ++lane) {
+                if (mask[lane] && current.child[lane] != EMPTY) {
+                    nodes_to_check.push({current.child[lane], current.pack_count[lane], t_min[lane]});
+                }
+            }
+        }
+
+        return false;
+    }
+
+    [[nodiscard]] constexpr bool occluded_leaf(const ray3<F>& ray, const std::size_t first_pack, const std::size_t pack_count, const F max_t) const noexcept {
+        for (std::size_t pack_idx = first_pack; pack_idx < first_pack + pack_count; ++pack_idx) {
+            const auto& pack = triangle_packs[pack_idx];
+
+            if (stdx::none_of(pack.visible_to[std::to_underlying(ray_type::shadow)])) {
+                continue;
+            }
+
+            if (stdx::any_of(hits_within<F, eps>(pack, ray, max_t))) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit_candidate> intersect_leaf(const ray3<F>& ray, const std::size_t first_pack, const std::size_t pack_count) const noexcept {
+        std::optional<hit_candidate> closest_hit;
+
+        for (std::size_t pack_idx = first_pack; pack_idx < first_pack + pack_count; ++pack_idx) {
+            const auto& pack = triangle_packs[pack_idx];
+
+            if (stdx::none_of(pack.visible_to[std::to_underlying(type)])) {
+                continue;
+            }
+
+            intersect_closest<type, back_face_culling, F, eps>(pack, pack_idx, ray, closest_hit);
+        }
+
+        return closest_hit;
+    }
+};
+
+// Wide BVH built with spatial splits (SBVH), which may add up to
+// spatial_split_budget times the triangle count of extra references.
+template <typename F, F eps, std::size_t N = 4, F spatial_split_budget = static_cast<F>(0.3)>
+using sbvh_wide_accel = bvh_wide_accel<F, eps, N, stdx::native_simd<F>::size(), stdx::native_simd<F>::size(), spatial_split_budget>;
+
+// Wide BVH with the linear (Morton code) builder, for scenes that have to be
+// rendered right after they changed.
+template <typename F, F eps, std::size_t N = 4>
+using lbvh_wide_accel = bvh_wide_accel<F, eps, N, stdx::native_simd<F>::size(), stdx::native_simd<F>::size(), static_cast<F>(0.), bvh_build_mode::MORTON>;
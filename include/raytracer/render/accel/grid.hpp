@@ -0,0 +1,311 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <experimental/simd>
+
+#include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/render/accel/packet_formats.hpp>
+#include <raytracer/render/accel/primitives.hpp>
+#include <raytracer/scene/scene.hpp>
+
+namespace stdx = std::experimental;
+
+// Uniform grid over the scene's bounding box. Every cell holds the triangles
+// whose boxes overlap it as triangle packets, and rays step through the cells
+// they pass with a 3D-DDA (Amanatides & Woo), so there is no hierarchy to
+// descend. Works best for evenly sized and evenly spread triangles.
+template <typename F, F eps, std::size_t W = stdx::native_simd<F>::size()>
+struct grid_accel {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+
+    static constexpr F MAX_F = std::numeric_limits<F>::max();
+
+    // The longest axis gets GRID_DENSITY * cbrt(triangle count) cells, the
+    // other axes proportionally as many, but no axis more than MAX_RESOLUTION.
+    static constexpr F GRID_DENSITY = static_cast<F>(2.);
+    static constexpr int MAX_RESOLUTION = 128;
+
+    using hit_candidate = packet_hit_candidate<F>;
+
+    std::shared_ptr<const scene<F>> scene_ptr;
+    std::vector<triangle_ref> triangle_refs;
+    std::vector<triangle_packet<F, W>> triangle_packs;
+
+    // The packets of cell c are [cell_offsets[c], cell_offsets[c + 1]).
+    std::vector<std::size_t> cell_offsets;
+
+    aabb3<F> root_box;
+    std::array<int, 3> resolution{1, 1, 1};
+    vec3<F> cell_size;
+    vec3<F> inv_cell_size;
+
+    // The scene's analytic primitives, only gathered by the whole scene
+    // constructor.
+    primitive_set<F, eps> primitives;
+
+    constexpr grid_accel(std::shared_ptr<const scene<F>> scene_ptr)
+        : grid_accel(scene_ptr, all_mesh_indices(*scene_ptr)) {
+        primitives = primitive_set<F, eps>(*this->scene_ptr);
+    }
+
+    // Builds the grid over the given meshes only, e.g. as the bottom level of
+    // an instance_accel.
+    constexpr grid_accel(std::shared_ptr<const scene<F>> scene_ptr, std::span<const std::size_t> mesh_indices)
+        : scene_ptr(std::move(scene_ptr)) {
+        triangle_refs = gather_triangle_refs(*this->scene_ptr, mesh_indices);
+
+        if (triangle_refs.empty()) {
+            return;
+        }
+
+        std::vector<aabb3<F>> triangle_boxes;
+        triangle_boxes.reserve(triangle_refs.size());
+        for (const auto ref : triangle_refs) {
+            triangle_boxes.push_back(triangle_box(*this->scene_ptr, ref));
+            root_box.unite(triangle_boxes.back());
+        }
+
+        const vec3<F> extent = root_box.max - root_box.min;
+        const F max_extent = std::max({extent.x, extent.y, extent.z});
+        const F cells_per_unit = max_extent <= static_cast<F>(0.)
+            ? static_cast<F>(0.)
+            : GRID_DENSITY * std::cbrt(static_cast<F>(triangle_refs.size())) / max_extent;
+
+        for (std::size_t axis = 0; axis < 3; ++axis) {
+            resolution[axis] = std::clamp(static_cast<int>(std::round(extent[axis] * cells_per_unit)), 1, MAX_RESOLUTION);
+
+            // Flat axes get a cell of non-zero size, so the DDA never divides
+            // by zero.
+            cell_size[axis] = std::max(extent[axis] / static_cast<F>(resolution[axis]), std::numeric_limits<F>::min());
+            inv_cell_size[axis] = static_cast<F>(1.) / cell_size[axis];
+        }
+
+        build_cells(triangle_boxes);
+    }
+
+    [[nodiscard]] constexpr std::size_t cell_count() const noexcept {
+        return static_cast<std::size_t>(resolution[0]) * static_cast<std::size_t>(resolution[1]) * static_cast<std::size_t>(resolution[2]);
+    }
+
+    [[nodiscard]] constexpr std::size_t cell_index(const std::array<int, 3>& cell) const noexcept {
+        return (static_cast<std::size_t>(cell[2]) * static_cast<std::size_t>(resolution[1]) + static_cast<std::size_t>(cell[1])) * static_cast<std::size_t>(resolution[0]) + static_cast<std::size_t>(cell[0]);
+    }
+
+    [[nodiscard]] constexpr int to_cell(const F position, const std::size_t axis) const noexcept {
+        const int cell = static_cast<int>((position - root_box.min[axis]) * inv_cell_size[axis]);
+        return std::clamp(cell, 0, resolution[axis] - 1);
+    }
+
+    // Calls visit(cell index) for every cell overlapped by the triangle's box.
+    template <typename V>
+    constexpr void for_each_cell(const aabb3<F>& box, V&& visit) const {
+        std::array<int, 3> first;
+        std::array<int, 3> last;
+        for (std::size_t axis = 0; axis < 3; ++axis) {
+            first[axis] = to_cell(box.min[axis], axis);
+            last[axis] = to_cell(box.max[axis], axis);
+        }
+
+        std::array<int, 3> cell;
+        for (cell[2] = first[2]; cell[2] <= last[2]; ++cell[2]) {
+            for (cell[1] = first[1]; cell[1] <= last[1]; ++cell[1]) {
+                for (cell[0] = first[0]; cell[0] <= last[0]; ++cell[0]) {
+                    visit(cell_index(cell));
+                }
+            }
+        }
+    }
+
+    // Counts the triangles of every cell, gathers them into one list sorted
+    // by cell and packs each cell's triangles into packets.
+    constexpr void build_cells(std::span<const aabb3<F>> triangle_boxes) {
+        std::vector<std::size_t> triangle_offsets(cell_count() + 1, 0);
+        for (const auto& triangle_box : triangle_boxes) {
+            for_each_cell(triangle_box, [&](const std::size_t cell_idx) {
+                ++triangle_offsets[cell_idx + 1];
+            });
+        }
+
+        for (std::size_t cell_idx = 0; cell_idx < cell_count(); ++cell_idx) {
+            triangle_offsets[cell_idx + 1] += triangle_offsets[cell_idx];
+        }
+
+        std::vector<std::uint32_t> cell_triangles(triangle_offsets.back());
+        std::vector<std::size_t> cursors(triangle_offsets.begin(), triangle_offsets.end() - 1);
+        for (std::uint32_t triangle_idx = 0; triangle_idx < triangle_refs.size(); ++triangle_idx) {
+            for_each_cell(triangle_boxes[triangle_idx], [&](const std::size_t cell_idx) {
+                cell_triangles[cursors[cell_idx]++] = triangle_idx;
+            });
+        }
+
+        const auto mesh_flags = mesh_surface_flags(*scene_ptr);
+
+        cell_offsets.resize(cell_count() + 1);
+        for (std::size_t cell_idx = 0; cell_idx < cell_count(); ++cell_idx) {
+            cell_offsets[cell_idx] = triangle_packs.size();
+
+            const std::size_t begin = triangle_offsets[cell_idx];
+            const std::size_t end = triangle_offsets[cell_idx + 1];
+            append_packets(triangle_packs, *scene_ptr, triangle_refs, mesh_flags, std::span(cell_triangles).subspan(begin, end - begin));
+        }
+        cell_offsets[cell_count()] = triangle_packs.size();
+    }
+
+    // Steps through the cells pierced by the ray, front to back, and calls
+    // visit(cell index, t_exit) for each of them, where t_exit is where the ray
+    // leaves the cell. Stops early once visit returns true.
+    template <typename V>
+    constexpr void traverse(const ray3<F>& ray, const F max_t, V&& visit) const {
+        if (cell_offsets.empty()) {
+            return;
+        }
+
+        const auto box_hit = root_box.intersect(ray);
+        if (!box_hit || max_t < box_hit->t_min) {
+            return;
+        }
+
+        const F t_end = std::min(box_hit->t_max, max_t);
+        const vec3<F> entry = ray.origin + (box_hit->t_min * ray.direction);
+
+        std::array<int, 3> cell;
+        std::array<int, 3> step;
+        std::array<int, 3> out;
+        std::array<F, 3> t_next;
+        std::array<F, 3> t_delta;
+
+        for (std::size_t axis = 0; axis < 3; ++axis) {
+            cell[axis] = to_cell(entry[axis], axis);
+
+            if (ray.direction[axis] > static_cast<F>(0.)) {
+                const F boundary = root_box.min[axis] + static_cast<F>(cell[axis] + 1) * cell_size[axis];
+                step[axis] = 1;
+                out[axis] = resolution[axis];
+                t_next[axis] = (boundary - ray.origin[axis]) * ray.inv_direction[axis];
+                t_delta[axis] = cell_size[axis] * ray.inv_direction[axis];
+            } else if (ray.direction[axis] < static_cast<F>(0.)) {
+                const F boundary = root_box.min[axis] + static_cast<F>(cell[axis]) * cell_size[axis];
+                step[axis] = -1;
+                out[axis] = -1;
+                t_next[axis] = (boundary - ray.origin[axis]) * ray.inv_direction[axis];
+                t_delta[axis] = -cell_size[axis] * ray.inv_direction[axis];
+            } else {
+                step[axis] = 0;
+                out[axis] = -1;
+                t_next[axis] = MAX_F;
+                t_delta[axis] = MAX_F;
+            }
+        }
+
+        while (true) {
+            std::size_t axis = 0;
+            if (t_next[1] < t_next[axis]) {
+                axis = 1;
+            }
+            if (t_next[2] < t_next[axis]) {
+                axis = 2;
+            }
+
+            const F t_exit = std::min(t_next[axis], t_end);
+            if (visit(cell_index(cell), t_exit)) {
+                return;
+            }
+
+            if (t_end <= t_next[axis]) {
+                return;
+            }
+
+            cell[axis] += step[axis];
+            if (cell[axis] == out[axis]) {
+                return;
+            }
+
+            t_next[axis] += t_delta[axis];
+        }
+    }
+
+    template <ray_type type, bool back_face_culling = true>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect(const ray3<F>& ray) const noexcept {
+        return primitives.template closest_hit<type, back_face_culling>(*scene_ptr, ray, intersect_triangles<type, back_face_culling>(ray));
+    }
+
+    [[nodiscard]] constexpr bool occluded(const ray3<F>& ray, const F max_t) const noexcept {
+        return primitives.occluded(ray, max_t) || occluded_triangles(ray, max_t);
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect_triangles(const ray3<F>& ray) const noexcept {
+        std::optional<hit_candidate> closest_hit;
+
+        // A triangle overlapping several cells may be hit behind the current
+        // cell, such a hit is kept but only accepted as the closest one once
+        // the traversal has passed it.
+        traverse(ray, MAX_F, [&](const std::size_t cell_idx, const F t_exit) {
+            const auto new_hit_candidate = intersect_cell<type, back_face_culling>(ray, cell_idx);
+
+            if (new_hit_candidate && (!closest_hit || new_hit_candidate->t < closest_hit->t)) {
+                closest_hit = new_hit_candidate;
+            }
+
+            return closest_hit && closest_hit->t <= t_exit;
+        });
+
+        if (!closest_hit) {
+            return std::nullopt;
+        }
+
+        const auto& pack = triangle_packs[closest_hit->pack_idx];
+
+        return make_triangle_hit(*scene_ptr, triangle_refs[pack.triangle_indices[closest_hit->lane]], ray, closest_hit->t, closest_hit->u, closest_hit->v);
+    }
+
+    [[nodiscard]] constexpr bool occluded_triangles(const ray3<F>& ray, const F max_t) const noexcept {
+        bool occluded = false;
+
+        traverse(ray, max_t, [&](const std::size_t cell_idx, const F) {
+            for (std::size_t pack_idx = cell_offsets[cell_idx]; pack_idx < cell_offsets[cell_idx + 1]; ++pack_idx) {
+                const auto& pack = triangle_packs[pack_idx];
+
+                if (stdx::none_of(pack.visible_to[std::to_underlying(ray_type::shadow)])) {
+                    continue;
+                }
+
+                if (stdx::any_of(hits_within<F, eps>(pack, ray, max_t))) {
+                    occluded = true;
+                    break;
+                }
+            }
+
+            return occluded;
+        });
+
+        return occluded;
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit_candidate> intersect_cell(const ray3<F>& ray, const std::size_t cell_idx) const noexcept {
+        std::optional<hit_candidate> closest_hit;
+
+        for (std::size_t pack_idx = cell_offsets[cell_idx]; pack_idx < cell_offsets[cell_idx + 1]; ++pack_idx) {
+            const auto& pack = triangle_packs[pack_idx];
+
+            if (stdx::none_of(pack.visible_to[std::to_underlying(type)])) {
+                continue;
+            }
+
+            intersect_closest<type, back_face_culling, F, eps>(pack, pack_idx, ray, closest_hit);
+        }
+
+        return closest_hit;
+    }
+};
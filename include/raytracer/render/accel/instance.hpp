@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/render/accel/accel.hpp>
+#include <raytracer/render/accel/kd_tree_simd.hpp>
+#include <raytracer/render/accel/primitives.hpp>
+#include <raytracer/scene/scene.hpp>
+#include <raytracer/utils/fixed_stack.hpp>
+
+// Two-level acceleration structure: every mesh gets its own bottom level
+// structure B, built once over the mesh's triangles, and a small top level BVH
+// over the placements of the meshes (each mesh itself and all of its
+// instances) selects the bottom levels a ray has to visit. Instanced rays are
+// transformed into the mesh's space instead of duplicating the triangles. The
+// analytic primitives are tested at the top level, next to the BVH.
+template <typename F, F eps, typename B = kd_tree_simd_accel<F, eps>>
+requires accelerator<B, F>
+struct instance_accel {
+    static constexpr std::size_t EMPTY = std::numeric_limits<std::size_t>::max();
+    static constexpr std::size_t MAX_LEAF_SIZE = 2;
+    // The median splits halve the placements at every level, so the tree
+    // has fewer levels than a placement count has bits, and the traversal
+    // keeps at most one child per level plus both children of the last node.
+    static constexpr std::size_t TRAVERSAL_STACK_SIZE = std::numeric_limits<std::size_t>::digits + 1;
+
+    struct placement {
+        std::size_t mesh_idx;
+        std::size_t instance_idx;
+        aabb3<F> box;
+    };
+
+    // The right child of an inner node is at `offset`, the left one directly
+    // after the node. Leaves hold the placements [offset, offset + count).
+    struct node {
+        aabb3<F> box;
+        std::size_t offset;
+        std::size_t count;
+    };
+
+    struct stack_entry {
+        std::size_t node_idx;
+        F t_min;
+    };
+
+    std::shared_ptr<const scene<F>> scene_ptr;
+    std::vector<surface_flags> mesh_flags;
+    std::vector<B> bottom_levels;
+    std::vector<placement> placements;
+    std::vector<node> tree;
+    primitive_set<F, eps> primitives;
+
+    constexpr instance_accel(std::shared_ptr<const scene<F>> scene_ptr) : scene_ptr(std::move(scene_ptr)) {
+        bottom_levels.reserve(this->scene_ptr->meshes.size());
+        for (std::size_t mesh_idx = 0; mesh_idx < this->scene_ptr->meshes.size(); ++mesh_idx) {
+            const std::array<std::size_t, 1> mesh_indices{mesh_idx};
+            bottom_levels.emplace_back(this->scene_ptr, mesh_indices);
+        }
+
+        build_top_level();
+    }
+
+    // Updates (or rebuilds, if B can't be updated) the bottom levels of the
+    // changed meshes and rebuilds the top level, the other bottom levels are
+    // kept as they are and only switched to the new scene, so that the old
+    // one isn't kept alive and their hits read the new materials. The new
+    // scene must have the same meshes (apart from the changed ones) as the
+    // one the structure was built for, the instances may differ.
+    constexpr void update(std::shared_ptr<const scene<F>> new_scene_ptr, std::span<const std::size_t> changed_meshes) {
+        scene_ptr = std::move(new_scene_ptr);
+
+        for (auto& bottom_level : bottom_levels) {
+            bottom_level.scene_ptr = scene_ptr;
+        }
+
+        for (const std::size_t mesh_idx : changed_meshes) {
+            if constexpr (requires { bottom_levels[mesh_idx].update(scene_ptr); }) {
+                bottom_levels[mesh_idx].update(scene_ptr);
+            } else {
+                const std::array<std::size_t, 1> mesh_indices{mesh_idx};
+                bottom_levels[mesh_idx] = B(scene_ptr, mesh_indices);
+            }
+        }
+
+        build_top_level();
+    }
+
+    constexpr void build_top_level() {
+        const auto& scene = *scene_ptr;
+
+        mesh_flags = mesh_surface_flags(scene);
+        primitives = primitive_set<F, eps>(scene);
+
+        placements.clear();
+        for (std::size_t mesh_idx = 0; mesh_idx < scene.meshes.size(); ++mesh_idx) {
+            placements.push_back({mesh_idx, EMPTY, scene.meshes[mesh_idx].box});
+        }
+
+        for (std::size_t instance_idx = 0; instance_idx < scene.instances.size(); ++instance_idx) {
+            const auto& instance = scene.instances[instance_idx];
+            placements.push_back({instance.mesh_idx, instance_idx, instance.box_to_world(scene.meshes[instance.mesh_idx].box)});
+        }
+
+        tree.clear();
+        if (!placements.empty()) {
+            build_node(0, placements.size());
+        }
+    }
+
+    constexpr std::size_t build_node(const std::size_t begin, const std::size_t end) {
+        aabb3<F> box;
+        aabb3<F> centroid_box;
+        for (std::size_t i = begin; i < end; ++i) {
+            box.unite(placements[i].box);
+            centroid_box.expand(centroid(placements[i].box));
+        }
+
+        const std::size_t node_idx = tree.size();
+        tree.push_back({box, begin, end - begin});
+
+        if (end - begin <= MAX_LEAF_SIZE) {
+            return node_idx;
+        }
+
+        const vec3<F> extent = centroid_box.max - centroid_box.min;
+        std::size_t axis = 0;
+        if (extent[axis] < extent.y) {
+            axis = 1;
+        }
+        if (extent[axis] < extent.z) {
+            axis = 2;
+        }
+
+        const std::size_t mid = begin + (end - begin) / 2;
+        std::nth_element(placements.begin() + begin, placements.begin() + mid, placements.begin() + end, [&](const auto& lhs, const auto& rhs) {
+            return centroid(lhs.box)[axis] < centroid(rhs.box)[axis];
+        });
+
+        build_node(begin, mid);
+        const std::size_t right_idx = build_node(mid, end);
+
+        tree[node_idx].offset = right_idx;
+        tree[node_idx].count = 0;
+
+        return node_idx;
+    }
+
+    [[nodiscard]] static constexpr vec3<F> centroid(const aabb3<F>& box) noexcept {
+        return static_cast<F>(.5) * (box.min + box.max);
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect_placement(const ray3<F>& ray, const placement& current) const noexcept {
+        if (!mesh_flags[current.mesh_idx].visible(type)) {
+            return std::nullopt;
+        }
+
+        const auto& bottom_level = bottom_levels[current.mesh_idx];
+
+        if (current.instance_idx == EMPTY) {
+            return bottom_level.template intersect<type, back_face_culling>(ray);
+        }
+
+        const auto& instance = scene_ptr->instances[current.instance_idx];
+        const ray3<F> object_ray = instance.ray_to_object(ray);
+
+        // A mirroring transform flips the winding of the triangles, so the
+        // object space culling would drop the front faces instead. Such
+        // instances are traced without culling and their normals are flipped
+        // to match the world space winding.
+        const bool mirrored = instance.mirrored();
+        auto maybe_hit = mirrored
+            ? bottom_level.template intersect<type, false>(object_ray)
+            : bottom_level.template intersect<type, back_face_culling>(object_ray);
+
+        if (maybe_hit) {
+            const F normal_sign = mirrored ? static_cast<F>(-1.) : static_cast<F>(1.);
+
+            maybe_hit->ray = ray;
+            maybe_hit->position = ray.origin + (maybe_hit->distance * ray.direction);
+            maybe_hit->hit_normal = normal_sign * instance.normal_to_world(maybe_hit->hit_normal);
+            maybe_hit->face_normal = normal_sign * instance.normal_to_world(maybe_hit->face_normal);
+        }
+
+        return maybe_hit;
+    }
+
+    template <ray_type type, bool back_face_culling = true>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect(const ray3<F>& ray) const noexcept {
+        return primitives.template closest_hit<type, back_face_culling>(*scene_ptr, ray, intersect_placements<type, back_face_culling>(ray));
+    }
+
+    [[nodiscard]] constexpr bool occluded(const ray3<F>& ray, const F max_t) const noexcept {
+        return primitives.occluded(ray, max_t) || occluded_placements(ray, max_t);
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect_placements(const ray3<F>& ray) const noexcept {
+        std::optional<hit<F>> closest_hit;
+
+        if (tree.empty() || !tree[0].box.intersect(ray)) {
+            return std::nullopt;
+        }
+
+        fixed_stack<stack_entry, TRAVERSAL_STACK_SIZE> nodes_to_check;
+        nodes_to_check.push({0, static_cast<F>(0.)});
+
+        while (!nodes_to_check.empty()) {
+            const auto entry = nodes_to_check.top();
+            nodes_to_check.pop();
+
+            if (closest_hit && closest_hit->distance < entry.t_min) {
+                continue;
+            }
+
+            const auto& current = tree[entry.node_idx];
+
+            if (current.count != 0) {
+                for (std::size_t i = current.offset; i < current.offset + current.count; ++i) {
+                    const auto maybe_hit = intersect_placement<type, back_face_culling>(ray, placements[i]);
+
+                    if (maybe_hit && (!closest_hit || maybe_hit->distance < closest_hit->distance)) {
+                        closest_hit = maybe_hit;
+                    }
+                }
+
+                continue;
+            }
+
+            const std::size_t left_idx = entry.node_idx + 1;
+            const std::size_t right_idx = current.offset;
+            const auto left_hit = tree[left_idx].box.intersect(ray);
+            const auto right_hit = tree[right_idx].box.intersect(ray);
+
+            // Push the farther child first, so the nearer one is visited first.
+            if (left_hit && right_hit) {
+                if (left_hit->t_min < right_hit->t_min) {
+                    nodes_to_check.push({right_idx, right_hit->t_min});
+                    nodes_to_check.push({left_idx, left_hit->t_min});
+                } else {
+                    nodes_to_check.push({left_idx, left_hit->t_min});
+                    nodes_to_check.push({right_idx, right_hit->t_min});
+                }
+            } else if (left_hit) {
+                nodes_to_check.push({left_idx, left_hit->t_min});
+            } else if (right_hit) {
+                nodes_to_check.push({right_idx, right_hit->t_min});
+            }
+        }
+
+        return closest_hit;
+    }
+
+    [[nodiscard]] constexpr bool occluded_placements(const ray3<F>& ray, const F max_t) const noexcept {
+        if (tree.empty()) {
+            return false;
+        }
+
+        fixed_stack<std::size_t, TRAVERSAL_STACK_SIZE> nodes_to_check;
+        nodes_to_check.push(0);
+
+        while (!nodes_to_check.empty()) {
+            const std::size_t node_idx = nodes_to_check.top();
+            nodes_to_check.pop();
+
+            const auto& current = tree[node_idx];
+
+            const auto box_hit = current.box.intersect(ray);
+            if (!box_hit || max_t < box_hit->t_min) {
+                continue;
+            }
+
+            if (current.count == 0) {
+                nodes_to_check.push(node_idx + 1);
+                nodes_to_check.push(current.offset);
+                continue;
+            }
+
+            for (std::size_t i = current.offset; i < current.offset + current.count; ++i) {
+                if (occluded_placement(ray, placements[i], max_t)) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    [[nodiscard]] constexpr bool occluded_placement(const ray3<F>& ray, const placement& current, const F max_t) const noexcept {
+        if (!mesh_flags[current.mesh_idx].visible(ray_type::shadow)) {
+            return false;
+        }
+
+        const auto& bottom_level = bottom_levels[current.mesh_idx];
+
+        if (current.instance_idx == EMPTY) {
+            return bottom_level.occluded(ray, max_t);
+        }
+
+        return bottom_level.occluded(scene_ptr->instances[current.instance_idx].ray_to_object(ray), max_t);
+    }
+};
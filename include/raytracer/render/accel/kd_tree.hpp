@@ -1,16 +1,24 @@
 #pragma once
 
+#include <cstdint>
+#include <future>
 #include <memory>
-#include <stack>
+#include <span>
 #include <optional>
 
 #include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/render/accel/accel.hpp>
+#include <raytracer/render/accel/build.hpp>
+#include <raytracer/render/accel/mailbox.hpp>
+#include <raytracer/render/accel/primitives.hpp>
 #include <raytracer/scene/scene.hpp>
+#include <raytracer/utils/fixed_stack.hpp>
 
 template <typename F,
           F eps,
           std::size_t max_depth = 8,
-          std::size_t max_primitive_count = 16>
+          std::size_t max_primitive_count = 16,
+          bool mailboxing = true>
 struct kd_tree_accel {
     struct kd_tree_node {
         std::size_t parent;
@@ -25,77 +33,171 @@ struct kd_tree_accel {
 
     static constexpr std::size_t EMPTY = std::numeric_limits<std::size_t>::max();
 
+    // The leaves are at most max_depth levels below the root, and the
+    // traversal keeps at most one child of each level on its stack, plus both
+    // children of the last node it opened.
+    static constexpr std::size_t TRAVERSAL_STACK_SIZE = max_depth + 1;
+
+    // Nodes and leaf indices of a (sub)tree built by a single task. The
+    // indices in it are local, until the subtree is spliced into its
+    // parent's.
+    struct subtree {
+        std::vector<kd_tree_node> nodes;
+        std::vector<std::uint32_t> leaf_indices;
+
+        constexpr std::size_t splice(subtree&& other, const std::size_t parent_idx) {
+            const std::size_t node_offset = nodes.size();
+            const std::size_t leaf_offset = leaf_indices.size();
+
+            for (auto current : other.nodes) {
+                current.parent = current.parent == EMPTY ? parent_idx : current.parent + node_offset;
+
+                if (current.child0 != EMPTY) {
+                    current.child0 += node_offset;
+                }
+
+                if (current.child1 != EMPTY) {
+                    current.child1 += node_offset;
+                }
+
+                if (current.start_idx != EMPTY) {
+                    current.start_idx += leaf_offset;
+                }
+
+                nodes.push_back(current);
+            }
+
+            leaf_indices.insert(leaf_indices.end(), other.leaf_indices.begin(), other.leaf_indices.end());
+
+            return node_offset;
+        }
+    };
+
     std::shared_ptr<const scene<F>> scene_ptr;
+    std::vector<surface_flags> mesh_flags;
+    // Only the intersection data of the triangles, with the references
+    // into the scene's meshes for the shading attributes of the hits.
     std::vector<triangle<F>> triangles;
+    std::vector<triangle_ref> triangle_refs;
     std::vector<kd_tree_node> tree;
-    std::vector<std::size_t> leaf_indices;
+    std::vector<std::uint32_t> leaf_indices;
+    scalar_primitive_set<F, eps> primitives;
 
     constexpr kd_tree_accel(std::shared_ptr<const scene<F>> scene_ptr) noexcept
-        : scene_ptr(std::move(scene_ptr)) {
+        : scene_ptr(std::move(scene_ptr)), mesh_flags(mesh_surface_flags(*this->scene_ptr)), primitives(*this->scene_ptr) {
+        const auto& scene = *this->scene_ptr;
+
         aabb3<F> root_box;
-        std::vector<std::size_t> triangle_indices;
-        for (const auto& mesh : this->scene_ptr->meshes) {
+        for (const auto& mesh : scene.meshes) {
             root_box.unite(mesh.box);
+        }
 
-            const std::size_t start_idx = triangles.size();
-            triangles.insert(triangles.end(), mesh.triangles.begin(), mesh.triangles.end());
-            for (std::size_t i = 0; i < mesh.triangles.size(); ++i) {
-                triangle_indices.push_back(start_idx + i);
-            }
+        triangle_refs = gather_triangle_refs(scene, all_mesh_indices(scene));
+
+        // The boxes are only needed while building.
+        std::vector<aabb3<F>> triangle_boxes;
+        std::vector<std::uint32_t> triangle_indices;
+        triangles.reserve(triangle_refs.size());
+        triangle_boxes.reserve(triangle_refs.size());
+        triangle_indices.reserve(triangle_refs.size());
+        for (const auto ref : triangle_refs) {
+            triangle_indices.push_back(static_cast<std::uint32_t>(triangles.size()));
+            triangles.push_back(triangle_at(scene, ref));
+            triangle_boxes.push_back(triangle_box(scene, ref));
         }
 
-        tree.emplace_back(EMPTY, root_box, EMPTY, EMPTY, EMPTY, 0);
-        build_tree(0, 0, triangle_indices);
+        index_arena arena(triangle_indices);
+        subtree root;
+        root.nodes.emplace_back(EMPTY, root_box, EMPTY, EMPTY, EMPTY, 0);
+        build_tree(root, 0, 0, triangle_boxes, arena, {0, triangle_indices.size()}, parallel_build_depth());
+
+        tree = std::move(root.nodes);
+        leaf_indices = std::move(root.leaf_indices);
     }
 
-    constexpr void build_tree(const std::size_t parent_idx, const std::size_t depth, const std::vector<std::size_t>& triangle_indices) {
-        if (depth == max_depth || triangle_indices.size() <= max_primitive_count) {
-            tree[parent_idx].start_idx = leaf_indices.size();
-            leaf_indices.insert(leaf_indices.end(), triangle_indices.begin(), triangle_indices.end());
-            tree[parent_idx].count = leaf_indices.size() - tree[parent_idx].start_idx;
+    // Builds the subtree below out.nodes[parent_idx] from the index list in
+    // the given arena range. While fork_depth is non-zero, the second child
+    // is built as a separate task into its own subtree and arena, and both
+    // children are then spliced in order, so the result is identical to a
+    // serial depth-first build.
+    constexpr void build_tree(subtree& out, const std::size_t parent_idx, const std::size_t depth, std::span<const aabb3<F>> triangle_boxes, index_arena& arena, const index_range range, const std::size_t fork_depth) const {
+        if (depth == max_depth || range.size() <= max_primitive_count) {
+            const auto triangle_indices = arena.view(range);
+            out.nodes[parent_idx].start_idx = out.leaf_indices.size();
+            out.leaf_indices.insert(out.leaf_indices.end(), triangle_indices.begin(), triangle_indices.end());
+            out.nodes[parent_idx].count = out.leaf_indices.size() - out.nodes[parent_idx].start_idx;
             return;
         }
 
-        auto [aabb0, aabb1] = tree[parent_idx].box.split(depth % 3);
+        auto [aabb0, aabb1] = out.nodes[parent_idx].box.split(depth % 3);
 
-        std::vector<std::size_t> child0_triangle_indices;
-        child0_triangle_indices.reserve(triangle_indices.size());
+        const std::size_t arena_mark = arena.mark();
 
-        std::vector<std::size_t> child1_triangle_indices;
-        child1_triangle_indices.reserve(triangle_indices.size());
+        const index_range child0_range = arena.push_filtered(range, [&](const std::size_t triangle_idx) {
+            return aabb0.intersect(triangle_boxes[triangle_idx]);
+        });
 
-        for (const auto& triangle_idx : triangle_indices) {
-            const auto& triangle = triangles[triangle_idx];
+        const index_range child1_range = arena.push_filtered(range, [&](const std::size_t triangle_idx) {
+            return aabb1.intersect(triangle_boxes[triangle_idx]);
+        });
 
-            if (aabb0.intersect(triangle.box)) {
-                child0_triangle_indices.push_back(triangle_idx);
-            }
+        if (fork_depth != 0 && child0_range.size() != 0 && child1_range.size() != 0 &&
+            PARALLEL_BUILD_MIN_TRIANGLES <= std::min(child0_range.size(), child1_range.size())) {
+            index_arena child1_arena(arena.view(child1_range));
 
-            if (aabb1.intersect(triangle.box)) {
-                child1_triangle_indices.push_back(triangle_idx);
-            }
+            auto child1_future = std::async(std::launch::async, [&, aabb1, child1_arena = std::move(child1_arena)]() mutable {
+                subtree child1;
+                child1.nodes.emplace_back(EMPTY, aabb1, EMPTY, EMPTY, EMPTY, 0);
+                build_tree(child1, 0, depth + 1, triangle_boxes, child1_arena, {0, child1_arena.buffer.size()}, fork_depth - 1);
+                return child1;
+            });
+
+            subtree child0;
+            child0.nodes.emplace_back(EMPTY, aabb0, EMPTY, EMPTY, EMPTY, 0);
+            build_tree(child0, 0, depth + 1, triangle_boxes, arena, child0_range, fork_depth - 1);
+
+            out.nodes[parent_idx].child0 = out.splice(std::move(child0), parent_idx);
+            out.nodes[parent_idx].child1 = out.splice(child1_future.get(), parent_idx);
+
+            arena.release(arena_mark);
+            return;
         }
 
-        if (!child0_triangle_indices.empty()) {
-            const std::size_t child0_idx = tree.size();
-            tree.emplace_back(parent_idx, aabb0, EMPTY, EMPTY, EMPTY, 0);
-            tree[parent_idx].child0 = child0_idx;
-            build_tree(child0_idx, depth + 1, child0_triangle_indices);
+        if (child0_range.size() != 0) {
+            const std::size_t child0_idx = out.nodes.size();
+            out.nodes.emplace_back(parent_idx, aabb0, EMPTY, EMPTY, EMPTY, 0);
+            out.nodes[parent_idx].child0 = child0_idx;
+            build_tree(out, child0_idx, depth + 1, triangle_boxes, arena, child0_range, fork_depth);
         }
 
-        if (!child1_triangle_indices.empty()) {
-            const std::size_t child1_idx = tree.size();
-            tree.emplace_back(parent_idx, aabb1, EMPTY, EMPTY, EMPTY, 0);
-            tree[parent_idx].child1 = child1_idx;
-            build_tree(child1_idx, depth + 1, child1_triangle_indices);
+        if (child1_range.size() != 0) {
+            const std::size_t child1_idx = out.nodes.size();
+            out.nodes.emplace_back(parent_idx, aabb1, EMPTY, EMPTY, EMPTY, 0);
+            out.nodes[parent_idx].child1 = child1_idx;
+            build_tree(out, child1_idx, depth + 1, triangle_boxes, arena, child1_range, fork_depth);
         }
+
+        arena.release(arena_mark);
     }
 
-    template <bool backface_culling>
+    template <ray_type type, bool back_face_culling = true>
     constexpr std::optional<hit<F>> intersect(const ray3<F>& ray) const {
+        return primitives.template closest_hit<type, back_face_culling>(*scene_ptr, ray, intersect_triangles<type, back_face_culling>(ray));
+    }
+
+    constexpr bool occluded(const ray3<F>& ray, const F max_t) const {
+        return primitives.occluded(*scene_ptr, ray, max_t) || occluded_triangles(ray, max_t);
+    }
+
+    template <ray_type type, bool back_face_culling>
+    constexpr std::optional<hit<F>> intersect_triangles(const ray3<F>& ray) const {
         std::optional<hit<F>> closest_hit;
 
-        std::stack<std::size_t, std::vector<std::size_t>> nodes_to_check;
+        // Triangles straddling a split are in several leaves, but have to be
+        // tested only once.
+        mailbox_type<mailboxing> tested_triangles;
+
+        fixed_stack<std::size_t, TRAVERSAL_STACK_SIZE> nodes_to_check;
         nodes_to_check.push(0);
 
         while (!nodes_to_check.empty()) {
@@ -123,36 +225,19 @@ struct kd_tree_accel {
                 }
             } else {
                 for (std::size_t triangle_idx = node.start_idx; triangle_idx < node.start_idx + node.count; ++triangle_idx) {
+                    const auto flags = mesh_flags[triangle_refs[leaf_indices[triangle_idx]].mesh_idx];
+                    if (!flags.visible(type) || tested_triangles.tested(leaf_indices[triangle_idx])) {
+                        continue;
+                    }
+
                     const auto& triangle = triangles[leaf_indices[triangle_idx]];
 
-                    const auto maybe_hit = triangle.template intersect<backface_culling, eps>(ray);
+                    const auto maybe_hit = back_face_culling && flags.back_face_culling
+                        ? triangle.template intersect<true, eps>(ray)
+                        : triangle.template intersect<false, eps>(ray);
 
                     if (maybe_hit && (!closest_hit || maybe_hit->distance < closest_hit->distance)) {
-                        const auto& mesh = scene_ptr->meshes[triangle.mesh_idx];
-
-                        const auto& v0_normal = mesh.vertex_normals[triangle.vertex_indices[0]];
-                        const auto& v1_normal = mesh.vertex_normals[triangle.vertex_indices[1]];
-                        const auto& v2_normal = mesh.vertex_normals[triangle.vertex_indices[2]];
-
-                        const F u = maybe_hit->u;
-                        const F v = maybe_hit->v;
-                        const F w = static_cast<F>(1.) - u - v;
-                        const vec3<F> hit_normal = u * v1_normal + v * v2_normal + w * v0_normal;
-
-                        const vec3<F> hit_position = ray.origin + (maybe_hit->distance * ray.direction);
-
-                        closest_hit = hit<F>{
-                            ray,
-                            hit_position,
-                            hit_normal,
-                            triangle.normal,
-                            triangle.uvs,
-                            maybe_hit->distance,
-                            u,
-                            v,
-                            w,
-                            triangle.mesh_idx
-                        };
+                        closest_hit = make_triangle_hit(*scene_ptr, triangle_refs[leaf_indices[triangle_idx]], ray, maybe_hit->distance, maybe_hit->u, maybe_hit->v);
                     }
                 }
             }
@@ -160,4 +245,48 @@ struct kd_tree_accel {
 
         return closest_hit;
     }
+
+    constexpr bool occluded_triangles(const ray3<F>& ray, const F max_t) const {
+        mailbox_type<mailboxing> tested_triangles;
+
+        fixed_stack<std::size_t, TRAVERSAL_STACK_SIZE> nodes_to_check;
+        nodes_to_check.push(0);
+
+        while (!nodes_to_check.empty()) {
+            const auto node_idx = nodes_to_check.top();
+            nodes_to_check.pop();
+
+            const auto& node = tree[node_idx];
+
+            const auto maybe_box_hit = node.box.intersect(ray);
+            if (!maybe_box_hit || max_t < maybe_box_hit->t_min) {
+                continue;
+            }
+
+            if (node.start_idx == EMPTY) {
+                if (node.child0 != EMPTY) {
+                    nodes_to_check.push(node.child0);
+                }
+
+                if (node.child1 != EMPTY) {
+                    nodes_to_check.push(node.child1);
+                }
+            } else {
+                for (std::size_t triangle_idx = node.start_idx; triangle_idx < node.start_idx + node.count; ++triangle_idx) {
+                    if (!mesh_flags[triangle_refs[leaf_indices[triangle_idx]].mesh_idx].visible(ray_type::shadow) || tested_triangles.tested(leaf_indices[triangle_idx])) {
+                        continue;
+                    }
+
+                    const auto& triangle = triangles[leaf_indices[triangle_idx]];
+                    const auto maybe_hit = triangle.template intersect<false, eps>(ray);
+
+                    if (maybe_hit && maybe_hit->distance < max_t) {
+                        return true;
+                    }
+                }
+            }
+        }
+
+        return false;
+    }
 };
@@ -1,301 +1,1228 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <memory>
 #include <stack>
 #include <optional>
 #include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <future>
+#include <numeric>
+#include <span>
+#include <utility>
 
 #include <experimental/simd>
 
 #include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/core/math/frustum3.hpp>
+#include <raytracer/core/math/ray_packet.hpp>
+#include <raytracer/io/binary/binary.hpp>
+#include <raytracer/render/accel/accel.hpp>
+#include <raytracer/render/accel/build.hpp>
+#include <raytracer/render/accel/mailbox.hpp>
+#include <raytracer/render/accel/packet_formats.hpp>
+#include <raytracer/render/accel/primitives.hpp>
+#include <raytracer/render/accel/stats.hpp>
 #include <raytracer/scene/scene.hpp>
+#include <raytracer/utils/fixed_stack.hpp>
+#include <raytracer/utils/hash.hpp>
 
 namespace stdx = std::experimental;
 
-template <typename F, std::size_t W>
-struct triangle_packet {
+template <typename F,
+          F eps,
+          std::size_t max_depth = 32,
+          std::size_t max_leaf_size = stdx::native_simd<F>::size(),
+          std::size_t W = stdx::native_simd<F>::size(),
+          bool mailboxing = false,
+          template <typename, std::size_t> typename L = triangle_packet>
+struct kd_tree_simd_accel {
     using simd_f = stdx::fixed_size_simd<F, W>;
     using simd_f_mask = simd_f::mask_type;
-    
-    simd_f v0x, v0y, v0z;
-    simd_f e1x, e1y, e1z;
-    simd_f e2x, e2y, e2z;
-    std::array<std::size_t, W> triangle_indices;
 
-    template <bool backface_culling, F eps>
-    constexpr simd_f_mask intersect(const ray3<F>& ray, simd_f& t, simd_f& u, simd_f& v) const noexcept {
-        const simd_f pvec_x = ray.direction.y * e2z - ray.direction.z * e2y;
-        const simd_f pvec_y = ray.direction.z * e2x - ray.direction.x * e2z;
-        const simd_f pvec_z = ray.direction.x * e2y - ray.direction.y * e2x;
+    // The leaf packet format, i.e. the intersection kernel: triangle_packet
+    // (Möller-Trumbore), woop_triangle_packet or plucker_triangle_packet.
+    using leaf_packet = L<F, W>;
 
-        const simd_f det = e1x * pvec_x + e1y * pvec_y + e1z * pvec_z;
+    // Mailboxing is off by default: a duplicated triangle shares its packet
+    // with different triangles in every leaf, so whole packets can rarely be
+    // skipped and the W lookups per packet cost more than they save.
+    using triangle_mailbox = mailbox_type<mailboxing>;
 
-        simd_f_mask mask{true};
-        if constexpr (backface_culling) {
-            mask = eps <= det;
-        } else {
-            mask = eps <= stdx::abs(det);
-        }
+    static constexpr F MAX_F = std::numeric_limits<F>::max();
 
-        const simd_f inv_det = static_cast<F>(1.) / det;
+    // Relative costs used by the surface area heuristic. The intersection
+    // cost is per packet, as a leaf always tests whole packets of W
+    // triangles. Splits which cut off an empty child get their cost scaled
+    // by EMPTY_SPACE_BONUS, so that empty space is carved off early.
+    static constexpr std::size_t SAH_BINS = 32;
+    static constexpr F TRAVERSAL_COST = static_cast<F>(1.);
+    static constexpr F PACKET_INTERSECTION_COST = static_cast<F>(1.5);
+    static constexpr F EMPTY_SPACE_BONUS = static_cast<F>(0.8);
+
+    // A refitted tree is kept by update as long as its SAH cost stays within
+    // this factor of the cost right after the last full build.
+    static constexpr F REFIT_MAX_COST_RATIO = static_cast<F>(1.25);
+
+    // A kd-tree node packed into the split position (or the packet count
+    // of a leaf) and 32 bits of flags, i.e. 8 bytes for floats. The low two
+    // bits of the flags hold the split axis, or LEAF, and the remaining bits
+    // hold the index of the child above the split plane (the child below is
+    // always stored right after its parent), or the first packet of a leaf.
+    struct node {
+        static constexpr uint32_t LEAF = 3;
+        static constexpr std::size_t MAX_OFFSET = std::numeric_limits<uint32_t>::max() >> 2;
 
-        const simd_f tvec_x{ray.origin.x - v0x};
-        const simd_f tvec_y{ray.origin.y - v0y};
-        const simd_f tvec_z{ray.origin.z - v0z};
+        union {
+            F split = static_cast<F>(0.);
+            uint32_t pack_count;
+        };
+        uint32_t flags = LEAF;
 
-        u = (tvec_x * pvec_x + tvec_y * pvec_y + tvec_z * pvec_z) * inv_det;
-        mask &= (static_cast<F>(0.) <= u) & (u <= static_cast<F>(1.));
+        [[nodiscard]] static constexpr node make_leaf(const std::size_t first_pack, const std::size_t pack_count) noexcept {
+            assert(first_pack <= MAX_OFFSET);
 
-        const simd_f qvec_x = tvec_y * e1z - tvec_z * e1y;
-        const simd_f qvec_y = tvec_z * e1x - tvec_x * e1z;
-        const simd_f qvec_z = tvec_x * e1y - tvec_y * e1x;
+            node leaf;
+            leaf.pack_count = static_cast<uint32_t>(pack_count);
+            leaf.flags = (static_cast<uint32_t>(first_pack) << 2) | LEAF;
+            return leaf;
+        }
 
-        v = (ray.direction.x * qvec_x + ray.direction.y * qvec_y + ray.direction.z * qvec_z) * inv_det;
-        mask &= (static_cast<F>(0.) <= v) & (u + v <= static_cast<F>(1.));
+        [[nodiscard]] static constexpr node make_inner(const uint32_t axis, const F split) noexcept {
+            node inner;
+            inner.split = split;
+            inner.flags = axis;
+            return inner;
+        }
 
-        t = (e2x * qvec_x + e2y * qvec_y + e2z * qvec_z) * inv_det;
-        mask &= (eps < t);
+        constexpr void set_offset(const std::size_t offset) noexcept {
+            assert(offset <= MAX_OFFSET);
+            flags = (static_cast<uint32_t>(offset) << 2) | (flags & 3u);
+        }
 
-        return mask;
-    }
-};
+        [[nodiscard]] constexpr bool is_leaf() const noexcept {
+            return (flags & 3u) == LEAF;
+        }
 
-template <typename F,
-          F eps,
-          std::size_t max_depth = 8,
-          std::size_t max_leaf_size = 64,
-          std::size_t W = stdx::native_simd<F>::size()>
-struct kd_tree_simd_accel {
-    using simd_f = stdx::fixed_size_simd<F, W>;
-    using simd_f_mask = simd_f::mask_type;
+        [[nodiscard]] constexpr uint32_t axis() const noexcept {
+            return flags & 3u;
+        }
 
-    static constexpr std::size_t EMPTY = std::numeric_limits<std::size_t>::max();
-    static constexpr F MAX_F = std::numeric_limits<F>::max();
+        [[nodiscard]] constexpr std::size_t offset() const noexcept {
+            return flags >> 2;
+        }
+    };
 
-    struct node {
-        std::size_t parent;
+    struct traversal_entry {
+        std::size_t node_idx;
+        F t_min;
+        F t_max;
+    };
 
+    // Where the traversal of a ray starts: a node and the box of its cell.
+    struct traversal_root {
+        std::size_t node_idx;
         aabb3<F> box;
-        std::size_t child0;
-        std::size_t child1;
+    };
+
+    using hit_candidate = packet_hit_candidate<F>;
 
-        std::size_t start_idx;
-        std::size_t pack_count;
+    struct split_candidate {
+        uint32_t axis;
+        F position;
+        F cost;
     };
 
-    struct hit_candidate {
-        F t;
-        F u;
-        F v;
+    // Nodes and packets of a (sub)tree built by a single task. The offsets
+    // in it are local, until the subtree is spliced into its parent's.
+    struct subtree {
+        std::vector<node> nodes;
+        std::vector<leaf_packet> packs;
 
-        std::size_t pack_idx;
-        std::size_t lane;
+        constexpr std::size_t splice(subtree&& other) {
+            const std::size_t node_offset = nodes.size();
+            const std::size_t pack_offset = packs.size();
+
+            for (auto current : other.nodes) {
+                current.set_offset(current.offset() + (current.is_leaf() ? pack_offset : node_offset));
+                nodes.push_back(current);
+            }
+
+            packs.insert(packs.end(), other.packs.begin(), other.packs.end());
+
+            return node_offset;
+        }
     };
 
     std::shared_ptr<const scene<F>> scene_ptr;
-    std::vector<triangle<F>> triangles;
+    std::vector<std::size_t> mesh_indices;
+    std::vector<surface_flags> mesh_flags;
+    std::vector<triangle_ref> triangle_refs;
     std::vector<node> tree;
-    std::vector<triangle_packet<F, W>> triangle_packs;
+    std::vector<leaf_packet> triangle_packs;
+    aabb3<F> root_box;
+    F build_cost = static_cast<F>(0.);
 
-    constexpr kd_tree_simd_accel(std::shared_ptr<const scene<F>> scene_ptr) : scene_ptr(std::move(scene_ptr)) {
-        aabb3<F> root_box;
-        std::vector<std::size_t> triangle_indices;
-        for (const auto& mesh : this->scene_ptr->meshes) {
-            root_box.unite(mesh.box);
+    // The scene's analytic primitives, which only the whole scene
+    // constructors gather (so the bottom levels of an instance_accel hold
+    // just their meshes).
+    primitive_set<F, eps> primitives;
+
+    // The triangles' bounding boxes, only kept while (re)building.
+    std::vector<aabb3<F>> triangle_boxes;
+
+    constexpr kd_tree_simd_accel(std::shared_ptr<const scene<F>> scene_ptr)
+        : kd_tree_simd_accel(scene_ptr, all_mesh_indices(*scene_ptr)) {
+        primitives = primitive_set<F, eps>(*this->scene_ptr);
+    }
+
+    // Builds the tree over the given meshes only, e.g. as the bottom level of
+    // an instance_accel.
+    constexpr kd_tree_simd_accel(std::shared_ptr<const scene<F>> scene_ptr, std::span<const std::size_t> mesh_indices)
+        : scene_ptr(std::move(scene_ptr)), mesh_indices(mesh_indices.begin(), mesh_indices.end()) {
+        rebuild();
+    }
+
+    // Like the mesh subset constructor, but reads the tree from the cache
+    // directory if it has a tree for the same triangles and parameters, and
+    // builds the tree and writes it there otherwise. The cache file is named
+    // after the cache key, so different scenes don't overwrite each other.
+    kd_tree_simd_accel(std::shared_ptr<const scene<F>> scene_ptr, std::span<const std::size_t> mesh_indices, const std::filesystem::path& cache_directory)
+        : scene_ptr(std::move(scene_ptr)), mesh_indices(mesh_indices.begin(), mesh_indices.end()) {
+        root_box = gather_triangles();
+
+        const std::uint64_t key = cache_key();
+        const std::filesystem::path cache_path = cache_directory / std::format("{:016x}.kdtree", key);
+
+        if (std::ifstream in(cache_path, std::ios::binary); in && read(in, key)) {
+            return;
+        }
 
-            const std::size_t start_idx = triangles.size();
-            triangles.insert(triangles.end(), mesh.triangles.begin(), mesh.triangles.end());
-            for (std::size_t i = 0; i < mesh.triangles.size(); ++i) {
-                triangle_indices.push_back(start_idx + i);
+        build();
+
+        std::error_code error;
+        std::filesystem::create_directories(cache_directory, error);
+        if (std::ofstream out(cache_path, std::ios::binary); out) {
+            write(out, key);
+        }
+    }
+
+    kd_tree_simd_accel(std::shared_ptr<const scene<F>> scene_ptr, const std::filesystem::path& cache_directory)
+        : kd_tree_simd_accel(scene_ptr, all_mesh_indices(*scene_ptr), cache_directory) {
+        primitives = primitive_set<F, eps>(*this->scene_ptr);
+    }
+
+    // Gathers the references to the triangles of the meshes into
+    // triangle_refs, resolves the meshes' surface flags and returns their
+    // bounding box.
+    constexpr aabb3<F> gather_triangles() {
+        aabb3<F> box;
+        for (const std::size_t mesh_idx : mesh_indices) {
+            box.unite(scene_ptr->meshes[mesh_idx].box);
+        }
+
+        mesh_flags = mesh_surface_flags(*scene_ptr);
+        triangle_refs = gather_triangle_refs(*scene_ptr, mesh_indices);
+
+        return box;
+    }
+
+    constexpr void compute_triangle_boxes() {
+        triangle_boxes.clear();
+        triangle_boxes.reserve(triangle_refs.size());
+        for (const auto ref : triangle_refs) {
+            triangle_boxes.push_back(triangle_box(*scene_ptr, ref));
+        }
+    }
+
+    constexpr void release_triangle_boxes() noexcept {
+        std::vector<aabb3<F>>().swap(triangle_boxes);
+    }
+
+    // Builds the tree from scratch, from the current scene.
+    constexpr void rebuild() {
+        root_box = gather_triangles();
+        build();
+    }
+
+    // Hash of everything the built tree depends on: the tree parameters and
+    // leaf packet format, the gathered triangles' references (as the packets store indices into
+    // them), vertices and their meshes' surface flags, as those are stored
+    // in the packets. The shading attributes are read from the meshes
+    // when building the hits, so they don't matter.
+    [[nodiscard]] std::uint64_t cache_key() const noexcept {
+        content_hasher hasher;
+
+        hasher.add(CACHE_VERSION);
+        hasher.add(sizeof(F));
+        hasher.add(W);
+        hasher.add(max_depth);
+        hasher.add(max_leaf_size);
+        for (const char c : leaf_packet::FORMAT_NAME) {
+            hasher.add(c);
+        }
+        hasher.add(triangle_refs.size());
+
+        for (const auto ref : triangle_refs) {
+            hasher.add(ref.mesh_idx);
+            hasher.add(ref.triangle_idx);
+
+            for (const auto& vertex : triangle_vertices(*scene_ptr, ref)) {
+                hasher.add(vertex.x);
+                hasher.add(vertex.y);
+                hasher.add(vertex.z);
             }
+
+            hasher.add(mesh_flags[ref.mesh_idx].visible_to);
+            hasher.add(mesh_flags[ref.mesh_idx].back_face_culling);
+        }
+
+        return hasher.state;
+    }
+
+    // The cache file holds a header, which has to match exactly (apart from
+    // the checksum of the rest of the file), followed by the root box, the
+    // build cost, the nodes and the packets. The triangles themselves are not
+    // stored, as they are gathered from the scene anyway.
+    struct cache_header {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t float_size;
+        std::uint32_t node_size;
+        std::uint32_t packet_size;
+        std::uint64_t key;
+        std::uint64_t triangle_count;
+        std::uint64_t payload_hash;
+
+        constexpr bool operator==(const cache_header&) const noexcept = default;
+    };
+
+    static constexpr std::array<char, 8> CACHE_MAGIC{'K', 'D', 'S', 'I', 'M', 'D', '\0', '\0'};
+    static constexpr std::uint32_t CACHE_VERSION = 5;
+
+    [[nodiscard]] cache_header make_cache_header(const std::uint64_t key, const std::uint64_t payload_hash) const noexcept {
+        return {CACHE_MAGIC, CACHE_VERSION, sizeof(F), sizeof(node), sizeof(typename leaf_packet::flat), key, triangle_refs.size(), payload_hash};
+    }
+
+    [[nodiscard]] static std::uint64_t payload_hash(const aabb3<F>& box, const F cost, std::span<const node> nodes, std::span<const typename leaf_packet::flat> packs) noexcept {
+        content_hasher hasher;
+        hasher.add_bytes(std::span<const aabb3<F>>(&box, 1));
+        hasher.add(cost);
+        hasher.add_bytes(nodes);
+        hasher.add_bytes(packs);
+
+        return hasher.state;
+    }
+
+    void write(std::ostream& out, const std::uint64_t key) const {
+        std::vector<typename leaf_packet::flat> flat_packs;
+        flat_packs.reserve(triangle_packs.size());
+        for (const auto& pack : triangle_packs) {
+            flat_packs.push_back(pack.flatten());
         }
 
-        tree.emplace_back(EMPTY, root_box, EMPTY, EMPTY, EMPTY, 0);
-        build_tree(0, 0, triangle_indices);
+        write_binary(out, make_cache_header(key, payload_hash(root_box, build_cost, tree, flat_packs)));
+        write_binary(out, root_box);
+        write_binary(out, build_cost);
+        write_binary(out, std::span<const node>(tree));
+        write_binary(out, std::span<const typename leaf_packet::flat>(flat_packs));
     }
 
-    constexpr void build_tree_leaf(const std::size_t parent_idx, const std::vector<std::size_t>& triangle_indices) {
-        const std::size_t first_pack = triangle_packs.size();
-        
-        for (std::size_t i = 0; i < triangle_indices.size(); i += W) {
-            triangle_packet<F, W> pack{};
-            for (std::size_t lane = 0; lane < W; ++lane) {
-                const std::size_t triangle_idx = triangle_indices[std::min(i + lane, triangle_indices.size() - 1)];
+    // Whether the cached tree only refers to nodes, packets and triangles
+    // which exist and is no deeper than max_depth, so that a corrupt file
+    // can't make the traversals read out of bounds or overflow their stacks.
+    // The child above a split is always stored after the subtree below it,
+    // which also keeps a corrupt offset from forming a cycle, and lets the
+    // depths be passed on to the children in a single forward pass.
+    [[nodiscard]] bool valid_cache(std::span<const node> nodes, std::span<const typename leaf_packet::flat> packs) const {
+        std::vector<std::size_t> depths(nodes.size(), 0);
+
+        for (std::size_t node_idx = 0; node_idx < nodes.size(); ++node_idx) {
+            const node& current = nodes[node_idx];
+
+            if (current.is_leaf()) {
+                if (packs.size() < current.offset() + current.pack_count) {
+                    return false;
+                }
 
-                const auto& triangle = triangles[triangle_idx];
+                continue;
+            }
 
-                pack.v0x[lane] = triangle.v0.x;
-                pack.v0y[lane] = triangle.v0.y;
-                pack.v0z[lane] = triangle.v0.z;
-                pack.e1x[lane] = triangle.e1.x;
-                pack.e1y[lane] = triangle.e1.y;
-                pack.e1z[lane] = triangle.e1.z;
-                pack.e2x[lane] = triangle.e2.x;
-                pack.e2y[lane] = triangle.e2.y;
-                pack.e2z[lane] = triangle.e2.z;
-                pack.triangle_indices[lane] = triangle_idx;
+            if (current.offset() <= node_idx + 1 || nodes.size() <= current.offset() || max_depth <= depths[node_idx]) {
+                return false;
             }
 
-            triangle_packs.push_back(pack);
+            depths[node_idx + 1] = std::max(depths[node_idx + 1], depths[node_idx] + 1);
+            depths[current.offset()] = std::max(depths[current.offset()], depths[node_idx] + 1);
         }
-        
-        tree[parent_idx].start_idx = first_pack;
-        tree[parent_idx].pack_count = triangle_packs.size() - first_pack;
+
+        for (const auto& pack : packs) {
+            for (const std::uint32_t triangle_idx : pack.triangle_indices) {
+                if (triangle_refs.size() <= triangle_idx) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
     }
 
-    constexpr void build_tree(const int32_t parent_idx, const std::size_t depth, const std::vector<std::size_t>& triangle_indices) {
-        if (depth == max_depth || triangle_indices.size() <= max_leaf_size) {
-            build_tree_leaf(parent_idx, triangle_indices);
-            return;
+    [[nodiscard]] bool read(std::istream& in, const std::uint64_t key) {
+        cache_header header;
+        if (!read_binary(in, header) || header != make_cache_header(key, header.payload_hash)) {
+            return false;
+        }
+
+        aabb3<F> cached_root_box;
+        F cached_build_cost;
+        std::vector<node> cached_tree;
+        std::vector<typename leaf_packet::flat> cached_packs;
+
+        if (!read_binary(in, cached_root_box) || !read_binary(in, cached_build_cost) ||
+            !read_binary(in, cached_tree) || !read_binary(in, cached_packs) || cached_tree.empty() ||
+            header.payload_hash != payload_hash(cached_root_box, cached_build_cost, cached_tree, cached_packs) ||
+            !valid_cache(cached_tree, cached_packs)) {
+            return false;
         }
 
-        auto [aabb0, aabb1] = tree[parent_idx].box.split(depth % 3);
+        root_box = cached_root_box;
+        build_cost = cached_build_cost;
+        tree = std::move(cached_tree);
 
-        std::vector<std::size_t> child0_triangle_indices;
-        child0_triangle_indices.reserve(triangle_indices.size());
+        triangle_packs.clear();
+        triangle_packs.reserve(cached_packs.size());
+        for (const auto& pack : cached_packs) {
+            triangle_packs.push_back(leaf_packet::unflatten(pack));
+        }
 
-        std::vector<std::size_t> child1_triangle_indices;
-        child1_triangle_indices.reserve(triangle_indices.size());
+        return true;
+    }
 
-        for (const auto& triangle_idx : triangle_indices) {
-            const auto& triangle = triangles[triangle_idx];
+    constexpr void build() {
+        compute_triangle_boxes();
+
+        std::vector<std::uint32_t> triangle_indices(triangle_refs.size());
+        std::iota(triangle_indices.begin(), triangle_indices.end(), 0u);
+
+        index_arena arena(triangle_indices);
+        subtree root;
+        root.nodes.emplace_back();
+        build_tree(root, 0, root_box, 0, arena, {0, triangle_indices.size()}, parallel_build_depth());
+
+        tree = std::move(root.nodes);
+        triangle_packs = std::move(root.packs);
+        build_cost = sah_cost();
+
+        release_triangle_boxes();
+    }
+
+    // Updates the tree for new vertex positions of the same meshes, e.g. for
+    // the next frame of an animation. The split planes are kept and only the
+    // leaves are refilled with the triangles overlapping their cells, which
+    // is a linear pass over the triangles instead of a full build. If the
+    // triangle counts changed or the refitted tree got too expensive under
+    // the SAH, the tree is rebuilt instead. The primitives, if the structure
+    // traces any, are gathered again. Returns whether it was refitted.
+    constexpr bool update(std::shared_ptr<const scene<F>> new_scene_ptr) {
+        scene_ptr = std::move(new_scene_ptr);
+
+        if (!primitives.empty()) {
+            primitives = primitive_set<F, eps>(*scene_ptr);
+        }
+
+        if (refit()) {
+            return true;
+        }
+
+        rebuild();
+
+        return false;
+    }
+
+    [[nodiscard]] constexpr bool refit() {
+        const std::size_t old_triangle_count = triangle_refs.size();
+        const aabb3<F> box = gather_triangles();
+        if (triangle_refs.size() != old_triangle_count) {
+            return false;
+        }
+
+        compute_triangle_boxes();
+
+        // The cells at the border of the tree grow with the root box, so
+        // they pick up the triangles which moved out of the old one.
+        root_box.unite(box);
+
+        // Collect the leaves overlapped by every triangle with the same
+        // (inclusive) test as the builder, then group the references by leaf
+        // with a counting sort, which keeps them in triangle order.
+        std::vector<std::pair<std::size_t, std::uint32_t>> references;
+        std::stack<std::size_t, std::vector<std::size_t>> nodes_to_visit;
+
+        for (std::uint32_t triangle_idx = 0; triangle_idx < triangle_refs.size(); ++triangle_idx) {
+            const auto& triangle_box = triangle_boxes[triangle_idx];
+
+            nodes_to_visit.push(0);
+            while (!nodes_to_visit.empty()) {
+                const std::size_t node_idx = nodes_to_visit.top();
+                nodes_to_visit.pop();
+
+                const auto& current = tree[node_idx];
+                if (current.is_leaf()) {
+                    references.emplace_back(node_idx, triangle_idx);
+                    continue;
+                }
+
+                if (triangle_box.min[current.axis()] <= current.split) {
+                    nodes_to_visit.push(node_idx + 1);
+                }
+                if (current.split <= triangle_box.max[current.axis()]) {
+                    nodes_to_visit.push(current.offset());
+                }
+            }
+        }
+
+        std::vector<std::size_t> leaf_begin(tree.size() + 1, 0);
+        for (const auto& [node_idx, triangle_idx] : references) {
+            ++leaf_begin[node_idx + 1];
+        }
+        for (std::size_t node_idx = 0; node_idx < tree.size(); ++node_idx) {
+            leaf_begin[node_idx + 1] += leaf_begin[node_idx];
+        }
 
-            if (aabb0.intersect(triangle.box)) {
-                child0_triangle_indices.push_back(triangle_idx);
+        release_triangle_boxes();
+
+        std::vector<std::uint32_t> leaf_triangles(references.size());
+        std::vector<std::size_t> leaf_end(leaf_begin.begin(), leaf_begin.end() - 1);
+        for (const auto& [node_idx, triangle_idx] : references) {
+            leaf_triangles[leaf_end[node_idx]++] = triangle_idx;
+        }
+
+        // Every leaf is written into a fresh packet vector, in node order like
+        // the builder, so the packets of leaves which shrank or grew aren't
+        // left behind from frame to frame.
+        std::vector<leaf_packet> refitted_packs;
+        refitted_packs.reserve(triangle_packs.size());
+        for (std::size_t node_idx = 0; node_idx < tree.size(); ++node_idx) {
+            auto& current = tree[node_idx];
+            if (!current.is_leaf()) {
+                continue;
             }
 
-            if (aabb1.intersect(triangle.box)) {
-                child1_triangle_indices.push_back(triangle_idx);
+            const std::size_t first_pack = refitted_packs.size();
+            if (node::MAX_OFFSET < first_pack) {
+                return false;
             }
+
+            const auto leaf_indices = std::span(leaf_triangles).subspan(leaf_begin[node_idx], leaf_begin[node_idx + 1] - leaf_begin[node_idx]);
+            append_packs(refitted_packs, leaf_indices);
+            current = node::make_leaf(first_pack, refitted_packs.size() - first_pack);
+        }
+
+        triangle_packs = std::move(refitted_packs);
+
+        return sah_cost() <= REFIT_MAX_COST_RATIO * build_cost;
+    }
+
+    constexpr void append_packs(std::vector<leaf_packet>& packs, std::span<const std::uint32_t> triangle_indices) const {
+        append_packets(packs, *scene_ptr, triangle_refs, mesh_flags, triangle_indices);
+    }
+
+    constexpr void build_tree_leaf(subtree& out, const std::size_t node_idx, std::span<const std::uint32_t> triangle_indices) const {
+        const std::size_t first_pack = out.packs.size();
+        append_packs(out.packs, triangle_indices);
+        out.nodes[node_idx] = node::make_leaf(first_pack, out.packs.size() - first_pack);
+    }
+
+    [[nodiscard]] static constexpr std::size_t packet_count(const std::size_t triangle_count) noexcept {
+        return (triangle_count + W - 1) / W;
+    }
+
+    [[nodiscard]] constexpr std::optional<split_candidate> find_split(const aabb3<F>& box, std::span<const std::uint32_t> triangle_indices) const noexcept {
+        const F box_area = box.surface_area();
+        if (box_area <= static_cast<F>(0.)) {
+            return std::nullopt;
         }
 
-        if (!child0_triangle_indices.empty()) {
-            const std::size_t child0_idx = tree.size();
-            tree.emplace_back(parent_idx, aabb0, EMPTY, EMPTY, EMPTY, 0);
-            tree[parent_idx].child0 = child0_idx;
-            build_tree(child0_idx, depth + 1, child0_triangle_indices);
+        // Each triangle is counted in the bin where its (clipped) box starts
+        // and in the bin where it ends, so that sweeping over the bin
+        // boundaries gives the triangle count on both sides of every plane.
+        std::array<std::array<std::size_t, SAH_BINS>, 3> starts{};
+        std::array<std::array<std::size_t, SAH_BINS>, 3> ends{};
+
+        const vec3<F> extent = box.max - box.min;
+        for (const auto& triangle_idx : triangle_indices) {
+            const auto& triangle_box = triangle_boxes[triangle_idx];
+
+            for (uint32_t axis = 0; axis < 3; ++axis) {
+                if (extent[axis] <= static_cast<F>(0.)) {
+                    continue;
+                }
+
+                const F scale = static_cast<F>(SAH_BINS) / extent[axis];
+                const F lo = std::max(triangle_box.min[axis], box.min[axis]);
+                const F hi = std::min(triangle_box.max[axis], box.max[axis]);
+
+                const auto to_bin = [&](const F position) {
+                    const F bin = (position - box.min[axis]) * scale;
+                    return std::min(static_cast<std::size_t>(std::max(bin, static_cast<F>(0.))), SAH_BINS - 1);
+                };
+
+                ++starts[axis][to_bin(lo)];
+                ++ends[axis][to_bin(hi)];
+            }
         }
 
-        if (!child1_triangle_indices.empty()) {
-            const std::size_t child1_idx = tree.size();
-            tree.emplace_back(parent_idx, aabb1, EMPTY, EMPTY, EMPTY, 0);
-            tree[parent_idx].child1 = child1_idx;
-            build_tree(child1_idx, depth + 1, child1_triangle_indices);
+        std::optional<split_candidate> best_split;
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            if (extent[axis] <= static_cast<F>(0.)) {
+                continue;
+            }
+
+            std::size_t left_count = 0;
+            std::size_t right_count = triangle_indices.size();
+
+            for (std::size_t plane = 1; plane < SAH_BINS; ++plane) {
+                left_count += starts[axis][plane - 1];
+                right_count -= ends[axis][plane - 1];
+
+                const F position = box.min[axis] + (extent[axis] * static_cast<F>(plane)) / static_cast<F>(SAH_BINS);
+                const auto [left_box, right_box] = box.split(axis, position);
+
+                F cost = TRAVERSAL_COST + PACKET_INTERSECTION_COST * (
+                    left_box.surface_area() * static_cast<F>(packet_count(left_count)) +
+                    right_box.surface_area() * static_cast<F>(packet_count(right_count))
+                ) / box_area;
+
+                if (left_count == 0 || right_count == 0) {
+                    cost *= EMPTY_SPACE_BONUS;
+                }
+
+                if (!best_split || cost < best_split->cost) {
+                    best_split = split_candidate{axis, position, cost};
+                }
+            }
         }
+
+        return best_split;
     }
 
-    template <bool backface_culling>
-    [[nodiscard]] constexpr std::optional<hit<F>> intersect(const ray3<F>& ray) const noexcept {
-        std::optional<hit_candidate> closest_hit;
+    // Builds the subtree rooted at out.nodes[node_idx], which bounds the given
+    // box, from the index list in the given arena range. Both children are
+    // always created (an empty one as an empty leaf), as the child below the
+    // split must directly follow its parent. While fork_depth is non-zero,
+    // the child above is built as a separate task into its own subtree and
+    // arena, and both children are then spliced in order, so the result is
+    // identical to a serial depth-first build.
+    constexpr void build_tree(subtree& out, const std::size_t node_idx, const aabb3<F>& box, const std::size_t depth, index_arena& arena, const index_range range, const std::size_t fork_depth) const {
+        if (depth == max_depth || range.size() <= max_leaf_size) {
+            build_tree_leaf(out, node_idx, arena.view(range));
+            return;
+        }
+
+        const F leaf_cost = PACKET_INTERSECTION_COST * static_cast<F>(packet_count(range.size()));
+        const auto split = find_split(box, arena.view(range));
+        if (!split || leaf_cost <= split->cost) {
+            build_tree_leaf(out, node_idx, arena.view(range));
+            return;
+        }
 
-        std::stack<std::size_t, std::vector<std::size_t>> nodes_to_check;
-        nodes_to_check.push(0);
+        out.nodes[node_idx] = node::make_inner(split->axis, split->position);
 
-        while (!nodes_to_check.empty()) {
-            const auto node_idx = nodes_to_check.top();
-            nodes_to_check.pop();
+        auto [aabb0, aabb1] = box.split(split->axis, split->position);
+
+        const std::size_t arena_mark = arena.mark();
+
+        const index_range child0_range = arena.push_filtered(range, [&](const std::size_t triangle_idx) {
+            return aabb0.intersect(triangle_boxes[triangle_idx]);
+        });
+
+        const index_range child1_range = arena.push_filtered(range, [&](const std::size_t triangle_idx) {
+            return aabb1.intersect(triangle_boxes[triangle_idx]);
+        });
+
+        if (fork_depth != 0 && PARALLEL_BUILD_MIN_TRIANGLES <= std::min(child0_range.size(), child1_range.size())) {
+            index_arena child1_arena(arena.view(child1_range));
+
+            auto child1_future = std::async(std::launch::async, [&, aabb1, child1_arena = std::move(child1_arena)]() mutable {
+                subtree child1;
+                child1.nodes.emplace_back();
+                build_tree(child1, 0, aabb1, depth + 1, child1_arena, {0, child1_arena.buffer.size()}, fork_depth - 1);
+                return child1;
+            });
 
-            const auto& node = tree[node_idx];
+            subtree child0;
+            child0.nodes.emplace_back();
+            build_tree(child0, 0, aabb0, depth + 1, arena, child0_range, fork_depth - 1);
+
+            out.splice(std::move(child0));
+            out.nodes[node_idx].set_offset(out.splice(child1_future.get()));
+
+            arena.release(arena_mark);
+            return;
+        }
+
+        const std::size_t child0_idx = out.nodes.size();
+        out.nodes.emplace_back();
+        build_tree(out, child0_idx, aabb0, depth + 1, arena, child0_range, fork_depth);
+
+        const std::size_t child1_idx = out.nodes.size();
+        out.nodes.emplace_back();
+        out.nodes[node_idx].set_offset(child1_idx);
+        build_tree(out, child1_idx, aabb1, depth + 1, arena, child1_range, fork_depth);
+
+        arena.release(arena_mark);
+    }
+
+    // Expected cost of a random ray through the tree under the surface area
+    // heuristic, using the same cost constants as the builder.
+    [[nodiscard]] constexpr F sah_cost() const noexcept {
+        const F root_area = root_box.surface_area();
+        if (root_area <= static_cast<F>(0.)) {
+            return PACKET_INTERSECTION_COST * static_cast<F>(triangle_packs.size());
+        }
 
-            const F best_t = closest_hit ? closest_hit->t : MAX_F;
+        F cost = static_cast<F>(0.);
 
-            auto maybe_box_hit = node.box.intersect(ray);
-            if (!maybe_box_hit || best_t < maybe_box_hit->t_min) {
+        std::stack<std::pair<std::size_t, aabb3<F>>, std::vector<std::pair<std::size_t, aabb3<F>>>> nodes_to_visit;
+        nodes_to_visit.emplace(0, root_box);
+
+        while (!nodes_to_visit.empty()) {
+            const auto [node_idx, box] = nodes_to_visit.top();
+            nodes_to_visit.pop();
+
+            const auto& current = tree[node_idx];
+            if (current.is_leaf()) {
+                cost += PACKET_INTERSECTION_COST * static_cast<F>(current.pack_count) * box.surface_area() / root_area;
                 continue;
             }
 
-            if (node.start_idx == EMPTY) {
-                if (node.child0 != EMPTY) {
-                    nodes_to_check.push(node.child0);
+            cost += TRAVERSAL_COST * box.surface_area() / root_area;
+
+            const auto [aabb0, aabb1] = box.split(current.axis(), current.split);
+            nodes_to_visit.emplace(node_idx + 1, aabb0);
+            nodes_to_visit.emplace(current.offset(), aabb1);
+        }
+
+        return cost;
+    }
+
+    // Walks the tree for the build quality report.
+    [[nodiscard]] accel_stats build_stats() const {
+        accel_stats stats;
+        stats.triangle_count = triangle_refs.size();
+        stats.packet_width = W;
+        stats.sah_cost = static_cast<double>(sah_cost());
+        stats.memory_bytes = {
+            {"nodes", vector_bytes(tree)},
+            {"packets", vector_bytes(triangle_packs)},
+            {"triangle_refs", vector_bytes(triangle_refs)},
+            {"mesh_flags", vector_bytes(mesh_flags)},
+            {"mesh_indices", vector_bytes(mesh_indices)}
+        };
+
+        std::stack<std::pair<std::size_t, std::size_t>, std::vector<std::pair<std::size_t, std::size_t>>> nodes_to_visit;
+        nodes_to_visit.emplace(0, 0);
+
+        while (!nodes_to_visit.empty()) {
+            const auto [node_idx, depth] = nodes_to_visit.top();
+            nodes_to_visit.pop();
+
+            const auto& current = tree[node_idx];
+            if (current.is_leaf()) {
+                std::size_t used = 0;
+                for (std::size_t pack_idx = current.offset(); pack_idx < current.offset() + current.pack_count; ++pack_idx) {
+                    used += used_lanes(triangle_packs[pack_idx]);
                 }
 
-                if (node.child1 != EMPTY) {
-                    nodes_to_check.push(node.child1);
+                stats.add_leaf(depth, current.pack_count, used);
+                continue;
+            }
+
+            ++stats.inner_node_count;
+            nodes_to_visit.emplace(node_idx + 1, depth + 1);
+            nodes_to_visit.emplace(current.offset(), depth + 1);
+        }
+
+        return stats;
+    }
+
+    // Whether every triangle of the packet lies fully outside one of the four
+    // side planes of the frustum.
+    [[nodiscard]] static constexpr bool culls(const frustum3<F>& frustum, const leaf_packet& pack) noexcept {
+        const std::array<const simd_f*, 3> v0{&pack.v0x, &pack.v0y, &pack.v0z};
+        const std::array<const simd_f*, 3> e1{&pack.e1x, &pack.e1y, &pack.e1z};
+        const std::array<const simd_f*, 3> e2{&pack.e2x, &pack.e2y, &pack.e2z};
+
+        simd_f_mask outside_min_u(true), outside_max_u(true);
+        simd_f_mask outside_min_v(true), outside_max_v(true);
+
+        for (std::size_t vertex = 0; vertex < 3; ++vertex) {
+            const auto relative = [&](const uint32_t axis) {
+                simd_f component = *v0[axis] - frustum.origin[axis];
+                if (vertex == 1) {
+                    component += *e1[axis];
+                } else if (vertex == 2) {
+                    component += *e2[axis];
                 }
-            } else {
-                const auto new_hit_candidate = intersect_leaf<backface_culling>(ray, node);
-                
-                if (!new_hit_candidate) {
-                    continue;
+
+                return component;
+            };
+
+            const simd_f along_d = frustum.sign * relative(frustum.d);
+            const simd_f along_u = relative(frustum.u);
+            const simd_f along_v = relative(frustum.v);
+
+            outside_min_u &= along_u < frustum.min_u_slope * along_d;
+            outside_max_u &= frustum.max_u_slope * along_d < along_u;
+            outside_min_v &= along_v < frustum.min_v_slope * along_d;
+            outside_max_v &= frustum.max_v_slope * along_d < along_v;
+        }
+
+        return stdx::all_of(outside_min_u || outside_max_u || outside_min_v || outside_max_v);
+    }
+
+    // The deepest node whose cell holds everything inside the frustum, found
+    // by descending as long as the frustum overlaps only one child's cell (or
+    // the other child is an empty leaf). Rays inside the frustum never enter
+    // the cells left out, so they can start their traversal there instead of
+    // at the root, e.g. all camera rays of a tile.
+    [[nodiscard]] constexpr traversal_root frustum_root(const frustum3<F>& frustum) const noexcept {
+        traversal_root root{0, root_box};
+
+        while (!tree[root.node_idx].is_leaf()) {
+            const auto& current = tree[root.node_idx];
+            const auto [aabb0, aabb1] = root.box.split(current.axis(), current.split);
+
+            const std::array<traversal_root, 2> children{{{root.node_idx + 1, aabb0}, {current.offset(), aabb1}}};
+            std::array<bool, 2> needed;
+            for (std::size_t child = 0; child < 2; ++child) {
+                const auto& child_node = tree[children[child].node_idx];
+                needed[child] = !(child_node.is_leaf() && child_node.pack_count == 0) && !frustum.excludes(children[child].box);
+            }
+
+            if (needed[0] == needed[1]) {
+                break;
+            }
+
+            root = needed[0] ? children[0] : children[1];
+        }
+
+        return root;
+    }
+
+    template <ray_type type, bool back_face_culling = true>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect(const ray3<F>& ray) const noexcept {
+        return intersect<type, back_face_culling>(ray, traversal_root{0, root_box});
+    }
+
+    // Traces the ray from the given root, which has to be the root of the
+    // tree or the frustum_root of a frustum containing the ray. The
+    // primitives don't depend on the root, they are always tested.
+    template <ray_type type, bool back_face_culling = true>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect(const ray3<F>& ray, const traversal_root& root) const noexcept {
+        return primitives.template closest_hit<type, back_face_culling>(*scene_ptr, ray, intersect_triangles<type, back_face_culling>(ray, root));
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit<F>> intersect_triangles(const ray3<F>& ray, const traversal_root& root) const noexcept {
+        std::optional<hit_candidate> closest_hit;
+
+        const auto root_hit = root.box.intersect(ray);
+        if (!root_hit) {
+            return std::nullopt;
+        }
+
+        // Classic front-to-back kd-tree traversal: the child on the ray
+        // origin's side of the split plane is visited first and the far child
+        // is only pushed when the ray's [t_min, t_max] interval crosses the
+        // plane. Entries are popped in increasing t_min order, so once a hit
+        // is closer than the next entry's t_min, nothing can beat it. At most
+        // one far child per level is pending, so the stack never holds more
+        // than max_depth entries and lives on the call stack.
+        fixed_stack<traversal_entry, max_depth> nodes_to_check;
+
+        // Packets whose triangles were all tested in an earlier leaf (as they
+        // straddle a split) are skipped.
+        triangle_mailbox tested_triangles;
+
+        std::size_t node_idx = root.node_idx;
+        F t_min = root_hit->t_min;
+        F t_max = root_hit->t_max;
+
+        while (true) {
+            const auto& current = tree[node_idx];
+
+            if (!current.is_leaf()) {
+                const uint32_t axis = current.axis();
+                const F origin = ray.origin[axis];
+                const F t_plane = (current.split - origin) * ray.inv_direction[axis];
+
+                const bool below_first = origin < current.split || (origin == current.split && ray.direction[axis] <= static_cast<F>(0.));
+                const std::size_t near_child = below_first ? node_idx + 1 : current.offset();
+                const std::size_t far_child = below_first ? current.offset() : node_idx + 1;
+
+                if (!(static_cast<F>(0.) < t_plane) || t_max < t_plane) {
+                    node_idx = near_child;
+                } else if (t_plane < t_min) {
+                    node_idx = far_child;
+                } else {
+                    nodes_to_check.push({far_child, t_plane, t_max});
+                    node_idx = near_child;
+                    t_max = t_plane;
                 }
 
-                const F best_t = closest_hit ? closest_hit->t : MAX_F;
+                continue;
+            }
+
+            if (current.pack_count != 0) {
+                const auto new_hit_candidate = intersect_leaf<type, back_face_culling>(ray, current, tested_triangles);
 
-                if (new_hit_candidate->t < best_t) {
+                if (new_hit_candidate && (!closest_hit || new_hit_candidate->t < closest_hit->t)) {
                     closest_hit = new_hit_candidate;
                 }
             }
+
+            if (nodes_to_check.empty()) {
+                break;
+            }
+
+            const auto next = nodes_to_check.top();
+            nodes_to_check.pop();
+
+            if (closest_hit && closest_hit->t < next.t_min) {
+                break;
+            }
+
+            node_idx = next.node_idx;
+            t_min = next.t_min;
+            t_max = next.t_max;
         }
 
         if (!closest_hit) {
             return std::nullopt;
         }
 
-        const auto& pack = triangle_packs[closest_hit->pack_idx];
+        return make_hit(ray, *closest_hit);
+    }
 
-        const F u = closest_hit->u;
-        const F v = closest_hit->v;
-        const F w = static_cast<F>(1.) - u - v;
+    [[nodiscard]] constexpr bool occluded(const ray3<F>& ray, const F max_t) const noexcept {
+        return primitives.occluded(ray, max_t) || occluded_triangles(ray, max_t);
+    }
 
-        const std::size_t triangle_idx = pack.triangle_indices[closest_hit->lane];
-        const auto& triangle = triangles[triangle_idx];
+    // Same traversal as intersect, but with the interval clipped to t_max
+    // and returning at the first leaf with a shadow casting hit.
+    [[nodiscard]] constexpr bool occluded_triangles(const ray3<F>& ray, const F max_t) const noexcept {
+        const auto root_hit = root_box.intersect(ray);
+        if (!root_hit || max_t < root_hit->t_min) {
+            return false;
+        }
 
-        const std::size_t mesh_idx = triangle.mesh_idx;
-        const std::size_t v0_idx = triangle.vertex_indices[0];
-        const std::size_t v1_idx = triangle.vertex_indices[1];
-        const std::size_t v2_idx = triangle.vertex_indices[2];
+        fixed_stack<traversal_entry, max_depth> nodes_to_check;
+        triangle_mailbox tested_triangles;
+
+        std::size_t node_idx = 0;
+        F t_min = root_hit->t_min;
+        F t_max = std::min(root_hit->t_max, max_t);
+
+        while (true) {
+            const auto& current = tree[node_idx];
+
+            if (!current.is_leaf()) {
+                const uint32_t axis = current.axis();
+                const F origin = ray.origin[axis];
+                const F t_plane = (current.split - origin) * ray.inv_direction[axis];
+
+                const bool below_first = origin < current.split || (origin == current.split && ray.direction[axis] <= static_cast<F>(0.));
+                const std::size_t near_child = below_first ? node_idx + 1 : current.offset();
+                const std::size_t far_child = below_first ? current.offset() : node_idx + 1;
+
+                if (!(static_cast<F>(0.) < t_plane) || t_max < t_plane) {
+                    node_idx = near_child;
+                } else if (t_plane < t_min) {
+                    node_idx = far_child;
+                } else {
+                    nodes_to_check.push({far_child, t_plane, t_max});
+                    node_idx = near_child;
+                    t_max = t_plane;
+                }
 
-        const auto& mesh = scene_ptr->meshes[mesh_idx];
+                continue;
+            }
 
-        const vec3<F> hit_normal = normalized(u * mesh.vertex_normals[v1_idx] + v * mesh.vertex_normals[v2_idx] + w * mesh.vertex_normals[v0_idx]);
+            if (current.pack_count != 0 && occluded_leaf(ray, current, max_t, tested_triangles)) {
+                return true;
+            }
 
-        return hit<F>{
-            ray,
-            ray.origin + (closest_hit->t * ray.direction),
-            hit_normal,
-            triangle.normal,
-            triangle.uvs,
-            closest_hit->t,
-            u,
-            v,
-            w,
-            mesh_idx
-        };
+            if (nodes_to_check.empty()) {
+                return false;
+            }
+
+            const auto next = nodes_to_check.top();
+            nodes_to_check.pop();
+
+            node_idx = next.node_idx;
+            t_min = next.t_min;
+            t_max = next.t_max;
+        }
     }
 
-    template <bool backface_culling>
-    [[nodiscard]] constexpr std::optional<hit_candidate> intersect_leaf(const ray3<F>& ray, const node& leaf) const noexcept {
-        std::optional<hit_candidate> closest_hit;
+    // Traverses the tree once for the whole packet, deciding at every node
+    // for all rays at once (as SIMD lanes) which of them need the near and
+    // the far child. Subtrees which no ray's [t_min, t_max] interval reaches
+    // are culled for the whole packet, and rays drop out of the packet once
+    // their closest hit is found. When all rays share an origin (e.g. camera
+    // rays), leaf triangle packets outside the packet's frustum are skipped
+    // without testing any ray. The near/far order is taken from the
+    // direction signs, so packets whose rays don't share them fall back to
+    // tracing every ray on its own.
+    template <ray_type type, bool back_face_culling = true, std::size_t P>
+    [[nodiscard]] std::array<std::optional<hit<F>>, P> intersect_packet(const ray_packet<F, P>& packet) const noexcept {
+        return intersect_packet<type, back_face_culling>(packet, traversal_root{0, root_box});
+    }
 
-        for (std::size_t pack_idx = leaf.start_idx; pack_idx < leaf.start_idx + leaf.pack_count; ++pack_idx) {
-            const auto& pack = triangle_packs[pack_idx];
+    // Same for a packet of rays inside the frustum the root was found for.
+    template <ray_type type, bool back_face_culling = true, std::size_t P>
+    [[nodiscard]] std::array<std::optional<hit<F>>, P> intersect_packet(const ray_packet<F, P>& packet, const traversal_root& root) const noexcept {
+        using simd_p = stdx::fixed_size_simd<F, P>;
+        using simd_p_mask = simd_p::mask_type;
+
+        struct packet_entry {
+            std::size_t node_idx;
+            simd_p t_min;
+            simd_p t_max;
+            simd_p_mask active;
+        };
+
+        std::array<std::optional<hit<F>>, P> hits;
+
+        const auto rays = [&]<std::size_t... lanes>(std::index_sequence<lanes...>) {
+            return std::array<ray3<F>, P>{packet.ray(lanes)...};
+        }(std::make_index_sequence<P>{});
+
+        std::optional<std::size_t> first_active;
+        std::array<bool, 3> negative{};
+        bool coherent = true;
+        bool shared_origin = true;
+        for (std::size_t lane = 0; lane < P; ++lane) {
+            if (!packet.active[lane]) {
+                continue;
+            }
+
+            if (!first_active) {
+                first_active = lane;
+            }
+
+            const vec3<F>& lane_origin = packet.origins[lane];
+            const vec3<F>& first_origin = packet.origins[*first_active];
+            if (lane_origin.x != first_origin.x || lane_origin.y != first_origin.y || lane_origin.z != first_origin.z) {
+                shared_origin = false;
+            }
+
+            for (std::size_t axis = 0; axis < 3; ++axis) {
+                const bool lane_negative = std::signbit(rays[lane].direction[axis]);
+                if (lane == *first_active) {
+                    negative[axis] = lane_negative;
+                } else if (negative[axis] != lane_negative) {
+                    coherent = false;
+                }
+            }
+        }
+
+        if (!first_active) {
+            return hits;
+        }
+
+        if (!coherent) {
+            for (std::size_t lane = 0; lane < P; ++lane) {
+                if (packet.active[lane]) {
+                    hits[lane] = intersect<type, back_face_culling>(rays[lane], root);
+                }
+            }
+
+            return hits;
+        }
+
+        // Only packet formats which store the vertices can be culled.
+        std::optional<frustum3<F>> frustum;
+        if (leaf_packet::STORES_VERTICES && shared_origin) {
+            std::array<vec3<F>, P> directions;
+            std::size_t direction_count = 0;
+            for (std::size_t lane = 0; lane < P; ++lane) {
+                if (packet.active[lane]) {
+                    directions[direction_count++] = rays[lane].direction;
+                }
+            }
+
+            frustum = frustum3<F>::around(rays[*first_active].origin, std::span(directions).first(direction_count));
+        }
+
+        std::array<simd_p, 3> origin;
+        std::array<simd_p, 3> inv_direction;
+        simd_p t_min(static_cast<F>(0.));
+        simd_p t_max(MAX_F);
+        simd_p_mask active(false);
+
+        for (std::size_t lane = 0; lane < P; ++lane) {
+            active[lane] = packet.active[lane];
+
+            for (std::size_t axis = 0; axis < 3; ++axis) {
+                origin[axis][lane] = rays[lane].origin[axis];
+                inv_direction[axis][lane] = rays[lane].inv_direction[axis];
+            }
+        }
+
+        for (std::size_t axis = 0; axis < 3; ++axis) {
+            const simd_p near_plane((negative[axis] ? root.box.max : root.box.min)[axis]);
+            const simd_p far_plane((negative[axis] ? root.box.min : root.box.max)[axis]);
+
+            t_min = stdx::max(t_min, (near_plane - origin[axis]) * inv_direction[axis]);
+            t_max = stdx::min(t_max, (far_plane - origin[axis]) * inv_direction[axis]);
+        }
 
-            simd_f t, u, v;
-            simd_f_mask mask = pack.template intersect<backface_culling, eps>(ray, t, u, v);
+        active &= t_min <= t_max;
+
+        std::array<std::optional<hit_candidate>, P> closest_hits;
+        std::array<triangle_mailbox, P> tested_triangles;
+        simd_p best_t(MAX_F);
+        simd_p_mask finished(false);
+
+        fixed_stack<packet_entry, max_depth> nodes_to_check;
+
+        std::size_t node_idx = root.node_idx;
+
+        while (stdx::any_of(active)) {
+            const auto& current = tree[node_idx];
+
+            if (!current.is_leaf()) {
+                const uint32_t axis = current.axis();
+                const simd_p t_plane = (simd_p(current.split) - origin[axis]) * inv_direction[axis];
+
+                const std::size_t near_child = negative[axis] ? current.offset() : node_idx + 1;
+                const std::size_t far_child = negative[axis] ? node_idx + 1 : current.offset();
+
+                // A NaN t_plane (ray inside the plane) keeps the ray in the
+                // near child only, as it is compared as neither smaller nor
+                // larger.
+                const simd_p_mask needs_near = active && !(t_plane < t_min);
+                const simd_p_mask needs_far = active && (t_plane <= t_max);
+
+                if (stdx::none_of(needs_far)) {
+                    node_idx = near_child;
+                    active = needs_near;
+                    stdx::where(t_plane < t_max, t_max) = t_plane;
+                } else if (stdx::none_of(needs_near)) {
+                    node_idx = far_child;
+                    active = needs_far;
+                    stdx::where(t_min < t_plane, t_min) = t_plane;
+                } else {
+                    packet_entry far_entry{far_child, t_min, t_max, needs_far};
+                    stdx::where(t_min < t_plane, far_entry.t_min) = t_plane;
+                    nodes_to_check.push(far_entry);
+
+                    node_idx = near_child;
+                    active = needs_near;
+                    stdx::where(t_plane < t_max, t_max) = t_plane;
+                }
 
-            if (stdx::none_of(mask)) {
                 continue;
             }
 
-            const F best_t = closest_hit ? closest_hit->t : MAX_F;
-            stdx::where(!mask, t) = best_t;
+            if (current.pack_count != 0) {
+                for (std::size_t pack_idx = current.offset(); pack_idx < current.offset() + current.pack_count; ++pack_idx) {
+                    if (stdx::none_of(triangle_packs[pack_idx].visible_to[std::to_underlying(type)])) {
+                        continue;
+                    }
+
+                    if constexpr (leaf_packet::STORES_VERTICES) {
+                        if (frustum && culls(*frustum, triangle_packs[pack_idx])) {
+                            continue;
+                        }
+                    }
+
+                    for (std::size_t lane = 0; lane < P; ++lane) {
+                        if (active[lane] && !tested_triangles[lane].tested(triangle_packs[pack_idx].triangle_indices)) {
+                            intersect_closest<type, back_face_culling, F, eps>(triangle_packs[pack_idx], pack_idx, rays[lane], closest_hits[lane]);
+                        }
+                    }
+                }
+
+                for (std::size_t lane = 0; lane < P; ++lane) {
+                    if (closest_hits[lane]) {
+                        best_t[lane] = closest_hits[lane]->t;
+                    }
+                }
+
+                finished |= active && (best_t <= t_max);
+            }
+
+            active = simd_p_mask(false);
+            while (stdx::none_of(active) && !nodes_to_check.empty()) {
+                const auto next = nodes_to_check.top();
+                nodes_to_check.pop();
+
+                node_idx = next.node_idx;
+                t_min = next.t_min;
+                t_max = next.t_max;
+                active = next.active && !finished && (t_min <= best_t);
+            }
+        }
 
-            const F t_min = stdx::hmin(t);
-            if (best_t <= t_min) {
+        for (std::size_t lane = 0; lane < P; ++lane) {
+            if (!packet.active[lane]) {
                 continue;
             }
 
-            mask = (t == t_min);
+            std::optional<hit<F>> triangle_hit;
+            if (closest_hits[lane]) {
+                triangle_hit = make_hit(rays[lane], *closest_hits[lane]);
+            }
 
-            const std::size_t winning_lane = stdx::find_first_set(mask);
+            hits[lane] = primitives.template closest_hit<type, back_face_culling>(*scene_ptr, rays[lane], triangle_hit);
+        }
 
-            closest_hit = hit_candidate{
-                t[winning_lane],
-                u[winning_lane],
-                v[winning_lane],
-                pack_idx,
-                winning_lane
-            };
+        return hits;
+    }
+
+    [[nodiscard]] constexpr hit<F> make_hit(const ray3<F>& ray, const hit_candidate& closest_hit) const noexcept {
+        const auto& pack = triangle_packs[closest_hit.pack_idx];
+
+        return make_triangle_hit(*scene_ptr, triangle_refs[pack.triangle_indices[closest_hit.lane]], ray, closest_hit.t, closest_hit.u, closest_hit.v);
+    }
+
+    [[nodiscard]] constexpr bool occluded_leaf(const ray3<F>& ray, const node& leaf, const F max_t, triangle_mailbox& tested_triangles) const noexcept {
+        for (std::size_t pack_idx = leaf.offset(); pack_idx < leaf.offset() + leaf.pack_count; ++pack_idx) {
+            const auto& pack = triangle_packs[pack_idx];
+
+            if (stdx::none_of(pack.visible_to[std::to_underlying(ray_type::shadow)]) || tested_triangles.tested(pack.triangle_indices)) {
+                continue;
+            }
+
+            if (stdx::any_of(hits_within<F, eps>(pack, ray, max_t))) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Packets without a triangle visible to the ray type are skipped before
+    // the mailbox lookup, so they cost neither the lookup nor a test.
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit_candidate> intersect_leaf(const ray3<F>& ray, const node& leaf, triangle_mailbox& tested_triangles) const noexcept {
+        std::optional<hit_candidate> closest_hit;
+
+        for (std::size_t pack_idx = leaf.offset(); pack_idx < leaf.offset() + leaf.pack_count; ++pack_idx) {
+            const auto& pack = triangle_packs[pack_idx];
+
+            if (stdx::none_of(pack.visible_to[std::to_underlying(type)]) || tested_triangles.tested(pack.triangle_indices)) {
+                continue;
+            }
+
+            intersect_closest<type, back_face_culling, F, eps>(pack, pack_idx, ray, closest_hit);
         }
 
         return closest_hit;
@@ -5,29 +5,36 @@
 
 #include <raytracer/core/math/ray3.hpp>
 #include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/render/accel/primitives.hpp>
 #include <raytracer/scene/scene.hpp>
 
 template <typename F, F eps>
 struct list_accel {
     std::shared_ptr<const scene<F>> scene_ptr;
+    std::vector<surface_flags> mesh_flags;
     aabb3<F> root_box;
+    scalar_primitive_set<F, eps> primitives;
 
-    constexpr list_accel(std::shared_ptr<const scene<F>> scene_ptr) : scene_ptr(std::move(scene_ptr)) {
+    constexpr list_accel(std::shared_ptr<const scene<F>> scene_ptr)
+        : scene_ptr(std::move(scene_ptr)), mesh_flags(mesh_surface_flags(*this->scene_ptr)), primitives(*this->scene_ptr) {
         for (const auto& mesh : this->scene_ptr->meshes) {
             root_box.unite(mesh.box);
         }
     }
 
-    template <bool backface_culling>
+    template <ray_type type, bool back_face_culling = true>
     constexpr std::optional<hit<F>> intersect(const ray3<F>& ray) const {
         std::optional<hit<F>> closest_hit;
 
         for (const auto& [mesh_idx, mesh] : scene_ptr->meshes | std::ranges::views::enumerate) {
-            if (!root_box.intersect(ray)) {
+            const auto flags = mesh_flags[mesh_idx];
+            if (!flags.visible(type) || !root_box.intersect(ray)) {
                 continue;
             }
 
-            const auto maybe_hit = mesh.template intersect<backface_culling, eps>(ray);
+            const auto maybe_hit = back_face_culling && flags.back_face_culling
+                ? mesh.template intersect<true, eps>(ray)
+                : mesh.template intersect<false, eps>(ray);
 
             if (maybe_hit && (!closest_hit || maybe_hit->distance < closest_hit->distance)) {
                 const F u = maybe_hit->u;
@@ -44,11 +51,38 @@ struct list_accel {
                     u,
                     v,
                     w,
-                    static_cast<std::size_t>(mesh_idx)
+                    mesh.material_idx
                 };
             }
         }
 
-        return closest_hit;
+        return primitives.template closest_hit<type, back_face_culling>(*scene_ptr, ray, closest_hit);
+    }
+
+    constexpr bool occluded(const ray3<F>& ray, const F max_t) const {
+        if (primitives.occluded(*scene_ptr, ray, max_t)) {
+            return true;
+        }
+
+        if (!root_box.intersect(ray)) {
+            return false;
+        }
+
+        for (std::size_t mesh_idx = 0; mesh_idx < scene_ptr->meshes.size(); ++mesh_idx) {
+            if (!mesh_flags[mesh_idx].visible(ray_type::shadow)) {
+                continue;
+            }
+
+            const auto& mesh = scene_ptr->meshes[mesh_idx];
+            for (std::size_t triangle_idx = 0; triangle_idx < mesh.triangles.size(); ++triangle_idx) {
+                const auto maybe_hit = mesh.triangle_at(triangle_idx).template intersect<false, eps>(ray);
+
+                if (maybe_hit && maybe_hit->distance < max_t) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
     }
 };
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <utility>
+
+#include <raytracer/render/accel/accel.hpp>
+
+// A structure over the scene together with a second build of it over the
+// scene's simplified copy (see simplify_scene), its coarse level of detail.
+// All the queries of the accelerator interface are answered by the detailed
+// level, the renderer picks the coarse one itself for the rays whose result
+// is blurred anyway (see blurred_ray_level).
+template <typename A, typename F>
+requires accelerator<A, F>
+struct lod_accel : A {
+    using level_type = A;
+
+    A coarse;
+
+    lod_accel(A detailed, A coarse)
+        : A(std::move(detailed)), coarse(std::move(coarse)) {}
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <type_traits>
+
+#include <raytracer/config.hpp>
+
+// Totals of all mailboxes, only collected if collect_mailbox_stats is set, as
+// otherwise every render thread would update the shared counters per ray.
+struct mailbox_stats {
+    static inline std::atomic<std::uint64_t> tests{0};
+    static inline std::atomic<std::uint64_t> skipped{0};
+
+    static void record(const std::uint64_t ray_tests, const std::uint64_t ray_skipped) noexcept {
+        tests.fetch_add(ray_tests, std::memory_order_relaxed);
+        skipped.fetch_add(ray_skipped, std::memory_order_relaxed);
+    }
+};
+
+// Per-ray mailbox of the recently tested triangles, so that triangles that
+// are referenced by several leaves (or repeated to pad a packet) are tested
+// only once per ray. It is a small direct-mapped table: a colliding triangle
+// evicts the older one, which then is only tested again, so a lookup never
+// skips a triangle that wasn't tested. The triangles are the structure's own
+// 32 bit indices, so the table of 16 takes a single cache line.
+template <std::size_t S = 16>
+struct mailbox {
+    static_assert((S & (S - 1)) == 0, "the mailbox size must be a power of two");
+
+    static constexpr std::uint32_t EMPTY = std::numeric_limits<std::uint32_t>::max();
+
+    std::array<std::uint32_t, S> slots;
+    std::uint64_t tests = 0;
+    std::uint64_t skipped = 0;
+
+    constexpr mailbox() noexcept {
+        slots.fill(EMPTY);
+    }
+
+    mailbox(const mailbox&) = delete;
+    mailbox& operator=(const mailbox&) = delete;
+
+    constexpr ~mailbox() {
+        if constexpr (collect_mailbox_stats) {
+            mailbox_stats::record(tests, skipped);
+        }
+    }
+
+    // Returns whether the triangle was tested already, otherwise records it
+    // as tested.
+    [[nodiscard]] constexpr bool tested(const std::uint32_t triangle_idx) noexcept {
+        std::uint32_t& slot = slots[triangle_idx & (S - 1)];
+        const bool hit = slot == triangle_idx;
+        slot = triangle_idx;
+
+        count(hit);
+
+        return hit;
+    }
+
+    // Same for a whole packet, which only counts as tested if all of its
+    // triangles were.
+    [[nodiscard]] constexpr bool tested(std::span<const std::uint32_t> triangle_indices) noexcept {
+        bool hit = true;
+        for (const std::uint32_t triangle_idx : triangle_indices) {
+            std::uint32_t& slot = slots[triangle_idx & (S - 1)];
+            hit = hit && slot == triangle_idx;
+            slot = triangle_idx;
+        }
+
+        count(hit);
+
+        return hit;
+    }
+
+    constexpr void count(const bool hit) noexcept {
+        if constexpr (collect_mailbox_stats) {
+            ++tests;
+            skipped += hit ? 1 : 0;
+        }
+    }
+};
+
+// Stand-in for structures traversed without a mailbox, which test everything.
+struct no_mailbox {
+    [[nodiscard]] static constexpr bool tested(const std::uint32_t) noexcept {
+        return false;
+    }
+
+    [[nodiscard]] static constexpr bool tested(std::span<const std::uint32_t>) noexcept {
+        return false;
+    }
+};
+
+template <bool enabled>
+using mailbox_type = std::conditional_t<enabled, mailbox<>, no_mailbox>;
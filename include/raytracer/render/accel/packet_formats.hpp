@@ -0,0 +1,485 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <experimental/simd>
+
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/core/math/vec3.hpp>
+#include <raytracer/scene/object/visibility.hpp>
+#include <raytracer/scene/primitive/triangle.hpp>
+#include <raytracer/scene/scene.hpp>
+
+namespace stdx = std::experimental;
+
+// Trivially copyable copy of a leaf packet with K simd components, as the simd
+// types aren't, for writing packets to files.
+template <typename F, std::size_t W, std::size_t K>
+struct flat_triangle_packet {
+    std::array<std::array<F, W>, K> components;
+    std::array<std::uint32_t, W> triangle_indices;
+    std::array<surface_flags, W> lane_flags;
+};
+
+// Every leaf packet format keeps the surface flags of its lanes' triangles
+// as one mask of visible lanes per ray type and a mask of the lanes whose
+// back faces are culled, resolved from the meshes and materials when the
+// packet is built, so the traversals don't have to look them up.
+template <typename P>
+constexpr void set_lane_flags(P& pack, const std::size_t lane, const surface_flags flags) noexcept {
+    for (const ray_type type : all_ray_types) {
+        pack.visible_to[std::to_underlying(type)][lane] = flags.visible(type);
+    }
+    pack.back_faces_culled[lane] = flags.back_face_culling;
+}
+
+template <typename P>
+[[nodiscard]] constexpr surface_flags lane_flags(const P& pack, const std::size_t lane) noexcept {
+    surface_flags flags{0, pack.back_faces_culled[lane]};
+    for (const ray_type type : all_ray_types) {
+        if (pack.visible_to[std::to_underlying(type)][lane]) {
+            flags.visible_to |= ray_type_bit(type);
+        }
+    }
+
+    return flags;
+}
+
+template <typename P>
+[[nodiscard]] constexpr typename P::flat flatten_packet(const P& pack) noexcept {
+    typename P::flat result;
+    result.triangle_indices = pack.triangle_indices;
+    for (std::size_t lane = 0; lane < result.lane_flags.size(); ++lane) {
+        result.lane_flags[lane] = lane_flags(pack, lane);
+    }
+
+    const auto vectors = pack.components();
+    for (std::size_t i = 0; i < vectors.size(); ++i) {
+        vectors[i]->copy_to(result.components[i].data(), stdx::element_aligned);
+    }
+
+    return result;
+}
+
+template <typename P>
+[[nodiscard]] constexpr P unflatten_packet(const typename P::flat& packed) noexcept {
+    P result;
+    result.triangle_indices = packed.triangle_indices;
+    for (std::size_t lane = 0; lane < packed.lane_flags.size(); ++lane) {
+        set_lane_flags(result, lane, packed.lane_flags[lane]);
+    }
+
+    const auto vectors = result.components();
+    for (std::size_t i = 0; i < vectors.size(); ++i) {
+        vectors[i]->copy_from(packed.components[i].data(), stdx::element_aligned);
+    }
+
+    return result;
+}
+
+// Leaf packet storing the first vertex and both edges of every triangle,
+// tested with Möller-Trumbore. The default format of every structure.
+template <typename F, std::size_t W>
+struct triangle_packet {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+
+    // Whether frustum culling can read the vertices from the packet.
+    static constexpr bool STORES_VERTICES = true;
+
+    // Tells the formats apart in the tree cache's key.
+    static constexpr std::string_view FORMAT_NAME = "moller_trumbore";
+
+    simd_f v0x, v0y, v0z;
+    simd_f e1x, e1y, e1z;
+    simd_f e2x, e2y, e2z;
+    std::array<std::uint32_t, W> triangle_indices;
+
+    // Lanes visible to each ray type and lanes whose back faces are culled
+    // (see set_lane_flags).
+    std::array<simd_f_mask, ray_type_count> visible_to;
+    simd_f_mask back_faces_culled;
+
+    constexpr void set_lane(const std::size_t lane, const triangle<F>& triangle, const std::uint32_t triangle_idx, const surface_flags flags) noexcept {
+        v0x[lane] = triangle.v0.x;
+        v0y[lane] = triangle.v0.y;
+        v0z[lane] = triangle.v0.z;
+        e1x[lane] = triangle.e1.x;
+        e1y[lane] = triangle.e1.y;
+        e1z[lane] = triangle.e1.z;
+        e2x[lane] = triangle.e2.x;
+        e2y[lane] = triangle.e2.y;
+        e2z[lane] = triangle.e2.z;
+        triangle_indices[lane] = triangle_idx;
+        set_lane_flags(*this, lane, flags);
+    }
+
+    using flat = flat_triangle_packet<F, W, 9>;
+
+    [[nodiscard]] constexpr std::array<const simd_f*, 9> components() const noexcept {
+        return {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z};
+    }
+
+    [[nodiscard]] constexpr std::array<simd_f*, 9> components() noexcept {
+        return {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z};
+    }
+
+    [[nodiscard]] constexpr flat flatten() const noexcept {
+        return flatten_packet(*this);
+    }
+
+    [[nodiscard]] static constexpr triangle_packet unflatten(const flat& packed) noexcept {
+        return unflatten_packet<triangle_packet>(packed);
+    }
+
+    // Only the lanes visible to the ray type can hit. With back face culling,
+    // the lanes flagged for it only hit front faces (det > 0).
+    template <ray_type type, bool back_face_culling, F eps>
+    constexpr simd_f_mask intersect(const ray3<F>& ray, simd_f& t, simd_f& u, simd_f& v) const noexcept {
+        const simd_f pvec_x = ray.direction.y * e2z - ray.direction.z * e2y;
+        const simd_f pvec_y = ray.direction.z * e2x - ray.direction.x * e2z;
+        const simd_f pvec_z = ray.direction.x * e2y - ray.direction.y * e2x;
+
+        const simd_f det = e1x * pvec_x + e1y * pvec_y + e1z * pvec_z;
+
+        simd_f_mask mask = visible_to[std::to_underlying(type)];
+        if constexpr (back_face_culling) {
+            mask &= (eps <= det) || (!back_faces_culled && det <= -eps);
+        } else {
+            mask &= eps <= stdx::abs(det);
+        }
+
+        const simd_f inv_det = static_cast<F>(1.) / det;
+
+        const simd_f tvec_x{ray.origin.x - v0x};
+        const simd_f tvec_y{ray.origin.y - v0y};
+        const simd_f tvec_z{ray.origin.z - v0z};
+
+        u = (tvec_x * pvec_x + tvec_y * pvec_y + tvec_z * pvec_z) * inv_det;
+        mask &= (static_cast<F>(0.) <= u) & (u <= static_cast<F>(1.));
+
+        const simd_f qvec_x = tvec_y * e1z - tvec_z * e1y;
+        const simd_f qvec_y = tvec_z * e1x - tvec_x * e1z;
+        const simd_f qvec_z = tvec_x * e1y - tvec_y * e1x;
+
+        v = (ray.direction.x * qvec_x + ray.direction.y * qvec_y + ray.direction.z * qvec_z) * inv_det;
+        mask &= (static_cast<F>(0.) <= v) & (u + v <= static_cast<F>(1.));
+
+        t = (e2x * qvec_x + e2y * qvec_y + e2z * qvec_z) * inv_det;
+        mask &= (eps < t);
+
+        return mask;
+    }
+};
+
+// Leaf packet storing per triangle the affine transform into the space, in
+// which the triangle is the unit triangle (0, 0, 0), (1, 0, 0), (0, 1, 0) in
+// the z = 0 plane (after Woop). The ray is transformed with a few dot
+// products per lane, from which t, u and v follow directly, without any
+// cross products. Takes 12 instead of 9 components per triangle.
+template <typename F, std::size_t W>
+struct woop_triangle_packet {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+    using flat = flat_triangle_packet<F, W, 12>;
+
+    // The transform doesn't keep the vertices, so leaves can't be frustum
+    // culled.
+    static constexpr bool STORES_VERTICES = false;
+
+    static constexpr std::string_view FORMAT_NAME = "woop";
+
+    // Rows of the transform, mapping a point p to u (along e1), v (along e2)
+    // and the distance from the plane in units of the normal e1 x e2.
+    simd_f u_x, u_y, u_z, u_w;
+    simd_f v_x, v_y, v_z, v_w;
+    simd_f n_x, n_y, n_z, n_w;
+    std::array<std::uint32_t, W> triangle_indices;
+    std::array<simd_f_mask, ray_type_count> visible_to;
+    simd_f_mask back_faces_culled;
+
+    constexpr void set_lane(const std::size_t lane, const triangle<F>& triangle, const std::uint32_t triangle_idx, const surface_flags flags) noexcept {
+        const vec3<F> normal = cross(triangle.e1, triangle.e2);
+        const F det = dot(normal, normal);
+
+        // The rows are the reciprocal basis of (e1, e2, normal). Degenerate
+        // triangles keep all rows zero, so their lanes never hit.
+        vec3<F> u_row{}, v_row{}, n_row{};
+        if (det != static_cast<F>(0.)) {
+            const F inv_det = static_cast<F>(1.) / det;
+            u_row = inv_det * cross(triangle.e2, normal);
+            v_row = inv_det * cross(normal, triangle.e1);
+            n_row = inv_det * normal;
+        }
+
+        u_x[lane] = u_row.x;
+        u_y[lane] = u_row.y;
+        u_z[lane] = u_row.z;
+        u_w[lane] = -dot(u_row, triangle.v0);
+        v_x[lane] = v_row.x;
+        v_y[lane] = v_row.y;
+        v_z[lane] = v_row.z;
+        v_w[lane] = -dot(v_row, triangle.v0);
+        n_x[lane] = n_row.x;
+        n_y[lane] = n_row.y;
+        n_z[lane] = n_row.z;
+        n_w[lane] = -dot(n_row, triangle.v0);
+        triangle_indices[lane] = triangle_idx;
+        set_lane_flags(*this, lane, flags);
+    }
+
+    [[nodiscard]] constexpr std::array<const simd_f*, 12> components() const noexcept {
+        return {&u_x, &u_y, &u_z, &u_w, &v_x, &v_y, &v_z, &v_w, &n_x, &n_y, &n_z, &n_w};
+    }
+
+    [[nodiscard]] constexpr std::array<simd_f*, 12> components() noexcept {
+        return {&u_x, &u_y, &u_z, &u_w, &v_x, &v_y, &v_z, &v_w, &n_x, &n_y, &n_z, &n_w};
+    }
+
+    [[nodiscard]] constexpr flat flatten() const noexcept {
+        return flatten_packet(*this);
+    }
+
+    [[nodiscard]] static constexpr woop_triangle_packet unflatten(const flat& packed) noexcept {
+        return unflatten_packet<woop_triangle_packet>(packed);
+    }
+
+    // The normal row is e1 x e2 / |e1 x e2|^2, so a front face (Möller-
+    // Trumbore's det = -d . (e1 x e2) > 0) has a negative normal component of
+    // the direction. Unlike Möller-Trumbore no epsilon is applied to it, only
+    // exactly parallel rays are rejected.
+    template <ray_type type, bool back_face_culling, F eps>
+    constexpr simd_f_mask intersect(const ray3<F>& ray, simd_f& t, simd_f& u, simd_f& v) const noexcept {
+        const simd_f origin_n = n_x * ray.origin.x + n_y * ray.origin.y + n_z * ray.origin.z + n_w;
+        const simd_f direction_n = n_x * ray.direction.x + n_y * ray.direction.y + n_z * ray.direction.z;
+
+        simd_f_mask mask = visible_to[std::to_underlying(type)];
+        if constexpr (back_face_culling) {
+            mask &= (direction_n < static_cast<F>(0.)) || (!back_faces_culled && static_cast<F>(0.) < direction_n);
+        } else {
+            mask &= direction_n != static_cast<F>(0.);
+        }
+
+        t = -origin_n / direction_n;
+
+        u = u_x * ray.origin.x + u_y * ray.origin.y + u_z * ray.origin.z + u_w +
+            t * (u_x * ray.direction.x + u_y * ray.direction.y + u_z * ray.direction.z);
+        mask &= (static_cast<F>(0.) <= u) & (u <= static_cast<F>(1.));
+
+        v = v_x * ray.origin.x + v_y * ray.origin.y + v_z * ray.origin.z + v_w +
+            t * (v_x * ray.direction.x + v_y * ray.direction.y + v_z * ray.direction.z);
+        mask &= (static_cast<F>(0.) <= v) & (u + v <= static_cast<F>(1.));
+
+        mask &= (eps < t);
+
+        return mask;
+    }
+};
+
+// Leaf packet storing the Plücker coordinates (direction and moment) of the
+// three edges and the triangle's plane. The side of the ray on which each edge
+// passes is a permuted inner product with the ray's own Plücker coordinates,
+// whose moment is computed once per ray instead of once per lane, and the
+// three sides are the (unnormalized) barycentric coordinates of the hit.
+// Takes 22 instead of 9 components per triangle.
+template <typename F, std::size_t W>
+struct plucker_triangle_packet {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+    using flat = flat_triangle_packet<F, W, 22>;
+
+    static constexpr bool STORES_VERTICES = false;
+    static constexpr std::string_view FORMAT_NAME = "plucker";
+
+    // Edge i is the one opposite of vertex i, as {direction, moment}
+    // components.
+    std::array<std::array<simd_f, 6>, 3> edges;
+    simd_f n_x, n_y, n_z, n_d;
+    std::array<std::uint32_t, W> triangle_indices;
+    std::array<simd_f_mask, ray_type_count> visible_to;
+    simd_f_mask back_faces_culled;
+
+    constexpr void set_lane(const std::size_t lane, const triangle<F>& triangle, const std::uint32_t triangle_idx, const surface_flags flags) noexcept {
+        const std::array<vec3<F>, 3> vertices{triangle.v0, triangle.v0 + triangle.e1, triangle.v0 + triangle.e2};
+
+        for (std::size_t edge = 0; edge < 3; ++edge) {
+            const vec3<F>& from = vertices[(edge + 1) % 3];
+            const vec3<F>& to = vertices[(edge + 2) % 3];
+            const vec3<F> direction = to - from;
+            const vec3<F> moment = cross(from, to);
+
+            edges[edge][0][lane] = direction.x;
+            edges[edge][1][lane] = direction.y;
+            edges[edge][2][lane] = direction.z;
+            edges[edge][3][lane] = moment.x;
+            edges[edge][4][lane] = moment.y;
+            edges[edge][5][lane] = moment.z;
+        }
+
+        const vec3<F> normal = cross(triangle.e1, triangle.e2);
+        n_x[lane] = normal.x;
+        n_y[lane] = normal.y;
+        n_z[lane] = normal.z;
+        n_d[lane] = dot(normal, triangle.v0);
+        triangle_indices[lane] = triangle_idx;
+        set_lane_flags(*this, lane, flags);
+    }
+
+    [[nodiscard]] constexpr std::array<const simd_f*, 22> components() const noexcept {
+        std::array<const simd_f*, 22> result;
+        for (std::size_t i = 0; i < 18; ++i) {
+            result[i] = &edges[i / 6][i % 6];
+        }
+        result[18] = &n_x;
+        result[19] = &n_y;
+        result[20] = &n_z;
+        result[21] = &n_d;
+
+        return result;
+    }
+
+    [[nodiscard]] constexpr std::array<simd_f*, 22> components() noexcept {
+        std::array<simd_f*, 22> result;
+        for (std::size_t i = 0; i < 18; ++i) {
+            result[i] = &edges[i / 6][i % 6];
+        }
+        result[18] = &n_x;
+        result[19] = &n_y;
+        result[20] = &n_z;
+        result[21] = &n_d;
+
+        return result;
+    }
+
+    [[nodiscard]] constexpr flat flatten() const noexcept {
+        return flatten_packet(*this);
+    }
+
+    [[nodiscard]] static constexpr plucker_triangle_packet unflatten(const flat& packed) noexcept {
+        return unflatten_packet<plucker_triangle_packet>(packed);
+    }
+
+    // The sides sum up to d . (e1 x e2), so their negated sum is exactly
+    // Möller-Trumbore's determinant and the same epsilon test applies.
+    template <ray_type type, bool back_face_culling, F eps>
+    constexpr simd_f_mask intersect(const ray3<F>& ray, simd_f& t, simd_f& u, simd_f& v) const noexcept {
+        const vec3<F> ray_moment = cross(ray.origin, ray.direction);
+
+        std::array<simd_f, 3> sides;
+        for (std::size_t edge = 0; edge < 3; ++edge) {
+            const auto& e = edges[edge];
+            sides[edge] = ray.direction.x * e[3] + ray.direction.y * e[4] + ray.direction.z * e[5] +
+                          ray_moment.x * e[0] + ray_moment.y * e[1] + ray_moment.z * e[2];
+        }
+
+        const simd_f sum = sides[0] + sides[1] + sides[2];
+
+        simd_f_mask mask = visible_to[std::to_underlying(type)];
+        if constexpr (back_face_culling) {
+            mask &= (eps <= -sum) || (!back_faces_culled && eps <= sum);
+        } else {
+            mask &= eps <= stdx::abs(sum);
+        }
+
+        const simd_f inv_sum = static_cast<F>(1.) / sum;
+
+        const simd_f w = sides[0] * inv_sum;
+        u = sides[1] * inv_sum;
+        v = sides[2] * inv_sum;
+        mask &= (static_cast<F>(0.) <= w) & (static_cast<F>(0.) <= u) & (static_cast<F>(0.) <= v);
+
+        // The sides of small triangles far from the origin cancel out a lot,
+        // so t is divided by the directly computed d . (e1 x e2) instead.
+        const simd_f direction_n = n_x * ray.direction.x + n_y * ray.direction.y + n_z * ray.direction.z;
+        t = (n_d - (n_x * ray.origin.x + n_y * ray.origin.y + n_z * ray.origin.z)) / direction_n;
+        mask &= (eps < t);
+
+        return mask;
+    }
+};
+
+// The closest triangle hit in the leaf packets so far, by its packet and
+// lane.
+template <typename F>
+struct packet_hit_candidate {
+    F t;
+    F u;
+    F v;
+
+    std::size_t pack_idx;
+    std::size_t lane;
+};
+
+// Tests the ray against the packet and replaces closest_hit by the packet's
+// nearest hit if that is closer. Of equally near lanes the first one wins.
+template <ray_type type, bool back_face_culling, typename F, F eps, typename P>
+constexpr void intersect_closest(const P& pack, const std::size_t pack_idx, const ray3<F>& ray, std::optional<packet_hit_candidate<F>>& closest_hit) noexcept {
+    typename P::simd_f t, u, v;
+    typename P::simd_f_mask mask = pack.template intersect<type, back_face_culling, eps>(ray, t, u, v);
+
+    if (stdx::none_of(mask)) {
+        return;
+    }
+
+    const F best_t = closest_hit ? closest_hit->t : std::numeric_limits<F>::max();
+    stdx::where(!mask, t) = best_t;
+
+    const F t_min = stdx::hmin(t);
+    if (best_t <= t_min) {
+        return;
+    }
+
+    mask = (t == t_min);
+
+    const std::size_t winning_lane = stdx::find_first_set(mask);
+
+    closest_hit = packet_hit_candidate<F>{
+        t[winning_lane],
+        u[winning_lane],
+        v[winning_lane],
+        pack_idx,
+        winning_lane
+    };
+}
+
+// The lanes of the packet visible to shadow rays which the ray hits within
+// (eps, t_max), for any-hit queries. Both sides of the triangles are hit.
+template <typename F, F eps, typename P>
+constexpr typename P::simd_f_mask hits_within(const P& pack, const ray3<F>& ray, const F t_max) noexcept {
+    typename P::simd_f t, u, v;
+    const typename P::simd_f_mask mask = pack.template intersect<ray_type::shadow, false, eps>(ray, t, u, v);
+
+    return mask && (t < t_max);
+}
+
+// Appends the packets of the given triangles (indices into triangle_refs)
+// to packs, filling the lanes of the last packet with its last triangle.
+template <typename P, typename F, std::ranges::random_access_range R>
+requires std::ranges::sized_range<R>
+constexpr void append_packets(std::vector<P>& packs, const scene<F>& scene, std::span<const triangle_ref> triangle_refs, std::span<const surface_flags> mesh_flags, R&& triangle_indices) {
+    constexpr std::size_t W = P::simd_f::size();
+    const std::size_t triangle_count = std::ranges::size(triangle_indices);
+
+    for (std::size_t i = 0; i < triangle_count; i += W) {
+        P pack{};
+        for (std::size_t lane = 0; lane < W; ++lane) {
+            const std::uint32_t triangle_idx = triangle_indices[std::min(i + lane, triangle_count - 1)];
+
+            const auto ref = triangle_refs[triangle_idx];
+
+            pack.set_lane(lane, triangle_at(scene, ref), triangle_idx, mesh_flags[ref.mesh_idx]);
+        }
+
+        packs.push_back(pack);
+    }
+}
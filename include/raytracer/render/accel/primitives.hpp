@@ -0,0 +1,335 @@
+#pragma once
+
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <experimental/simd>
+
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/render/accel/accel.hpp>
+#include <raytracer/render/accel/packet_formats.hpp>
+#include <raytracer/scene/scene.hpp>
+
+namespace stdx = std::experimental;
+
+// Packets of W analytic primitives of one shape, laid out like the triangle
+// leaf packets: one simd component per shape parameter, the scene indices of
+// the lanes' primitives and their surface flags (see set_lane_flags). Unused
+// lanes are visible to no ray type, so they never hit.
+template <typename F, std::size_t W>
+struct sphere_packet {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+
+    simd_f c_x{}, c_y{}, c_z{}, r_squared{};
+    std::array<std::uint32_t, W> primitive_indices{};
+    std::array<simd_f_mask, ray_type_count> visible_to{};
+    simd_f_mask back_faces_culled{};
+
+    constexpr void set_lane(const std::size_t lane, const sphere<F>& sphere, const std::uint32_t primitive_idx, const surface_flags flags) noexcept {
+        c_x[lane] = sphere.center.x;
+        c_y[lane] = sphere.center.y;
+        c_z[lane] = sphere.center.z;
+        r_squared[lane] = sphere.radius * sphere.radius;
+        primitive_indices[lane] = primitive_idx;
+        set_lane_flags(*this, lane, flags);
+    }
+
+    // Same quadratic as sphere::intersect. A lane falls back to the far root
+    // (the exit from the inside) unless its back faces are culled.
+    template <ray_type type, bool back_face_culling, F eps>
+    constexpr simd_f_mask intersect(const ray3<F>& ray, simd_f& t) const noexcept {
+        const simd_f oc_x = ray.origin.x - c_x;
+        const simd_f oc_y = ray.origin.y - c_y;
+        const simd_f oc_z = ray.origin.z - c_z;
+
+        const F a = dot(ray.direction, ray.direction);
+        const simd_f b = oc_x * ray.direction.x + oc_y * ray.direction.y + oc_z * ray.direction.z;
+        const simd_f c = oc_x * oc_x + oc_y * oc_y + oc_z * oc_z - r_squared;
+
+        const simd_f discriminant = b * b - a * c;
+        simd_f_mask mask = visible_to[std::to_underlying(type)] && (static_cast<F>(0.) <= discriminant);
+
+        // GCC 12's AVX-512 sqrt intrinsic passes an "undefined" vector as the
+        // unused merge source, which -Wuninitialized reports once inlined.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+        const simd_f root = stdx::sqrt(stdx::max(discriminant, simd_f(static_cast<F>(0.))));
+#pragma GCC diagnostic pop
+        t = (-b - root) / a;
+
+        simd_f_mask exits = !(eps < t);
+        if constexpr (back_face_culling) {
+            exits &= !back_faces_culled;
+        }
+        stdx::where(exits, t) = (-b + root) / a;
+
+        return mask && (eps < t);
+    }
+};
+
+template <typename F, std::size_t W>
+struct plane_packet {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+
+    simd_f n_x{}, n_y{}, n_z{}, n_d{};
+    std::array<std::uint32_t, W> primitive_indices{};
+    std::array<simd_f_mask, ray_type_count> visible_to{};
+    simd_f_mask back_faces_culled{};
+
+    constexpr void set_lane(const std::size_t lane, const plane<F>& plane, const std::uint32_t primitive_idx, const surface_flags flags) noexcept {
+        n_x[lane] = plane.normal.x;
+        n_y[lane] = plane.normal.y;
+        n_z[lane] = plane.normal.z;
+        n_d[lane] = plane.offset;
+        primitive_indices[lane] = primitive_idx;
+        set_lane_flags(*this, lane, flags);
+    }
+
+    template <ray_type type, bool back_face_culling, F eps>
+    constexpr simd_f_mask intersect(const ray3<F>& ray, simd_f& t) const noexcept {
+        const simd_f direction_n = n_x * ray.direction.x + n_y * ray.direction.y + n_z * ray.direction.z;
+
+        simd_f_mask mask = visible_to[std::to_underlying(type)];
+        if constexpr (back_face_culling) {
+            mask &= (direction_n < static_cast<F>(0.)) || (!back_faces_culled && static_cast<F>(0.) < direction_n);
+        } else {
+            mask &= direction_n != static_cast<F>(0.);
+        }
+
+        t = (n_d - (n_x * ray.origin.x + n_y * ray.origin.y + n_z * ray.origin.z)) / direction_n;
+
+        return mask && (eps < t);
+    }
+};
+
+template <typename F, std::size_t W>
+struct disk_packet {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+
+    simd_f n_x{}, n_y{}, n_z{}, n_d{};
+    simd_f c_x{}, c_y{}, c_z{}, r_squared{};
+    std::array<std::uint32_t, W> primitive_indices{};
+    std::array<simd_f_mask, ray_type_count> visible_to{};
+    simd_f_mask back_faces_culled{};
+
+    constexpr void set_lane(const std::size_t lane, const disk<F>& disk, const std::uint32_t primitive_idx, const surface_flags flags) noexcept {
+        n_x[lane] = disk.surface.normal.x;
+        n_y[lane] = disk.surface.normal.y;
+        n_z[lane] = disk.surface.normal.z;
+        n_d[lane] = disk.surface.offset;
+        c_x[lane] = disk.center().x;
+        c_y[lane] = disk.center().y;
+        c_z[lane] = disk.center().z;
+        r_squared[lane] = disk.radius * disk.radius;
+        primitive_indices[lane] = primitive_idx;
+        set_lane_flags(*this, lane, flags);
+    }
+
+    // The plane test of plane_packet, followed by the distance of the hit
+    // from the center.
+    template <ray_type type, bool back_face_culling, F eps>
+    constexpr simd_f_mask intersect(const ray3<F>& ray, simd_f& t) const noexcept {
+        const simd_f direction_n = n_x * ray.direction.x + n_y * ray.direction.y + n_z * ray.direction.z;
+
+        simd_f_mask mask = visible_to[std::to_underlying(type)];
+        if constexpr (back_face_culling) {
+            mask &= (direction_n < static_cast<F>(0.)) || (!back_faces_culled && static_cast<F>(0.) < direction_n);
+        } else {
+            mask &= direction_n != static_cast<F>(0.);
+        }
+
+        t = (n_d - (n_x * ray.origin.x + n_y * ray.origin.y + n_z * ray.origin.z)) / direction_n;
+
+        const simd_f offset_x = ray.origin.x + t * ray.direction.x - c_x;
+        const simd_f offset_y = ray.origin.y + t * ray.direction.y - c_y;
+        const simd_f offset_z = ray.origin.z + t * ray.direction.z - c_z;
+
+        return mask && (eps < t) && (offset_x * offset_x + offset_y * offset_y + offset_z * offset_z <= r_squared);
+    }
+};
+
+// The scene's analytic primitives, for the acceleration structures to test
+// next to their triangles. The primitives are grouped by shape into packets
+// and every packet is tested with its SIMD kernel, without any tree: scenes
+// have few of them, each replacing a whole mesh, and planes are unbounded
+// anyway. An empty set (e.g. of a bottom level structure, which only holds
+// meshes) costs a few size checks per ray.
+template <typename F, F eps, std::size_t W = stdx::native_simd<F>::size()>
+struct primitive_set {
+    using simd_f = stdx::fixed_size_simd<F, W>;
+    using simd_f_mask = simd_f::mask_type;
+
+    static constexpr F MAX_F = std::numeric_limits<F>::max();
+
+    std::vector<sphere_packet<F, W>> sphere_packs;
+    std::vector<plane_packet<F, W>> plane_packs;
+    std::vector<disk_packet<F, W>> disk_packs;
+
+    constexpr primitive_set() = default;
+
+    explicit primitive_set(const scene<F>& scene) {
+        std::array<std::size_t, std::variant_size_v<shape_variant<F>>> counts{};
+
+        for (std::size_t primitive_idx = 0; primitive_idx < scene.primitives.size(); ++primitive_idx) {
+            const auto& primitive = scene.primitives[primitive_idx];
+            const surface_flags flags = primitive_surface_flags(scene, primitive_idx);
+
+            std::visit([&](const auto& shape) {
+                using S = std::decay_t<decltype(shape)>;
+
+                auto& packs = packs_of<S>();
+                const std::size_t lane = counts[primitive.shape.index()]++ % W;
+                if (lane == 0) {
+                    packs.emplace_back();
+                }
+
+                packs.back().set_lane(lane, shape, static_cast<std::uint32_t>(primitive_idx), flags);
+            }, primitive.shape);
+        }
+    }
+
+    template <typename S>
+    [[nodiscard]] constexpr auto& packs_of() noexcept {
+        if constexpr (std::same_as<S, sphere<F>>) {
+            return sphere_packs;
+        } else if constexpr (std::same_as<S, plane<F>>) {
+            return plane_packs;
+        } else {
+            return disk_packs;
+        }
+    }
+
+    [[nodiscard]] constexpr bool empty() const noexcept {
+        return sphere_packs.empty() && plane_packs.empty() && disk_packs.empty();
+    }
+
+    // The closer of the triangle hit found by the structure and the closest
+    // primitive hit, so the structures only have to pass their hit through.
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit<F>> closest_hit(const scene<F>& scene, const ray3<F>& ray, std::optional<hit<F>> triangle_hit) const noexcept {
+        if (empty()) {
+            return triangle_hit;
+        }
+
+        F best_t = triangle_hit ? triangle_hit->distance : MAX_F;
+        std::optional<std::uint32_t> closest_primitive;
+
+        intersect_packs<type, back_face_culling>(sphere_packs, ray, best_t, closest_primitive);
+        intersect_packs<type, back_face_culling>(plane_packs, ray, best_t, closest_primitive);
+        intersect_packs<type, back_face_culling>(disk_packs, ray, best_t, closest_primitive);
+
+        if (!closest_primitive) {
+            return triangle_hit;
+        }
+
+        return make_primitive_hit(scene, *closest_primitive, ray, best_t);
+    }
+
+    [[nodiscard]] constexpr bool occluded(const ray3<F>& ray, const F max_t) const noexcept {
+        return occluded_packs(sphere_packs, ray, max_t) || occluded_packs(plane_packs, ray, max_t) || occluded_packs(disk_packs, ray, max_t);
+    }
+
+    template <ray_type type, bool back_face_culling, typename P>
+    static constexpr void intersect_packs(const std::vector<P>& packs, const ray3<F>& ray, F& best_t, std::optional<std::uint32_t>& closest_primitive) noexcept {
+        for (const auto& pack : packs) {
+            if (stdx::none_of(pack.visible_to[std::to_underlying(type)])) {
+                continue;
+            }
+
+            simd_f t;
+            simd_f_mask mask = pack.template intersect<type, back_face_culling, eps>(ray, t);
+            mask &= t < best_t;
+
+            if (stdx::none_of(mask)) {
+                continue;
+            }
+
+            stdx::where(!mask, t) = best_t;
+            best_t = stdx::hmin(t);
+            closest_primitive = pack.primitive_indices[stdx::find_first_set(t == best_t)];
+        }
+    }
+
+    template <typename P>
+    static constexpr bool occluded_packs(const std::vector<P>& packs, const ray3<F>& ray, const F max_t) noexcept {
+        for (const auto& pack : packs) {
+            if (stdx::none_of(pack.visible_to[std::to_underlying(ray_type::shadow)])) {
+                continue;
+            }
+
+            simd_f t;
+            if (stdx::any_of(pack.template intersect<ray_type::shadow, false, eps>(ray, t) && (t < max_t))) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+// Same interface for the scalar structures, which test every primitive on
+// its own with the shapes' scalar intersection.
+template <typename F, F eps>
+struct scalar_primitive_set {
+    std::vector<surface_flags> primitive_flags;
+
+    constexpr scalar_primitive_set() = default;
+
+    explicit scalar_primitive_set(const scene<F>& scene) {
+        primitive_flags.reserve(scene.primitives.size());
+        for (std::size_t primitive_idx = 0; primitive_idx < scene.primitives.size(); ++primitive_idx) {
+            primitive_flags.push_back(primitive_surface_flags(scene, primitive_idx));
+        }
+    }
+
+    template <ray_type type, bool back_face_culling>
+    [[nodiscard]] constexpr std::optional<hit<F>> closest_hit(const scene<F>& scene, const ray3<F>& ray, std::optional<hit<F>> best_hit) const noexcept {
+        for (std::size_t primitive_idx = 0; primitive_idx < primitive_flags.size(); ++primitive_idx) {
+            const auto flags = primitive_flags[primitive_idx];
+            if (!flags.visible(type)) {
+                continue;
+            }
+
+            const auto t = std::visit([&](const auto& shape) {
+                return back_face_culling && flags.back_face_culling
+                    ? shape.template intersect<true, eps>(ray)
+                    : shape.template intersect<false, eps>(ray);
+            }, scene.primitives[primitive_idx].shape);
+
+            if (t && (!best_hit || *t < best_hit->distance)) {
+                best_hit = make_primitive_hit(scene, primitive_idx, ray, *t);
+            }
+        }
+
+        return best_hit;
+    }
+
+    [[nodiscard]] constexpr bool occluded(const scene<F>& scene, const ray3<F>& ray, const F max_t) const noexcept {
+        for (std::size_t primitive_idx = 0; primitive_idx < primitive_flags.size(); ++primitive_idx) {
+            if (!primitive_flags[primitive_idx].visible(ray_type::shadow)) {
+                continue;
+            }
+
+            const auto t = std::visit([&](const auto& shape) {
+                return shape.template intersect<false, eps>(ray);
+            }, scene.primitives[primitive_idx].shape);
+
+            if (t && *t < max_t) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <raytracer/render/accel/accel.hpp>
+
+// Build quality of an acceleration structure, as gathered by its
+// build_stats, for tracking how builder changes affect the trees of the same
+// scenes (see write_accel_stats for the JSON report).
+struct accel_stats {
+    std::size_t triangle_count = 0;
+    std::size_t inner_node_count = 0;
+    std::size_t leaf_count = 0;
+    std::size_t empty_leaf_count = 0;
+
+    // The number of leaves at every depth, the root being at depth 0.
+    std::vector<std::size_t> leaf_depth_histogram;
+
+    // Triangles referenced by all the leaves together, which is more than
+    // triangle_count where triangles were duplicated into several leaves.
+    std::size_t triangle_reference_count = 0;
+
+    // The leaf packets and their lanes which hold a triangle, the others
+    // repeat the packet's last triangle as padding.
+    std::size_t packet_count = 0;
+    std::size_t packet_width = 0;
+    std::size_t used_lane_count = 0;
+
+    double sah_cost = 0.;
+
+    // The size of each of the structure's arrays, by name.
+    std::vector<std::pair<std::string, std::size_t>> memory_bytes;
+
+    constexpr void add_leaf(const std::size_t depth, const std::size_t packets, const std::size_t used_lanes) {
+        if (leaf_depth_histogram.size() <= depth) {
+            leaf_depth_histogram.resize(depth + 1, 0);
+        }
+
+        ++leaf_depth_histogram[depth];
+        ++leaf_count;
+        empty_leaf_count += packets == 0 ? 1 : 0;
+        packet_count += packets;
+        used_lane_count += used_lanes;
+        triangle_reference_count += used_lanes;
+    }
+
+    [[nodiscard]] constexpr std::size_t max_depth() const noexcept {
+        return leaf_depth_histogram.empty() ? 0 : leaf_depth_histogram.size() - 1;
+    }
+
+    [[nodiscard]] constexpr double average_leaf_depth() const noexcept {
+        std::size_t depth_sum = 0;
+        for (std::size_t depth = 0; depth < leaf_depth_histogram.size(); ++depth) {
+            depth_sum += depth * leaf_depth_histogram[depth];
+        }
+
+        return leaf_count == 0 ? 0. : static_cast<double>(depth_sum) / static_cast<double>(leaf_count);
+    }
+
+    [[nodiscard]] constexpr double duplication_factor() const noexcept {
+        return triangle_count == 0 ? 1. : static_cast<double>(triangle_reference_count) / static_cast<double>(triangle_count);
+    }
+
+    [[nodiscard]] constexpr double lane_occupancy() const noexcept {
+        return packet_count == 0 ? 0. : static_cast<double>(used_lane_count) / static_cast<double>(packet_count * packet_width);
+    }
+
+    [[nodiscard]] constexpr std::size_t total_memory_bytes() const noexcept {
+        std::size_t total = 0;
+        for (const auto& [name, bytes] : memory_bytes) {
+            total += bytes;
+        }
+
+        return total;
+    }
+};
+
+// The lanes of a leaf packet which hold a triangle. The builders pad the last
+// packet of a leaf by repeating its last triangle, and a leaf references
+// every triangle at most once, so a lane is padding exactly when it repeats
+// the lane before it.
+template <typename P>
+[[nodiscard]] constexpr std::size_t used_lanes(const P& pack) noexcept {
+    std::size_t used = 1;
+    for (std::size_t lane = 1; lane < pack.triangle_indices.size(); ++lane) {
+        used += pack.triangle_indices[lane] != pack.triangle_indices[lane - 1] ? 1 : 0;
+    }
+
+    return used;
+}
+
+// The bytes taken by the elements of the vector (without its spare capacity).
+template <typename T>
+[[nodiscard]] constexpr std::size_t vector_bytes(const std::vector<T>& elements) noexcept {
+    return elements.size() * sizeof(T);
+}
+
+// Structures which can report the quality of their build.
+template <typename A, typename F>
+concept stats_accelerator = accelerator<A, F> && requires(const A accel) {
+    { accel.build_stats() } -> std::same_as<accel_stats>;
+};
@@ -17,5 +17,5 @@ struct hit {
     F u;
     F v;
     F w;
-    std::size_t mesh_idx;
+    std::size_t material_idx;
 };
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <string_view>
 #include <thread>
 
 #include <raytracer/config.hpp>
+#include <raytracer/core/math/frustum3.hpp>
 #include <raytracer/scene/scene.hpp>
 #include <raytracer/scene/material/queries.hpp>
 #include <raytracer/scene/texture/queries.hpp>
@@ -12,66 +17,206 @@
 #include <raytracer/render/tile/single.hpp>
 #include <raytracer/render/tile/region.hpp>
 #include <raytracer/render/tile/bucket.hpp>
+#include <raytracer/utils/allocation_count.hpp>
 #include <raytracer/utils/rand.hpp>
 #include <raytracer/utils/convert.hpp>
 
+// The camera ray through the given raster position, in pixels from the top
+// left corner of the image.
+template <typename F>
+constexpr ray3<F> camera_ray(const scene<F>& scene, const F raster_x, const F raster_y) noexcept {
+    const std::size_t image_height = scene.config.image_height;
+    const std::size_t image_width = scene.config.image_width;
+    const F aspect_ratio = static_cast<F>(image_width) / image_height;
+
+    const F ndc_x = raster_x / image_width;
+    const F ndc_y = raster_y / image_height;
+
+    F screen_x = (static_cast<F>(2.) * ndc_x) - static_cast<F>(1.);
+    F screen_y = static_cast<F>(1.) - (static_cast<F>(2.) * ndc_y);
+
+    screen_x *= aspect_ratio;
+
+    const F fov_radians = degrees_to_radians(fov_degrees);
+    screen_x *= std::tan(fov_radians / static_cast<F>(2.));
+    screen_y *= std::tan(fov_radians / static_cast<F>(2.));
+
+    vec3<F> direction{screen_x, screen_y, static_cast<F>(-1.)};
+    direction = normalized(transpose(scene.viewpoint.matrix) * direction);
+
+    return ray3<F>(scene.viewpoint.position, direction);
+}
+
+// The frustum around all camera rays through the tile, including jittered
+// ones. It is spanned by the rays through the tile's corners, as the camera
+// ray of any raster position inside is a positive combination of those.
+template <typename F>
+constexpr std::optional<frustum3<F>> tile_frustum(const scene<F>& scene, const render_tile& tile) noexcept {
+    const F x0 = static_cast<F>(tile.x0);
+    const F y0 = static_cast<F>(tile.y0);
+    const F x1 = static_cast<F>(tile.x1);
+    const F y1 = static_cast<F>(tile.y1);
+
+    const std::array<vec3<F>, 4> corner_directions{
+        camera_ray(scene, x0, y0).direction,
+        camera_ray(scene, x1, y0).direction,
+        camera_ray(scene, x0, y1).direction,
+        camera_ray(scene, x1, y1).direction
+    };
+
+    return frustum3<F>::around(scene.viewpoint.position, corner_directions);
+}
+
+// How the color of a camera hit is computed: with the recursive
+// Whitted-style color_hit, which follows every ray a hit spawns, or with the
+// iterative trace_path, which follows a single path.
+enum struct integrator_type {
+    WHITTED,
+    PATH,
+};
+
+[[nodiscard]] constexpr std::optional<integrator_type> parse_integrator_type(const std::string_view name) noexcept {
+    if (name == "whitted") {
+        return integrator_type::WHITTED;
+    }
+    if (name == "path") {
+        return integrator_type::PATH;
+    }
+
+    return std::nullopt;
+}
+
 template <typename A, typename F>
-constexpr image<F> render_frame(const A& accel, const scheduling_type threading)
+constexpr image<F> render_frame(const A& accel, const scheduling_type threading, const integrator_type integrator = integrator_type::WHITTED)
 requires accelerator<A, F> {
     const scene<F>& scene = *accel.scene_ptr;
 
     const std::size_t image_height = scene.config.image_height;
     const std::size_t image_width = scene.config.image_width;
-    const camera<F> camera = scene.viewpoint;
     const color<F> background_color = scene.config.background_color;
-    const F aspect_ratio = static_cast<F>(image_width) / image_height;
 
-    std::vector<std::vector<color<F>>> pixels(image_height, std::vector<color<F>>(image_width, background_color));
-    const auto tile_worker = [&](render_tile tile) {
-        for (std::size_t y = tile.y0; y < tile.y1; ++y) {
-            for (std::size_t x = tile.x0; x < tile.x1; ++x) {
-                color<F> final_color{};
-
-                for (std::size_t s = 0; s < samples_per_pixel; ++s) {
-                    F raster_x = x;
-                    F raster_y = y;
-
-                    if constexpr (samples_per_pixel == 1) {
-                        raster_x += static_cast<F>(0.5);
-                        raster_y += static_cast<F>(0.5);
-                    } else {
-                        raster_x += urand01<F>();
-                        raster_y += urand01<F>();
-                    }
+    std::vector<color<F>> pixels(image_height * image_width, background_color);
 
-                    const F ndc_x = raster_x / image_width;
-                    const F ndc_y = raster_y / image_height;
+    const auto primary_ray = [&](const std::size_t x, const std::size_t y) {
+        F raster_x = x;
+        F raster_y = y;
 
-                    F screen_x = (static_cast<F>(2.) * ndc_x) - static_cast<F>(1.);
-                    F screen_y = static_cast<F>(1.) - (static_cast<F>(2.) * ndc_y);
+        if constexpr (samples_per_pixel == 1) {
+            raster_x += static_cast<F>(0.5);
+            raster_y += static_cast<F>(0.5);
+        } else {
+            raster_x += urand01<F>();
+            raster_y += urand01<F>();
+        }
 
-                    screen_x *= aspect_ratio;
+        return camera_ray(scene, raster_x, raster_y);
+    };
 
-                    const F fov_radians = degrees_to_radians(fov_degrees);
-                    screen_x *= std::tan(fov_radians / static_cast<F>(2.));
-                    screen_y *= std::tan(fov_radians / static_cast<F>(2.));
+    constexpr std::size_t packet_rays = packet_size * packet_size;
 
-                    vec3<F> direction{screen_x, screen_y, static_cast<F>(-1.)};
-                    direction = normalized(transpose(camera.matrix) * direction);
+    const auto tile_worker = [&](render_tile tile) {
+        // Structures which support it start all camera rays of the tile at
+        // the node enclosing the tile's frustum instead of at their root.
+        [[maybe_unused]] const auto camera_root = [&] {
+            if constexpr (frustum_accelerator<A, F>) {
+                return tile_frustum(scene, tile).transform([&](const frustum3<F>& frustum) {
+                    return accel.frustum_root(frustum);
+                });
+            } else {
+                return std::nullopt;
+            }
+        }();
 
-                    const ray3<F> ray(camera.position, direction);
+        const auto trace_camera_ray = [&](const ray3<F>& ray) {
+            if constexpr (frustum_accelerator<A, F>) {
+                if (camera_root) {
+                    return accel.template intersect<ray_type::camera>(ray, *camera_root);
+                }
+            }
+
+            return accel.template intersect<ray_type::camera>(ray);
+        };
+
+        const auto trace_camera_packet = [&](const auto& packet) {
+            if constexpr (frustum_packet_accelerator<A, F, packet_rays>) {
+                if (camera_root) {
+                    return accel.template intersect_packet<ray_type::camera>(packet, *camera_root);
+                }
+            }
 
-                    const auto camera_hit = accel.template intersect<true>(ray);
-                    if (camera_hit.has_value()) {
-                        final_color += color_hit(accel, camera_hit.value(), 0uz);
-                    } else {
-                        final_color += background_color;
+            return accel.template intersect_packet<ray_type::camera>(packet);
+        };
+
+        if constexpr (packet_accelerator<A, F, packet_rays>) {
+            // The camera rays of every packet_size x packet_size block of the
+            // tile are traced together as a single coherent packet.
+            for (std::size_t block_y = tile.y0; block_y < tile.y1; block_y += packet_size) {
+                for (std::size_t block_x = tile.x0; block_x < tile.x1; block_x += packet_size) {
+                    std::array<color<F>, packet_rays> final_colors{};
+
+                    for (std::size_t s = 0; s < samples_per_pixel; ++s) {
+                        ray_packet<F, packet_rays> packet{};
+
+                        for (std::size_t lane = 0; lane < packet_rays; ++lane) {
+                            const std::size_t x = block_x + (lane % packet_size);
+                            const std::size_t y = block_y + (lane / packet_size);
+
+                            packet.active[lane] = x < tile.x1 && y < tile.y1;
+                            if (!packet.active[lane]) {
+                                continue;
+                            }
+
+                            const ray3<F> ray = primary_ray(x, y);
+                            packet.origins[lane] = ray.origin;
+                            packet.directions[lane] = ray.direction;
+                        }
+
+                        const auto camera_hits = trace_camera_packet(packet);
+
+                        for (std::size_t lane = 0; lane < packet_rays; ++lane) {
+                            if (!packet.active[lane]) {
+                                continue;
+                            }
+
+                            if (camera_hits[lane].has_value()) {
+                                final_colors[lane] += color_camera_hit(accel, camera_hits[lane].value(), integrator);
+                            } else {
+                                final_colors[lane] += background_color;
+                            }
+                        }
+                    }
+
+                    for (std::size_t lane = 0; lane < packet_rays; ++lane) {
+                        const std::size_t x = block_x + (lane % packet_size);
+                        const std::size_t y = block_y + (lane / packet_size);
+
+                        if (x < tile.x1 && y < tile.y1) {
+                            final_colors[lane] /= static_cast<F>(samples_per_pixel);
+                            pixels[y * image_width + x] = final_colors[lane];
+                        }
                     }
                 }
+            }
+        } else {
+            for (std::size_t y = tile.y0; y < tile.y1; ++y) {
+                for (std::size_t x = tile.x0; x < tile.x1; ++x) {
+                    color<F> final_color{};
+
+                    for (std::size_t s = 0; s < samples_per_pixel; ++s) {
+                        const ray3<F> ray = primary_ray(x, y);
+
+                        const auto camera_hit = trace_camera_ray(ray);
+                        if (camera_hit.has_value()) {
+                            final_color += color_camera_hit(accel, camera_hit.value(), integrator);
+                        } else {
+                            final_color += background_color;
+                        }
+                    }
 
-                final_color /= static_cast<F>(samples_per_pixel);
+                    final_color /= static_cast<F>(samples_per_pixel);
 
-                pixels[y][x] = final_color;
+                    pixels[y * image_width + x] = final_color;
+                }
             }
         }
     };
@@ -90,13 +235,23 @@ requires accelerator<A, F> {
             break;
     }
 
+    // Everything the workers need is allocated before they start, so only
+    // the allocations the workers make themselves count against the frame.
+    allocation_stats::frame_allocations = 0;
+
     std::vector<std::jthread> threads;
     threads.reserve(num_threads);
     for (std::size_t t = 0; t < num_threads; ++t) {
         threads.emplace_back([&] {
+            const std::uint64_t allocations_before = thread_heap_allocations();
+
             while (auto tile = queue.pop()) {
                 tile_worker(*tile);
             }
+
+            if constexpr (count_heap_allocations) {
+                allocation_stats::frame_allocations += thread_heap_allocations() - allocations_before;
+            }
         });
     }
 
@@ -107,198 +262,225 @@ requires accelerator<A, F> {
     return {image_height, image_width, std::move(pixels)};
 }
 
+// Transmissive meshes and the meshes hidden from shadow rays don't cast
+// shadows, so only the others are tested by the accelerator's any-hit query.
 template <typename A, typename F>
-constexpr auto is_occluded(const A& accel, ray3<F> ray, F max_t)
+constexpr auto is_occluded(const A& accel, const ray3<F>& ray, const F max_t)
 requires accelerator<A, F> {
-    const auto& scene = *accel.scene_ptr;
-
-    while (static_cast<F>(0.) < max_t) {
-        const auto maybe_hit = accel.template intersect<false>(ray);
-        if (!maybe_hit.has_value() || max_t < maybe_hit->distance) {
-            return false;
-        }
+    return accel.occluded(ray, max_t);
+}
 
-        const auto& material = scene.materials[scene.meshes[maybe_hit->mesh_idx].material_idx];
-        if (!is_transmissive(material)) {
-            return true;
-        }
+// The level of the structure which traces the diffuse and shadow rays cast
+// at the hit of a ray which has bounced ray_depth times: the coarse one from
+// lod_ray_depth on, if the structure has one, and the detailed one otherwise.
+// The camera, reflection and refraction rays always trace the detailed level.
+template <typename A, typename F>
+constexpr const auto& blurred_ray_level(const A& accel, const std::size_t ray_depth) noexcept
+requires accelerator<A, F> {
+    if constexpr (lod_accelerator<A, F>) {
+        using level = typename A::level_type;
 
-        ray.origin = maybe_hit->position + (static_cast<F>(shadow_bias) * ray.direction);
-        max_t -= maybe_hit->distance;
+        return ray_depth < lod_ray_depth ? static_cast<const level&>(accel) : accel.coarse;
+    } else {
+        return accel;
     }
-
-    return false;
 }
 
+// The light of the scene's lights reflected at the hit by a diffuse surface
+// with the given albedo, leaving out the lights whose shadow rays are
+// occluded.
 template <typename A, typename F>
-constexpr color<F> color_hit(const A& accel, const hit<F>& hit_record, const std::size_t ray_depth) noexcept
+constexpr color<F> direct_lighting(const A& accel, const hit<F>& hit_record, const std::size_t ray_depth, const bool smooth_shading, const color<F>& albedo) noexcept
 requires accelerator<A, F> {
     const auto& scene = *accel.scene_ptr;
 
-    if (ray_depth == max_ray_depth)
-        return scene.config.background_color;
+    color<F> final_color{};
+    for (const auto& light : scene.lights) {
+        const vec3<F> light_position = light.position;
+        vec3<F> light_direction = light_position - hit_record.position;
 
-    auto [incoming_ray, hit_position, hit_normal, face_normal, uvs, hit_distance, u, v, w, mesh_idx] = hit_record;
+        const F sphere_radius = light_direction.len();
+        const F sphere_area = static_cast<F>(4.) * std::numbers::pi_v<F> * sphere_radius * sphere_radius;
 
-    const auto& mesh = scene.meshes[mesh_idx];
-    const auto& material_variant = scene.materials[mesh.material_idx];
+        light_direction = normalized(light_direction);
 
-    return std::visit([&](const auto& material) -> color<F> {
-        using M = std::decay_t<decltype(material)>;
+        F cosine_law;
+        if (smooth_shading) {
+            cosine_law = std::max(static_cast<F>(0.), dot(light_direction, hit_record.hit_normal));
+        } else {
+            cosine_law = std::max(static_cast<F>(0.), dot(light_direction, hit_record.face_normal));
+        }
 
-        if constexpr (std::same_as<M, diffuse_material<F>>) {
-            color<F> final_color{};
-            for (std::size_t i = 0; i < diffuse_reflection_ray_count; ++i) {
-                const vec3<F> right_axis = normalized(cross(incoming_ray.direction, hit_normal));
-                const vec3<F> up_axis = hit_normal;
-                const vec3<F> forward_axis = cross(right_axis, up_axis);
+        const ray3<F> shadow_ray(hit_record.position + (static_cast<F>(shadow_bias) * light_direction), light_direction);
+        if (is_occluded(blurred_ray_level<A, F>(accel, ray_depth), shadow_ray, sphere_radius)) {
+            continue;
+        }
 
-                const mat3<F> local_hit_mat(right_axis, up_axis, forward_axis);
+        final_color += ((light.intensity / sphere_area) * cosine_law) * albedo;
+    }
 
-                const F rand_xy_angle = std::numbers::pi_v<F> * urand01<F>();
-                vec3<F> rand_xy_vec{std::cos(rand_xy_angle), std::sin(rand_xy_angle), 0};
+    return final_color;
+}
 
-                const F rand_xz_angle = std::numbers::pi_v<F> * urand01<F>() * static_cast<F>(2.);
-                const mat3<F> rotate_y_mat{{
-                    std::cos(rand_xz_angle),    static_cast<F>(0.), -std::sin(rand_xz_angle),
-                    static_cast<F>(0.),         static_cast<F>(1.), static_cast<F>(0.),
-                    std::sin(rand_xz_angle),    static_cast<F>(0.), std::cos(rand_xz_angle)
-                }};
+// A diffuse reflection ray in a random direction of the hemisphere around
+// the normal.
+template <typename F>
+constexpr ray3<F> diffuse_reflection_ray(const hit<F>& hit_record) noexcept {
+    const vec3<F> right_axis = normalized(cross(hit_record.ray.direction, hit_record.hit_normal));
+    const vec3<F> up_axis = hit_record.hit_normal;
+    const vec3<F> forward_axis = cross(right_axis, up_axis);
 
-                rand_xy_vec = rotate_y_mat * rand_xy_vec;
+    const mat3<F> local_hit_mat(right_axis, up_axis, forward_axis);
 
-                const vec3<F> diffuse_reflection_ray_origin = hit_position + (static_cast<F>(reflection_bias) * hit_normal);
-                const vec3<F> diffuse_reflection_ray_direction = local_hit_mat * rand_xy_vec;
+    const F rand_xy_angle = std::numbers::pi_v<F> * urand01<F>();
+    vec3<F> rand_xy_vec{std::cos(rand_xy_angle), std::sin(rand_xy_angle), 0};
 
-                const ray3<F> diffuse_reflection_ray{diffuse_reflection_ray_origin, diffuse_reflection_ray_direction};
+    const F rand_xz_angle = std::numbers::pi_v<F> * urand01<F>() * static_cast<F>(2.);
+    const mat3<F> rotate_y_mat{{
+        std::cos(rand_xz_angle),    static_cast<F>(0.), -std::sin(rand_xz_angle),
+        static_cast<F>(0.),         static_cast<F>(1.), static_cast<F>(0.),
+        std::sin(rand_xz_angle),    static_cast<F>(0.), std::cos(rand_xz_angle)
+    }};
 
-                const auto diffuse_reflection_hit = accel.template intersect<false>(diffuse_reflection_ray);
+    rand_xy_vec = rotate_y_mat * rand_xy_vec;
 
-                if (!diffuse_reflection_hit.has_value()) {
-                    continue;
-                }
+    const vec3<F> diffuse_reflection_ray_origin = hit_record.position + (static_cast<F>(reflection_bias) * hit_record.hit_normal);
+    const vec3<F> diffuse_reflection_ray_direction = local_hit_mat * rand_xy_vec;
 
-                final_color += color_hit(accel, diffuse_reflection_hit.value(), ray_depth + 1);
-            }
+    return ray3<F>{diffuse_reflection_ray_origin, diffuse_reflection_ray_direction};
+}
 
-            for (const auto& light : scene.lights) {
-                const vec3<F> light_position = light.position;
-                vec3<F> light_direction = light_position - hit_position;
+template <typename F>
+constexpr ray3<F> mirror_reflection_ray(const hit<F>& hit_record) noexcept {
+    const vec3<F> reflection_direction = hit_record.ray.direction - (static_cast<F>(2.) * dot(hit_record.ray.direction, hit_record.hit_normal) * hit_record.hit_normal);
+    const vec3<F> reflection_origin = hit_record.position + (static_cast<F>(reflection_bias) * reflection_direction);
 
-                const F sphere_radius = light_direction.len();
-                const F sphere_area = static_cast<F>(4.) * std::numbers::pi_v<F> * sphere_radius * sphere_radius;
+    return ray3<F>(reflection_origin, reflection_direction);
+}
 
-                light_direction = normalized(light_direction);
+// The rays leaving a hit on a refractive surface and the share of the light
+// which is reflected (the rest is refracted). Beyond the critical angle all
+// of it is reflected and there is no refraction ray.
+template <typename F>
+struct refraction_split {
+    ray3<F> reflection_ray;
+    std::optional<ray3<F>> refraction_ray;
+    F fresnel;
+};
+
+template <typename F>
+constexpr refraction_split<F> split_at_refraction(const refractive_material<F>& material, const hit<F>& hit_record) noexcept {
+    vec3<F> n = normalized(material.smooth_shading ? hit_record.hit_normal : hit_record.face_normal);
+    vec3<F> i = normalized(hit_record.ray.direction);
+
+    F eta_i = static_cast<F>(1.);
+    F eta_r = material.ior;
+
+    if (static_cast<F>(0.) < dot(i, n)) {
+        std::swap(eta_i, eta_r);
+        n = -n;
+    }
 
-                F cosine_law;
-                if (material.smooth_shading) {
-                    cosine_law = std::max(static_cast<F>(0.), dot(light_direction, hit_normal));
-                } else {
-                    cosine_law = std::max(static_cast<F>(0.), dot(light_direction, face_normal));
-                }
+    // Rounding can push the normalized dot product past 1, where the sine
+    // would be NaN.
+    const F cos_i_n = std::min(-dot(i, n), static_cast<F>(1.));
+    const F sin_i_n = std::sqrt(static_cast<F>(1.) - cos_i_n * cos_i_n);
 
-                const ray3<F> shadow_ray(hit_position + (static_cast<F>(shadow_bias) * light_direction), light_direction);
-                if (is_occluded(accel, shadow_ray, sphere_radius)) {
-                    continue;
-                }
+    const vec3<F> reflection_direction = i - static_cast<F>(2.) * dot(i, n) * n;
+    const ray3<F> reflection_ray(hit_record.position + (static_cast<F>(reflection_bias) * reflection_direction), reflection_direction);
 
-                final_color += ((light.intensity / sphere_area) * cosine_law) * material.albedo;
-            }
+    if (eta_r / eta_i < sin_i_n) {
+        return {reflection_ray, std::nullopt, static_cast<F>(1.)};
+    }
 
-            final_color /= static_cast<F>(diffuse_reflection_ray_count + 1);
+    const F sin_r_mn = ((sin_i_n * eta_i) / eta_r);
+    const F cos_r_mn = std::sqrt(std::max(static_cast<F>(1.) - sin_r_mn * sin_r_mn, static_cast<F>(0.)));
 
-            return final_color;
-        } else if constexpr (std::same_as<M, texture_material<F>>) {
-            color<F> final_color{};
-            for (const auto& light : scene.lights) {
-                const vec3<F> light_position = light.position;
-                vec3<F> light_direction = light_position - hit_position;
+    // At normal incidence the tangent vanishes and the ray passes straight
+    // through, normalizing it would give NaN.
+    const vec3<F> tangent = i + (cos_i_n * n);
+    const vec3<F> r = tangent.len_squared() == static_cast<F>(0.) ? -n : (cos_r_mn * (-n)) + sin_r_mn * normalized(tangent);
 
-                const F sphere_radius = light_direction.len();
-                const F sphere_area = static_cast<F>(4.) * std::numbers::pi_v<F> * sphere_radius * sphere_radius;
+    const ray3<F> refraction_ray(hit_record.position + (static_cast<F>(refraction_bias) * r), r);
 
-                light_direction = normalized(light_direction);
+    const F fresnel = 0.5 * std::pow(static_cast<F>(1.) + dot(i, n), 5);
+    return {reflection_ray, refraction_ray, fresnel};
+}
 
-                F cosine_law;
-                if (material.smooth_shading) {
-                    cosine_law = std::max(static_cast<F>(0.), dot(light_direction, hit_normal));
-                } else {
-                    cosine_law = std::max(static_cast<F>(0.), dot(light_direction, face_normal));
-                }
+// The Whitted-style integrator: the color of the hit, from its direct light
+// and the colors of all the rays it spawns, traced recursively. A refractive
+// hit follows both its reflection and its refraction and a diffuse hit
+// diffuse_reflection_ray_count rays, so the work grows exponentially with
+// max_ray_depth.
+template <typename A, typename F>
+constexpr color<F> color_hit(const A& accel, const hit<F>& hit_record, const std::size_t ray_depth) noexcept
+requires accelerator<A, F> {
+    const auto& scene = *accel.scene_ptr;
+
+    if (ray_depth == max_ray_depth)
+        return scene.config.background_color;
+
+    const auto& material_variant = scene.materials[hit_record.material_idx];
 
-                const ray3<F> shadow_ray(hit_position + (static_cast<F>(shadow_bias) * light_direction), light_direction);
-                if (is_occluded(accel, shadow_ray, sphere_radius)) {
+    return std::visit([&](const auto& material) -> color<F> {
+        using M = std::decay_t<decltype(material)>;
+
+        if constexpr (std::same_as<M, diffuse_material<F>>) {
+            color<F> final_color{};
+            for (std::size_t i = 0; i < diffuse_reflection_ray_count; ++i) {
+                const auto diffuse_reflection_hit = blurred_ray_level<A, F>(accel, ray_depth).template intersect<ray_type::diffuse>(diffuse_reflection_ray(hit_record));
+
+                if (!diffuse_reflection_hit.has_value()) {
                     continue;
                 }
 
-                const auto& texture_variant = scene.textures.at(material.texture);
-                final_color += ((light.intensity / sphere_area) * cosine_law) * sample(texture_variant, hit_record, uvs);
+                final_color += color_hit(accel, diffuse_reflection_hit.value(), ray_depth + 1);
             }
 
+            final_color += direct_lighting(accel, hit_record, ray_depth, material.smooth_shading, material.albedo);
+            final_color /= static_cast<F>(diffuse_reflection_ray_count + 1);
+
             return final_color;
-        } else if constexpr (std::same_as<M, reflective_material<F>>) {
-            const vec3<F> reflection_direction = incoming_ray.direction - (static_cast<F>(2.) * dot(incoming_ray.direction, hit_normal) * hit_normal);
-            const vec3<F> reflection_origin = hit_position + (static_cast<F>(reflection_bias) * reflection_direction);
-            const ray3<F> reflection_ray(reflection_origin, reflection_direction);
+        } else if constexpr (std::same_as<M, texture_material<F>>) {
+            const auto& texture_variant = scene.textures.at(material.texture);
 
-            const auto reflection_hit = accel.template intersect<false>(reflection_ray);
+            return direct_lighting(accel, hit_record, ray_depth, material.smooth_shading, sample(texture_variant, hit_record, hit_record.uvs));
+        } else if constexpr (std::same_as<M, reflective_material<F>>) {
+            const auto reflection_hit = accel.template intersect<ray_type::reflection>(mirror_reflection_ray(hit_record));
 
             if (!reflection_hit.has_value()) {
                 return scene.config.background_color;
             }
 
-            return color_hit(accel, reflection_hit.value(), ray_depth + 1);     
+            return color_hit(accel, reflection_hit.value(), ray_depth + 1);
         } else if constexpr (std::same_as<M, refractive_material<F>>) {
-            vec3<F> n = normalized(material.smooth_shading ? hit_normal : face_normal);
-            vec3<F> i = normalized(incoming_ray.direction);
-
-            F eta_i = static_cast<F>(1.);
-            F eta_r = material.ior;
-
-            if (static_cast<F>(0.) < dot(i, n)) {
-                std::swap(eta_i, eta_r);
-                n = -n;
-            }
-
-            const F cos_i_n = -dot(i, n);
-            const F sin_i_n = std::sqrt(static_cast<F>(1.) - cos_i_n * cos_i_n);
+            const auto split = split_at_refraction(material, hit_record);
 
-            if (eta_r / eta_i < sin_i_n) {
-                const vec3<F> reflection_direction = i - static_cast<F>(2.) * dot(i, n) * n;
-                const ray3<F> reflection_ray(hit_position + (static_cast<F>(reflection_bias) * reflection_direction), reflection_direction);
-                const auto reflection_hit = accel.template intersect<false>(reflection_ray);
+            if (!split.refraction_ray) {
+                const auto reflection_hit = accel.template intersect<ray_type::reflection>(split.reflection_ray);
 
                 if (!reflection_hit.has_value()) {
                     return color<F>{};
                 }
 
-                return color_hit(accel, reflection_hit.value(), ray_depth + 1); 
+                return color_hit(accel, reflection_hit.value(), ray_depth + 1);
             }
 
-            const F sin_r_mn = ((sin_i_n * eta_i) / eta_r);
-            const F cos_r_mn = std::sqrt(static_cast<F>(1.) - sin_r_mn * sin_r_mn);
-
-            const vec3<F> r = (cos_r_mn * (-n)) + sin_r_mn * normalized(i + (cos_i_n * n));
-
-            const ray3<F> refraction_ray(hit_position + (static_cast<F>(refraction_bias) * r), r);
-            const auto refraction_hit = accel.template intersect<false>(refraction_ray);
+            const auto refraction_hit = accel.template intersect<ray_type::reflection>(*split.refraction_ray);
 
             color<F> refraction_color{};
             if (refraction_hit.has_value()) {
                 refraction_color = color_hit(accel, refraction_hit.value(), ray_depth + 1);
             }
 
-            const vec3<F> reflection_direction = i - static_cast<F>(2.) * dot(i, n) * n;
-            const ray3<F> reflection_ray(hit_position + (static_cast<F>(reflection_bias) * reflection_direction), reflection_direction);
-            const auto reflection_hit = accel.template intersect<false>(reflection_ray);
+            const auto reflection_hit = accel.template intersect<ray_type::reflection>(split.reflection_ray);
 
             color<F> reflection_color{};
             if (reflection_hit.has_value()) {
                 reflection_color = color_hit(accel, reflection_hit.value(), ray_depth + 1);
             }
 
-            const F fresnel = 0.5 * std::pow(static_cast<F>(1.) + dot(i, n), 5);
-            return fresnel * reflection_color + (static_cast<F>(1.) - fresnel) * refraction_color;
+            return split.fresnel * reflection_color + (static_cast<F>(1.) - split.fresnel) * refraction_color;
         } else if constexpr (std::same_as<M, constant_material<F>>) {
             return material.albedo;
         } else {
@@ -306,3 +488,104 @@ requires accelerator<A, F> {
         }
     }, material_variant);
 }
+
+// The state of a path of the path tracing integrator: the hit it has reached,
+// the bounces it took to get there and the share of the hit's light which
+// reaches the camera. The materials don't tint the light they pass on, so
+// the throughput is a single weight.
+template <typename F>
+struct path_state {
+    hit<F> hit_record;
+    std::size_t ray_depth;
+    F throughput;
+};
+
+// The path tracing integrator: instead of every ray a hit spawns, it follows
+// a single one per bounce, in a loop. A refractive hit continues with its
+// reflection or its refraction, picked with the Fresnel probability, and a
+// diffuse hit with one diffuse reflection ray, which stands in for all
+// diffuse_reflection_ray_count of color_hit's. Either way the average over
+// many paths converges to color_hit's color, at a cost linear in
+// max_ray_depth, but a single path is noisy, so it needs more samples per
+// pixel.
+template <typename A, typename F>
+constexpr color<F> trace_path(const A& accel, const hit<F>& camera_hit) noexcept
+requires accelerator<A, F> {
+    const auto& scene = *accel.scene_ptr;
+
+    path_state<F> path{camera_hit, 0, static_cast<F>(1.)};
+    color<F> final_color{};
+
+    while (path.ray_depth != max_ray_depth) {
+        const auto& material_variant = scene.materials[path.hit_record.material_idx];
+
+        // Adds the light the hit reflects directly and returns the hit the
+        // path continues at, if any.
+        const auto next_hit = std::visit([&](const auto& material) -> std::optional<hit<F>> {
+            using M = std::decay_t<decltype(material)>;
+
+            if constexpr (std::same_as<M, diffuse_material<F>>) {
+                const F direct_weight = path.throughput / static_cast<F>(diffuse_reflection_ray_count + 1);
+                final_color += direct_weight * direct_lighting(accel, path.hit_record, path.ray_depth, material.smooth_shading, material.albedo);
+
+                if constexpr (diffuse_reflection_ray_count == 0) {
+                    return std::nullopt;
+                } else {
+                    path.throughput -= direct_weight;
+
+                    return blurred_ray_level<A, F>(accel, path.ray_depth).template intersect<ray_type::diffuse>(diffuse_reflection_ray(path.hit_record));
+                }
+            } else if constexpr (std::same_as<M, texture_material<F>>) {
+                const auto& texture_variant = scene.textures.at(material.texture);
+                final_color += path.throughput * direct_lighting(accel, path.hit_record, path.ray_depth, material.smooth_shading, sample(texture_variant, path.hit_record, path.hit_record.uvs));
+
+                return std::nullopt;
+            } else if constexpr (std::same_as<M, reflective_material<F>>) {
+                auto reflection_hit = accel.template intersect<ray_type::reflection>(mirror_reflection_ray(path.hit_record));
+
+                if (!reflection_hit.has_value()) {
+                    final_color += path.throughput * scene.config.background_color;
+                }
+
+                return reflection_hit;
+            } else if constexpr (std::same_as<M, refractive_material<F>>) {
+                const auto split = split_at_refraction(material, path.hit_record);
+
+                // Picking a ray with the share of the light it carries keeps
+                // the throughput unchanged.
+                const bool reflects = !split.refraction_ray || urand01<F>() < split.fresnel;
+
+                return accel.template intersect<ray_type::reflection>(reflects ? split.reflection_ray : *split.refraction_ray);
+            } else if constexpr (std::same_as<M, constant_material<F>>) {
+                final_color += path.throughput * material.albedo;
+
+                return std::nullopt;
+            } else {
+                return std::nullopt;
+            }
+        }, material_variant);
+
+        if (!next_hit.has_value()) {
+            return final_color;
+        }
+
+        path.hit_record = next_hit.value();
+        ++path.ray_depth;
+    }
+
+    // Like color_hit, a path which reaches the maximum depth ends with the
+    // background color.
+    final_color += path.throughput * scene.config.background_color;
+
+    return final_color;
+}
+
+template <typename A, typename F>
+constexpr color<F> color_camera_hit(const A& accel, const hit<F>& camera_hit, const integrator_type integrator) noexcept
+requires accelerator<A, F> {
+    if (integrator == integrator_type::PATH) {
+        return trace_path(accel, camera_hit);
+    }
+
+    return color_hit(accel, camera_hit, 0uz);
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <raytracer/config.hpp>
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/render/accel/accel.hpp>
+#include <raytracer/render/render.hpp>
+#include <raytracer/scene/scene.hpp>
+#include <raytracer/utils/hash.hpp>
+
+// Builds the structure, through the cache for the structures which support
+// it, so unchanged scenes don't have to be built again.
+template <typename A, typename F>
+requires accelerator<A, F>
+A make_accelerator(std::shared_ptr<const scene<F>> scene_ptr) {
+    if constexpr (!accel_cache_directory.empty() && std::constructible_from<A, decltype(scene_ptr), std::filesystem::path>) {
+        return A(std::move(scene_ptr), std::filesystem::path(accel_cache_directory));
+    } else {
+        return A(std::move(scene_ptr));
+    }
+}
+
+// A sample of the rays a render traces: the camera rays through a regular
+// grid of pixels and, for every camera hit, a shadow ray to each light and a
+// mirrored ray, which stands in for all the secondary rays.
+template <typename F>
+struct tuning_rays {
+    struct shadow_ray {
+        ray3<F> ray;
+        F max_t;
+    };
+
+    std::vector<ray3<F>> camera_rays;
+    std::vector<ray3<F>> secondary_rays;
+    std::vector<shadow_ray> shadow_rays;
+};
+
+template <typename A, typename F>
+requires accelerator<A, F>
+tuning_rays<F> sample_tuning_rays(const A& accel, const std::size_t grid_size) {
+    const auto& scene = *accel.scene_ptr;
+
+    tuning_rays<F> rays;
+    for (std::size_t i = 0; i < grid_size; ++i) {
+        for (std::size_t j = 0; j < grid_size; ++j) {
+            const F raster_x = (static_cast<F>(j) + static_cast<F>(.5)) * static_cast<F>(scene.config.image_width) / static_cast<F>(grid_size);
+            const F raster_y = (static_cast<F>(i) + static_cast<F>(.5)) * static_cast<F>(scene.config.image_height) / static_cast<F>(grid_size);
+            rays.camera_rays.push_back(camera_ray(scene, raster_x, raster_y));
+        }
+    }
+
+    for (const auto& ray : rays.camera_rays) {
+        const auto camera_hit = accel.template intersect<ray_type::camera>(ray);
+        if (!camera_hit) {
+            continue;
+        }
+
+        const vec3<F>& normal = camera_hit->hit_normal;
+        const vec3<F> reflection_direction = ray.direction - (static_cast<F>(2.) * dot(ray.direction, normal) * normal);
+        rays.secondary_rays.emplace_back(camera_hit->position + (static_cast<F>(reflection_bias) * normal), reflection_direction);
+
+        for (const auto& light : scene.lights) {
+            const vec3<F> light_direction = light.position - camera_hit->position;
+            const F distance = light_direction.len();
+            const vec3<F> direction = normalized(light_direction);
+
+            rays.shadow_rays.push_back({ray3<F>(camera_hit->position + (static_cast<F>(shadow_bias) * direction), direction), distance});
+        }
+    }
+
+    return rays;
+}
+
+// Traces the sample like a render would (camera rays, mirrored rays as
+// reflection rays and shadow rays) and returns the fastest of a few runs, in
+// seconds, as the first run also pays for the cold caches.
+template <typename A, typename F>
+requires accelerator<A, F>
+double time_tuning_rays(const A& accel, const tuning_rays<F>& rays, const std::size_t runs = 3) {
+    double best = std::numeric_limits<double>::infinity();
+
+    for (std::size_t run = 0; run < runs; ++run) {
+        std::size_t hits = 0;
+
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& ray : rays.camera_rays) {
+            hits += accel.template intersect<ray_type::camera>(ray).has_value() ? 1 : 0;
+        }
+        for (const auto& ray : rays.secondary_rays) {
+            hits += accel.template intersect<ray_type::reflection>(ray).has_value() ? 1 : 0;
+        }
+        for (const auto& shadow_ray : rays.shadow_rays) {
+            hits += accel.occluded(shadow_ray.ray, shadow_ray.max_t) ? 1 : 0;
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        // Keeps the traversals from being optimized away.
+        volatile std::size_t sink = hits;
+        static_cast<void>(sink);
+
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+
+    return best;
+}
+
+// Picks the fastest of the candidate structures As (usually one structure
+// with different template parameters) for a scene, by building each of them
+// and timing a sample of its rays. The choice is kept in a small sidecar
+// file next to the scene as the key of the scene and the candidate's name,
+// so later runs of the same scene reuse it without building the others.
+template <typename F, typename... As>
+requires (accelerator<As, F> && ...)
+struct accel_tuner {
+    static constexpr std::size_t CANDIDATE_COUNT = sizeof...(As);
+    static constexpr std::size_t SAMPLE_GRID_SIZE = 128;
+
+    std::array<std::string, CANDIDATE_COUNT> names;
+
+    // Calls visitor.template operator()<A>() with the candidate_idx-th
+    // candidate structure A.
+    template <typename V>
+    static void visit(const std::size_t candidate_idx, V&& visitor) {
+        std::size_t idx = 0;
+        static_cast<void>(((idx++ == candidate_idx ? (visitor.template operator()<As>(), true) : false) || ...));
+    }
+
+    // Hash of everything the timings depend on: the triangles, the
+    // primitives, their surface flags (which lanes the rays skip), the
+    // camera, the image size, the lights and the candidates themselves.
+    [[nodiscard]] std::uint64_t tuning_key(const scene<F>& scene) const noexcept {
+        content_hasher hasher;
+
+        hasher.add(sizeof(F));
+        for (const auto& name : names) {
+            for (const char c : name) {
+                hasher.add(c);
+            }
+        }
+
+        for (std::size_t mesh_idx = 0; mesh_idx < scene.meshes.size(); ++mesh_idx) {
+            const auto& mesh = scene.meshes[mesh_idx];
+            const surface_flags flags = surface_flags_of(scene, mesh_idx);
+
+            hasher.add(flags.visible_to);
+            hasher.add(flags.back_face_culling);
+            hasher.add(mesh.triangles.size());
+            for (std::size_t triangle_idx = 0; triangle_idx < mesh.triangles.size(); ++triangle_idx) {
+                for (const auto& vertex : mesh.triangle_vertices(triangle_idx)) {
+                    hasher.add(vertex.x);
+                    hasher.add(vertex.y);
+                    hasher.add(vertex.z);
+                }
+            }
+        }
+
+        for (std::size_t primitive_idx = 0; primitive_idx < scene.primitives.size(); ++primitive_idx) {
+            const auto& primitive = scene.primitives[primitive_idx];
+            const surface_flags flags = primitive_surface_flags(scene, primitive_idx);
+
+            hasher.add(flags.visible_to);
+            hasher.add(flags.back_face_culling);
+            hasher.add(primitive.shape.index());
+            std::visit([&](const auto& shape) {
+                for (const F parameter : shape.parameters()) {
+                    hasher.add(parameter);
+                }
+            }, primitive.shape);
+        }
+
+        hasher.add(scene.viewpoint.position.x);
+        hasher.add(scene.viewpoint.position.y);
+        hasher.add(scene.viewpoint.position.z);
+        for (const F element : scene.viewpoint.matrix.m) {
+            hasher.add(element);
+        }
+
+        hasher.add(scene.config.image_width);
+        hasher.add(scene.config.image_height);
+        for (const auto& light : scene.lights) {
+            hasher.add(light.position.x);
+            hasher.add(light.position.y);
+            hasher.add(light.position.z);
+        }
+
+        return hasher.state;
+    }
+
+    // The candidate stored in the sidecar file, if the file was written for
+    // the same key.
+    [[nodiscard]] std::optional<std::size_t> read_choice(const std::filesystem::path& sidecar_path, const std::uint64_t key) const {
+        std::ifstream in(sidecar_path);
+
+        std::string stored_key;
+        std::string stored_name;
+        if (!(in >> stored_key) || !std::getline(in >> std::ws, stored_name) || stored_key != std::format("{:016x}", key)) {
+            return std::nullopt;
+        }
+
+        const auto it = std::ranges::find(names, stored_name);
+        if (it == names.end()) {
+            return std::nullopt;
+        }
+
+        return static_cast<std::size_t>(it - names.begin());
+    }
+
+    void write_choice(const std::filesystem::path& sidecar_path, const std::uint64_t key, const std::size_t candidate_idx) const {
+        if (std::ofstream out(sidecar_path); out) {
+            out << std::format("{:016x} {}\n", key, names[candidate_idx]);
+        }
+    }
+
+    // Builds every candidate in turn (only one is alive at a time) and
+    // returns the time each took for the same ray sample, in seconds. The
+    // sample is taken with the first candidate.
+    [[nodiscard]] std::array<double, CANDIDATE_COUNT> time_candidates(const std::shared_ptr<const scene<F>>& scene_ptr) const {
+        std::array<double, CANDIDATE_COUNT> timings{};
+        std::optional<tuning_rays<F>> rays;
+
+        for (std::size_t candidate_idx = 0; candidate_idx < CANDIDATE_COUNT; ++candidate_idx) {
+            visit(candidate_idx, [&]<typename A>() {
+                const A accel = make_accelerator<A, F>(scene_ptr);
+                if (!rays) {
+                    rays = sample_tuning_rays<A, F>(accel, SAMPLE_GRID_SIZE);
+                }
+
+                timings[candidate_idx] = time_tuning_rays<A, F>(accel, *rays);
+            });
+        }
+
+        return timings;
+    }
+};
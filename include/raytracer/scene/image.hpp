@@ -4,17 +4,18 @@
 
 #include <raytracer/scene/color.hpp>
 
+// The pixels are stored row by row in a single buffer.
 template <typename F>
 struct image {
 private:
     std::size_t height;
     std::size_t width;
-    std::vector<std::vector<color<F>>> pixels;
+    std::vector<color<F>> pixels;
 public:
-    constexpr image(std::size_t height, std::size_t width, std::vector<std::vector<color<F>>>&& pixels)
+    constexpr image(std::size_t height, std::size_t width, std::vector<color<F>>&& pixels)
         : height(height), width(width), pixels(std::move(pixels)) {}
 
-    constexpr image(std::size_t height, std::size_t width, const std::vector<std::vector<color<F>>>& pixels)
+    constexpr image(std::size_t height, std::size_t width, const std::vector<color<F>>& pixels)
         : height(height), width(width), pixels(pixels) {}
 
     constexpr size_t get_height() const {
@@ -26,6 +27,6 @@ public:
     }
 
     constexpr const color<F>& get_pixel(std::size_t row, std::size_t column) const {
-        return pixels[row][column];
+        return pixels[row * width + column];
     }
 };
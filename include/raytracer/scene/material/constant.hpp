@@ -6,4 +6,5 @@ template <typename F>
 struct constant_material {
     color<F> albedo;
     bool smooth_shading;
+    bool back_face_culling;
 };
@@ -11,6 +11,13 @@ constexpr bool smooth_shading_of(const material_variant<F>& mv) {
     }, mv);
 }
 
+template <typename F>
+constexpr bool back_face_culling_of(const material_variant<F>& mv) {
+    return std::visit([](const auto& material) {
+        return material.back_face_culling;
+    }, mv);
+}
+
 template <typename F>
 constexpr F ior_of(const material_variant<F>& mv) {
     return std::visit([](const auto& material) {
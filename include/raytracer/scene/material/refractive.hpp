@@ -4,4 +4,5 @@ template <typename F>
 struct refractive_material {
     F ior;
     bool smooth_shading;
+    bool back_face_culling;
 };
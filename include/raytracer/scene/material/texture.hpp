@@ -6,4 +6,5 @@ template <typename F>
 struct texture_material {
     std::string texture;
     bool smooth_shading;
+    bool back_face_culling;
 };
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+
+#include <raytracer/core/math/aabb3.hpp>
+#include <raytracer/core/math/mat3.hpp>
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/core/math/vec3.hpp>
+
+// An additional placement of a mesh in the scene. The mesh's own triangles are
+// in world space already, an instance places another copy of them with the
+// given matrix and position (using the same row-vector convention as the
+// camera: world = object * matrix + position), without duplicating the mesh.
+// The matrix has to be invertible, as rays are traced in object space.
+template <typename F>
+struct mesh_instance {
+    std::size_t mesh_idx;
+    mat3<F> matrix;
+    vec3<F> position;
+    mat3<F> to_world;
+    mat3<F> to_object;
+
+    constexpr mesh_instance(const std::size_t mesh_idx, const mat3<F>& matrix, const vec3<F>& position) noexcept
+        : mesh_idx(mesh_idx), matrix(matrix), position(position), to_world(transpose(matrix)), to_object(inverse(to_world)) {
+        assert(determinant(matrix) != static_cast<F>(0.));
+    }
+
+    [[nodiscard]] constexpr bool mirrored() const noexcept {
+        return determinant(to_world) < static_cast<F>(0.);
+    }
+
+    [[nodiscard]] constexpr vec3<F> point_to_world(const vec3<F>& point) const noexcept {
+        return to_world * point + position;
+    }
+
+    [[nodiscard]] constexpr vec3<F> normal_to_world(const vec3<F>& normal) const noexcept {
+        return normalized(transpose(to_object) * normal);
+    }
+
+    // The direction is not normalized, so that hit distances along the object
+    // space ray are the same as along the world space ray.
+    [[nodiscard]] constexpr ray3<F> ray_to_object(const ray3<F>& ray) const noexcept {
+        return {to_object * (ray.origin - position), to_object * ray.direction};
+    }
+
+    [[nodiscard]] constexpr aabb3<F> box_to_world(const aabb3<F>& box) const noexcept {
+        aabb3<F> world_box;
+
+        for (std::size_t corner = 0; corner < 8; ++corner) {
+            world_box.expand(point_to_world({
+                (corner & 1u) ? box.max.x : box.min.x,
+                (corner & 2u) ? box.max.y : box.min.y,
+                (corner & 4u) ? box.max.z : box.min.z
+            }));
+        }
+
+        return world_box;
+    }
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <ranges>
 #include <optional>
 #include <vector>
@@ -7,31 +8,59 @@
 #include <raytracer/core/math/aabb3.hpp>
 #include <raytracer/core/math/vec2.hpp>
 #include <raytracer/scene/object/hit.hpp>
+#include <raytracer/scene/object/visibility.hpp>
 #include <raytracer/core/math/vec3.hpp>
 #include <raytracer/scene/primitive/triangle.hpp>
 
+// Whether the triangles only refer to existing vertices and, if there are
+// uvs, every vertex has one, as the mesh's accessors assume. The loader checks
+// the same while parsing a scene, with an error for each case.
+template <typename F>
+[[nodiscard]] constexpr bool valid_mesh_indices(const std::vector<vec3<F>>& vertices, const std::vector<vec2<F>>& uvs, const std::vector<std::array<vertex_index, 3>>& triangles) noexcept {
+    if (!uvs.empty() && uvs.size() < vertices.size()) {
+        return false;
+    }
+
+    for (const auto& triangle : triangles) {
+        for (const vertex_index vertex_idx : triangle) {
+            if (vertices.size() <= vertex_idx) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Indexed triangle mesh. The vertex buffers (positions, normals and, if the
+// mesh has them, uvs) are indexed by the triangles' vertex indices, the face
+// normals by the triangle index. This is the only copy of the geometry, the
+// acceleration structures only refer to the triangles by index. The mesh is
+// only hit by the ray types in its visibility mask.
 template <typename F>
 struct mesh_object {
     std::size_t material_idx;
     std::vector<vec3<F>> vertices;
     std::vector<vec3<F>> vertex_normals;
     std::vector<vec2<F>> uvs;
-    std::vector<triangle<F>> triangles;
+    std::vector<std::array<vertex_index, 3>> triangles;
     std::vector<vec3<F>> triangle_normals;
     aabb3<F> box;
+    ray_type_mask visibility;
 
-    mesh_object(std::size_t material_index, std::vector<vec3<F>> vertices, std::vector<vec2<F>> uvs, std::vector<triangle<F>> triangles)
-        : material_idx(material_index), vertices(vertices), uvs(uvs), triangles(triangles) {
-        triangle_normals.assign(triangles.size(), vec3<F>({0., 0., 0.}));
-        vertex_normals.assign(vertices.size(), vec3<F>({0., 0., 0.}));
-        for (const auto& [idx, triangle] : triangles | std::views::enumerate) {
-            auto [v0_idx, v1_idx, v2_idx] = triangle.vertex_indices;
+    mesh_object(std::size_t material_index, std::vector<vec3<F>> vertices, std::vector<vec2<F>> uvs, std::vector<std::array<vertex_index, 3>> triangles, const ray_type_mask visibility = all_ray_types_mask)
+        : material_idx(material_index), vertices(std::move(vertices)), uvs(std::move(uvs)), triangles(std::move(triangles)), visibility(visibility) {
+        triangle_normals.assign(this->triangles.size(), vec3<F>({0., 0., 0.}));
+        vertex_normals.assign(this->vertices.size(), vec3<F>({0., 0., 0.}));
+        for (const auto& [idx, vertex_indices] : this->triangles | std::views::enumerate) {
+            auto [v0_idx, v1_idx, v2_idx] = vertex_indices;
+            const auto [v0, v1, v2] = triangle_vertices(idx);
 
-            box.expand(triangle.v0);
-            box.expand(triangle.v1);
-            box.expand(triangle.v2);
+            box.expand(v0);
+            box.expand(v1);
+            box.expand(v2);
 
-            triangle_normals[idx] = normalized(cross(triangle.v1 - triangle.v0, triangle.v2 - triangle.v0));
+            triangle_normals[idx] = normalized(cross(v1 - v0, v2 - v0));
 
             vertex_normals[v0_idx] += triangle_normals[idx];
             vertex_normals[v1_idx] += triangle_normals[idx];
@@ -43,32 +72,70 @@ struct mesh_object {
         }
     }
 
+    [[nodiscard]] constexpr std::array<vec3<F>, 3> triangle_vertices(const std::size_t triangle_idx) const noexcept {
+        const auto [v0_idx, v1_idx, v2_idx] = triangles[triangle_idx];
+
+        return {vertices[v0_idx], vertices[v1_idx], vertices[v2_idx]};
+    }
+
+    [[nodiscard]] constexpr triangle<F> triangle_at(const std::size_t triangle_idx) const noexcept {
+        const auto [v0, v1, v2] = triangle_vertices(triangle_idx);
+
+        return {v0, v1, v2};
+    }
+
+    [[nodiscard]] constexpr aabb3<F> triangle_box(const std::size_t triangle_idx) const noexcept {
+        aabb3<F> triangle_box;
+        for (const auto& vertex : triangle_vertices(triangle_idx)) {
+            triangle_box.expand(vertex);
+        }
+
+        return triangle_box;
+    }
+
+    // The uvs of the triangle's vertices, all zero if the mesh has none.
+    [[nodiscard]] constexpr vec3<vec2<F>> triangle_uvs(const std::size_t triangle_idx) const noexcept {
+        if (uvs.empty()) {
+            return {};
+        }
+
+        const auto [v0_idx, v1_idx, v2_idx] = triangles[triangle_idx];
+
+        return {uvs[v0_idx], uvs[v1_idx], uvs[v2_idx]};
+    }
+
+    // The vertex normals interpolated at the barycentric coordinates (u, v).
+    [[nodiscard]] constexpr vec3<F> shading_normal(const std::size_t triangle_idx, const F u, const F v) const noexcept {
+        const auto [v0_idx, v1_idx, v2_idx] = triangles[triangle_idx];
+        const F w = static_cast<F>(1.) - u - v;
+
+        return normalized(u * vertex_normals[v1_idx] + v * vertex_normals[v2_idx] + w * vertex_normals[v0_idx]);
+    }
+
     template <bool backface_culling, F eps>
     constexpr std::optional<mesh_hit<F>> intersect(const ray3<F>& ray) const {
         std::optional<mesh_hit<F>> closest_hit;
 
-        for (const auto& [triangle_idx, triangle] : triangles | std::ranges::views::enumerate) {
-            const auto maybe_hit = triangle.template intersect<backface_culling, eps>(ray);
+        for (std::size_t triangle_idx = 0; triangle_idx < triangles.size(); ++triangle_idx) {
+            const auto maybe_hit = triangle_at(triangle_idx).template intersect<backface_culling, eps>(ray);
 
             if (!maybe_hit || (closest_hit && closest_hit->distance < maybe_hit->distance)) {
                 continue;
             }
 
-            const vec3<F> v0_normal = vertex_normals[triangle.vertex_indices[0]];
-            const vec3<F> v1_normal = vertex_normals[triangle.vertex_indices[1]];
-            const vec3<F> v2_normal = vertex_normals[triangle.vertex_indices[2]];
+            const auto [v0_idx, v1_idx, v2_idx] = triangles[triangle_idx];
             const vec3<F> hit_position = ray.origin + (maybe_hit->distance * ray.direction);
-            const vec3<F> hit_normal = maybe_hit->u * v1_normal + maybe_hit->v * v2_normal + (static_cast<F>(1.) - maybe_hit->u - maybe_hit->v) * v0_normal;
+            const vec3<F> hit_normal = maybe_hit->u * vertex_normals[v1_idx] + maybe_hit->v * vertex_normals[v2_idx] + (static_cast<F>(1.) - maybe_hit->u - maybe_hit->v) * vertex_normals[v0_idx];
 
             closest_hit = mesh_hit<F>{
                 hit_position,
                 hit_normal,
-                triangle.normal,
-                triangle.uvs,
+                triangle_normals[triangle_idx],
+                triangle_uvs(triangle_idx),
                 maybe_hit->distance,
                 maybe_hit->u,
                 maybe_hit->v,
-                static_cast<std::size_t>(triangle_idx)
+                triangle_idx
             };
         }
 
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <variant>
+
+#include <raytracer/core/math/vec2.hpp>
+#include <raytracer/core/math/vec3.hpp>
+#include <raytracer/scene/object/visibility.hpp>
+#include <raytracer/scene/primitive/disk.hpp>
+#include <raytracer/scene/primitive/plane.hpp>
+#include <raytracer/scene/primitive/sphere.hpp>
+
+template <typename F>
+using shape_variant = std::variant<sphere<F>, plane<F>, disk<F>>;
+
+// Analytic primitive with a closed-form intersection, stored as the shape
+// itself instead of a tessellated mesh. Like a mesh, it is only hit by the
+// ray types in its visibility mask.
+template <typename F>
+struct primitive_object {
+    std::size_t material_idx;
+    shape_variant<F> shape;
+    ray_type_mask visibility = all_ray_types_mask;
+
+    [[nodiscard]] constexpr vec3<F> normal_at(const vec3<F>& point) const noexcept {
+        return std::visit([&](const auto& s) {
+            return s.normal_at(point);
+        }, shape);
+    }
+
+    [[nodiscard]] constexpr vec2<F> uv_at(const vec3<F>& point) const noexcept {
+        return std::visit([&](const auto& s) {
+            return s.uv_at(point);
+        }, shape);
+    }
+};
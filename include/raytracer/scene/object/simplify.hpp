@@ -0,0 +1,442 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <span>
+#include <vector>
+
+#include <raytracer/core/math/vec3.hpp>
+#include <raytracer/io/binary/binary.hpp>
+#include <raytracer/scene/object/mesh.hpp>
+#include <raytracer/scene/scene.hpp>
+#include <raytracer/utils/hash.hpp>
+
+// Symmetric 4x4 matrix of a quadric error metric (Garland and Heckbert): the
+// sum of the squared distances of a point to a set of planes, each weighted.
+// Only the upper triangle is stored, in double precision, as the sums over
+// many planes lose too much in float.
+struct error_quadric {
+    std::array<double, 10> q{};
+
+    // The plane a x + b y + c z + d = 0, with (a, b, c) of unit length.
+    [[nodiscard]] static constexpr error_quadric of_plane(const double a, const double b, const double c, const double d, const double weight) noexcept {
+        return {{
+            weight * a * a, weight * a * b, weight * a * c, weight * a * d,
+            weight * b * b, weight * b * c, weight * b * d,
+            weight * c * c, weight * c * d,
+            weight * d * d
+        }};
+    }
+
+    constexpr error_quadric& operator+=(const error_quadric& other) noexcept {
+        for (std::size_t idx = 0; idx < q.size(); ++idx) {
+            q[idx] += other.q[idx];
+        }
+
+        return *this;
+    }
+
+    [[nodiscard]] constexpr error_quadric operator+(const error_quadric& other) const noexcept {
+        error_quadric sum = *this;
+        sum += other;
+
+        return sum;
+    }
+
+    [[nodiscard]] constexpr double error(const double x, const double y, const double z) const noexcept {
+        return q[0] * x * x + 2. * q[1] * x * y + 2. * q[2] * x * z + 2. * q[3] * x
+             + q[4] * y * y + 2. * q[5] * y * z + 2. * q[6] * y
+             + q[7] * z * z + 2. * q[8] * z
+             + q[9];
+    }
+};
+
+// Decimates the mesh to about target_triangle_count triangles by collapsing
+// edges, cheapest first by the quadric error of the surviving vertex. Every
+// collapse moves one end of the edge onto the other (a half-edge collapse),
+// so the remaining vertices keep their positions and uvs. Collapses which
+// would flip or squash a triangle or make the surface non-manifold are
+// skipped, and the open edges (including the uv seams, where the vertices are
+// split) get an extra quadric which keeps them in place, so the result may
+// keep more triangles than the target.
+template <typename F>
+mesh_object<F> simplify_mesh(const mesh_object<F>& mesh, const std::size_t target_triangle_count) {
+    // The weight of the planes along the open edges, relative to the faces.
+    constexpr double BOUNDARY_WEIGHT = 1'000.;
+    // The smallest cosine of the angle a collapse may turn a triangle by.
+    constexpr double MIN_NORMAL_COSINE = .25;
+
+    const std::size_t vertex_count = mesh.vertices.size();
+
+    std::vector<std::array<vertex_index, 3>> triangles = mesh.triangles;
+    std::vector<bool> triangle_removed(triangles.size(), false);
+    std::vector<bool> vertex_removed(vertex_count, false);
+    std::vector<std::uint32_t> vertex_versions(vertex_count, 0);
+    std::vector<std::vector<std::uint32_t>> vertex_triangles(vertex_count);
+    std::vector<error_quadric> quadrics(vertex_count);
+
+    const auto position = [&](const vertex_index vertex_idx) {
+        const vec3<F>& vertex = mesh.vertices[vertex_idx];
+
+        return vec3<double>{vertex.x, vertex.y, vertex.z};
+    };
+
+    const auto face_cross = [&](const std::array<vertex_index, 3>& triangle) {
+        const vec3<double> v0 = position(triangle[0]);
+
+        return cross(position(triangle[1]) - v0, position(triangle[2]) - v0);
+    };
+
+    // The faces' planes, weighted by their area.
+    for (std::uint32_t triangle_idx = 0; triangle_idx < triangles.size(); ++triangle_idx) {
+        const auto& triangle = triangles[triangle_idx];
+        for (const vertex_index vertex_idx : triangle) {
+            vertex_triangles[vertex_idx].push_back(triangle_idx);
+        }
+
+        const vec3<double> normal_area = face_cross(triangle);
+        const double length = normal_area.len();
+        if (length == 0.) {
+            continue;
+        }
+
+        const vec3<double> n = (1. / length) * normal_area;
+        const error_quadric plane = error_quadric::of_plane(n.x, n.y, n.z, -dot(n, position(triangle[0])), .5 * length);
+        for (const vertex_index vertex_idx : triangle) {
+            quadrics[vertex_idx] += plane;
+        }
+    }
+
+    // The edges as (smaller vertex, larger vertex, triangle), sorted, so the
+    // triangles sharing an edge are next to each other.
+    struct triangle_edge {
+        vertex_index a;
+        vertex_index b;
+        std::uint32_t triangle_idx;
+    };
+
+    std::vector<triangle_edge> edges;
+    edges.reserve(3 * triangles.size());
+    for (std::uint32_t triangle_idx = 0; triangle_idx < triangles.size(); ++triangle_idx) {
+        const auto& triangle = triangles[triangle_idx];
+        for (std::size_t corner = 0; corner < 3; ++corner) {
+            const vertex_index a = triangle[corner];
+            const vertex_index b = triangle[(corner + 1) % 3];
+            edges.push_back({std::min(a, b), std::max(a, b), triangle_idx});
+        }
+    }
+
+    std::ranges::sort(edges, [](const triangle_edge& lhs, const triangle_edge& rhs) {
+        return lhs.a != rhs.a ? lhs.a < rhs.a : lhs.b < rhs.b;
+    });
+
+    // The planes through the open edges, perpendicular to their face.
+    for (std::size_t first = 0; first < edges.size();) {
+        std::size_t last = first + 1;
+        while (last < edges.size() && edges[last].a == edges[first].a && edges[last].b == edges[first].b) {
+            ++last;
+        }
+
+        if (last - first == 1) {
+            const auto [a, b, triangle_idx] = edges[first];
+            const vec3<double> edge = position(b) - position(a);
+            const vec3<double> border_normal = cross(edge, face_cross(triangles[triangle_idx]));
+            const double length = border_normal.len();
+
+            if (length != 0.) {
+                const vec3<double> n = (1. / length) * border_normal;
+                const error_quadric plane = error_quadric::of_plane(n.x, n.y, n.z, -dot(n, position(a)), BOUNDARY_WEIGHT * edge.len_squared());
+                quadrics[a] += plane;
+                quadrics[b] += plane;
+            }
+        }
+
+        first = last;
+    }
+
+    // A candidate collapse of the edge, moving from onto to. It is stale once
+    // either vertex has changed since it was queued.
+    struct collapse {
+        double cost;
+        vertex_index from;
+        vertex_index to;
+        std::uint32_t from_version;
+        std::uint32_t to_version;
+
+        constexpr bool operator>(const collapse& other) const noexcept {
+            return cost > other.cost;
+        }
+    };
+
+    std::priority_queue<collapse, std::vector<collapse>, std::greater<>> queue;
+
+    const auto push_edge = [&](const vertex_index a, const vertex_index b) {
+        const error_quadric sum = quadrics[a] + quadrics[b];
+        const vec3<double> pa = position(a);
+        const vec3<double> pb = position(b);
+        const double cost_a = sum.error(pa.x, pa.y, pa.z);
+        const double cost_b = sum.error(pb.x, pb.y, pb.z);
+
+        if (cost_a <= cost_b) {
+            queue.push({cost_a, b, a, vertex_versions[b], vertex_versions[a]});
+        } else {
+            queue.push({cost_b, a, b, vertex_versions[a], vertex_versions[b]});
+        }
+    };
+
+    for (std::size_t edge_idx = 0; edge_idx < edges.size(); ++edge_idx) {
+        if (edge_idx == 0 || edges[edge_idx].a != edges[edge_idx - 1].a || edges[edge_idx].b != edges[edge_idx - 1].b) {
+            push_edge(edges[edge_idx].a, edges[edge_idx].b);
+        }
+    }
+
+    std::vector<triangle_edge>().swap(edges);
+
+    // Drops the removed triangles from the vertex's list and returns its
+    // neighbors, sorted.
+    std::vector<vertex_index> from_neighbors;
+    std::vector<vertex_index> to_neighbors;
+    const auto gather_neighbors = [&](const vertex_index vertex_idx, std::vector<vertex_index>& neighbors) {
+        auto& incident = vertex_triangles[vertex_idx];
+        std::erase_if(incident, [&](const std::uint32_t triangle_idx) {
+            return triangle_removed[triangle_idx];
+        });
+
+        neighbors.clear();
+        for (const std::uint32_t triangle_idx : incident) {
+            for (const vertex_index neighbor : triangles[triangle_idx]) {
+                if (neighbor != vertex_idx) {
+                    neighbors.push_back(neighbor);
+                }
+            }
+        }
+
+        std::ranges::sort(neighbors);
+        neighbors.erase(std::ranges::unique(neighbors).begin(), neighbors.end());
+    };
+
+    std::size_t triangle_count = triangles.size();
+    while (target_triangle_count < triangle_count && !queue.empty()) {
+        const auto [cost, from, to, from_version, to_version] = queue.top();
+        queue.pop();
+
+        if (vertex_removed[from] || vertex_removed[to] || vertex_versions[from] != from_version || vertex_versions[to] != to_version) {
+            continue;
+        }
+
+        gather_neighbors(from, from_neighbors);
+        gather_neighbors(to, to_neighbors);
+
+        // The link condition: the two ends may only share the neighbors
+        // opposite the edge, one per triangle on it, or the collapse would
+        // pinch the surface.
+        std::size_t shared_triangle_count = 0;
+        for (const std::uint32_t triangle_idx : vertex_triangles[from]) {
+            shared_triangle_count += std::ranges::find(triangles[triangle_idx], to) != triangles[triangle_idx].end() ? 1 : 0;
+        }
+
+        std::size_t shared_neighbor_count = 0;
+        for (const vertex_index neighbor : from_neighbors) {
+            shared_neighbor_count += std::ranges::binary_search(to_neighbors, neighbor) ? 1 : 0;
+        }
+
+        if (shared_triangle_count == 0 || shared_neighbor_count != shared_triangle_count) {
+            continue;
+        }
+
+        bool flips = false;
+        for (const std::uint32_t triangle_idx : vertex_triangles[from]) {
+            auto triangle = triangles[triangle_idx];
+            if (std::ranges::find(triangle, to) != triangle.end()) {
+                continue;
+            }
+
+            const vec3<double> old_normal = face_cross(triangle);
+            std::ranges::replace(triangle, from, to);
+            const vec3<double> new_normal = face_cross(triangle);
+
+            if (dot(old_normal, new_normal) <= MIN_NORMAL_COSINE * old_normal.len() * new_normal.len()) {
+                flips = true;
+                break;
+            }
+        }
+
+        if (flips) {
+            continue;
+        }
+
+        for (const std::uint32_t triangle_idx : vertex_triangles[from]) {
+            auto& triangle = triangles[triangle_idx];
+            if (std::ranges::find(triangle, to) != triangle.end()) {
+                triangle_removed[triangle_idx] = true;
+                --triangle_count;
+            } else {
+                std::ranges::replace(triangle, from, to);
+                vertex_triangles[to].push_back(triangle_idx);
+            }
+        }
+
+        std::vector<std::uint32_t>().swap(vertex_triangles[from]);
+        vertex_removed[from] = true;
+        quadrics[to] += quadrics[from];
+        ++vertex_versions[to];
+
+        gather_neighbors(to, to_neighbors);
+        for (const vertex_index neighbor : to_neighbors) {
+            push_edge(to, neighbor);
+        }
+    }
+
+    // Keeps only the vertices still used by a triangle, in their order.
+    constexpr vertex_index UNUSED = ~vertex_index{0};
+    std::vector<vertex_index> remap(vertex_count, UNUSED);
+    std::vector<vec3<F>> vertices;
+    std::vector<vec2<F>> uvs;
+    std::vector<std::array<vertex_index, 3>> kept_triangles;
+    kept_triangles.reserve(triangle_count);
+
+    for (std::size_t triangle_idx = 0; triangle_idx < triangles.size(); ++triangle_idx) {
+        if (triangle_removed[triangle_idx]) {
+            continue;
+        }
+
+        auto triangle = triangles[triangle_idx];
+        for (vertex_index& vertex_idx : triangle) {
+            if (remap[vertex_idx] == UNUSED) {
+                remap[vertex_idx] = static_cast<vertex_index>(vertices.size());
+                vertices.push_back(mesh.vertices[vertex_idx]);
+                if (!mesh.uvs.empty()) {
+                    uvs.push_back(mesh.uvs[vertex_idx]);
+                }
+            }
+
+            vertex_idx = remap[vertex_idx];
+        }
+
+        kept_triangles.push_back(triangle);
+    }
+
+    return mesh_object<F>(mesh.material_idx, std::move(vertices), std::move(uvs), std::move(kept_triangles), mesh.visibility);
+}
+
+// The triangle count a mesh is simplified to: triangle_ratio of its
+// triangles, but no fewer than min_triangle_count. Meshes with no more than
+// that are kept as they are.
+[[nodiscard]] constexpr std::size_t simplified_triangle_count(const std::size_t triangle_count, const double triangle_ratio, const std::size_t min_triangle_count) noexcept {
+    if (triangle_count <= min_triangle_count) {
+        return triangle_count;
+    }
+
+    return std::max(min_triangle_count, static_cast<std::size_t>(static_cast<double>(triangle_count) * triangle_ratio));
+}
+
+// The cache file of a simplified mesh holds a header, which has to match
+// exactly, followed by its vertices, uvs and triangles. The normals and the
+// bounding box are computed again when it is read, after the triangles'
+// vertex indices and the uvs are checked like the loader checks them, so a
+// corrupt file is simplified again rather than read out of bounds.
+struct simplified_mesh_header {
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t float_size;
+    std::uint64_t key;
+    std::uint64_t target_triangle_count;
+
+    constexpr bool operator==(const simplified_mesh_header&) const noexcept = default;
+};
+
+constexpr std::array<char, 8> SIMPLIFIED_MESH_CACHE_MAGIC{'L', 'O', 'D', 'M', 'E', 'S', 'H', '\0'};
+constexpr std::uint32_t SIMPLIFIED_MESH_CACHE_VERSION = 1;
+
+// Hash of everything the simplified mesh depends on: the vertices, uvs and
+// triangles of the mesh and the target triangle count.
+template <typename F>
+[[nodiscard]] std::uint64_t simplified_mesh_key(const mesh_object<F>& mesh, const std::size_t target_triangle_count) noexcept {
+    content_hasher hasher;
+
+    hasher.add(SIMPLIFIED_MESH_CACHE_VERSION);
+    hasher.add(sizeof(F));
+    hasher.add(target_triangle_count);
+
+    hasher.add(mesh.vertices.size());
+    for (const auto& vertex : mesh.vertices) {
+        hasher.add(vertex.x);
+        hasher.add(vertex.y);
+        hasher.add(vertex.z);
+    }
+
+    hasher.add(mesh.uvs.size());
+    for (const auto& uv : mesh.uvs) {
+        hasher.add(uv.x);
+        hasher.add(uv.y);
+    }
+
+    hasher.add(mesh.triangles.size());
+    for (const auto& triangle : mesh.triangles) {
+        for (const vertex_index vertex_idx : triangle) {
+            hasher.add(vertex_idx);
+        }
+    }
+
+    return hasher.state;
+}
+
+// Like simplify_mesh, but reads the simplified mesh from the cache directory
+// if it has one for the same mesh and target, and simplifies the mesh and
+// writes the result there otherwise.
+template <typename F>
+mesh_object<F> simplify_mesh(const mesh_object<F>& mesh, const std::size_t target_triangle_count, const std::filesystem::path& cache_directory) {
+    const std::uint64_t key = simplified_mesh_key(mesh, target_triangle_count);
+    const simplified_mesh_header header{SIMPLIFIED_MESH_CACHE_MAGIC, SIMPLIFIED_MESH_CACHE_VERSION, sizeof(F), key, target_triangle_count};
+    const std::filesystem::path cache_path = cache_directory / std::format("{:016x}.lod", key);
+
+    if (std::ifstream in(cache_path, std::ios::binary); in) {
+        simplified_mesh_header cached_header;
+        std::vector<vec3<F>> vertices;
+        std::vector<vec2<F>> uvs;
+        std::vector<std::array<vertex_index, 3>> triangles;
+
+        if (read_binary(in, cached_header) && cached_header == header &&
+            read_binary(in, vertices) && read_binary(in, uvs) && read_binary(in, triangles) &&
+            valid_mesh_indices(vertices, uvs, triangles)) {
+            return mesh_object<F>(mesh.material_idx, std::move(vertices), std::move(uvs), std::move(triangles), mesh.visibility);
+        }
+    }
+
+    mesh_object<F> simplified = simplify_mesh(mesh, target_triangle_count);
+
+    std::error_code error;
+    std::filesystem::create_directories(cache_directory, error);
+    if (std::ofstream out(cache_path, std::ios::binary); out) {
+        write_binary(out, header);
+        write_binary(out, std::span<const vec3<F>>(simplified.vertices));
+        write_binary(out, std::span<const vec2<F>>(simplified.uvs));
+        write_binary(out, std::span<const std::array<vertex_index, 3>>(simplified.triangles));
+    }
+
+    return simplified;
+}
+
+// A copy of the scene with every mesh simplified (see
+// simplified_triangle_count), as the coarse level of detail. Everything else,
+// including the materials and the mesh indices the instances refer to, is
+// unchanged, so the hits on either scene are shaded alike. An empty cache
+// directory disables the cache.
+template <typename F>
+scene<F> simplify_scene(scene<F> scene, const double triangle_ratio, const std::size_t min_triangle_count, const std::filesystem::path& cache_directory) {
+    for (auto& mesh : scene.meshes) {
+        const std::size_t target_triangle_count = simplified_triangle_count(mesh.triangles.size(), triangle_ratio, min_triangle_count);
+        if (target_triangle_count < mesh.triangles.size()) {
+            mesh = cache_directory.empty() ? simplify_mesh(mesh, target_triangle_count) : simplify_mesh(mesh, target_triangle_count, cache_directory);
+        }
+    }
+
+    return scene;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+// The kinds of rays the renderer traces. Refracted rays count as reflection
+// rays, as both continue a specular path.
+enum class ray_type : std::uint8_t {
+    camera,
+    shadow,
+    reflection,
+    diffuse,
+};
+
+constexpr std::size_t ray_type_count = 4;
+
+constexpr std::array<ray_type, ray_type_count> all_ray_types{ray_type::camera, ray_type::shadow, ray_type::reflection, ray_type::diffuse};
+
+[[nodiscard]] constexpr std::string_view ray_type_name(const ray_type type) noexcept {
+    switch (type) {
+        case ray_type::camera:
+            return "camera";
+        case ray_type::shadow:
+            return "shadow";
+        case ray_type::reflection:
+            return "reflection";
+        default:
+            return "diffuse";
+    }
+}
+
+// A set of ray types, with one bit per type.
+using ray_type_mask = std::uint8_t;
+
+[[nodiscard]] constexpr ray_type_mask ray_type_bit(const ray_type type) noexcept {
+    return static_cast<ray_type_mask>(1u << std::to_underlying(type));
+}
+
+constexpr ray_type_mask all_ray_types_mask = (1u << ray_type_count) - 1;
+
+// How the triangles of a mesh are traced, resolved from the mesh and its
+// material: the ray types which can hit them and whether the rays (apart from
+// shadow rays, which always test both sides) skip their back faces.
+struct surface_flags {
+    ray_type_mask visible_to = all_ray_types_mask;
+    bool back_face_culling = false;
+
+    [[nodiscard]] constexpr bool visible(const ray_type type) const noexcept {
+        return (visible_to & ray_type_bit(type)) != 0;
+    }
+
+    constexpr bool operator==(const surface_flags&) const noexcept = default;
+};
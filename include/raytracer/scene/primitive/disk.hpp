@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <optional>
+
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/core/math/vec2.hpp>
+#include <raytracer/core/math/vec3.hpp>
+#include <raytracer/scene/primitive/plane.hpp>
+
+// Analytic disk: the part of the plane through center, facing along normal,
+// within radius of the center.
+template <typename F>
+struct disk {
+    plane<F> surface;
+    F radius;
+
+    constexpr disk(const vec3<F>& center, const vec3<F>& normal, const F radius) noexcept
+        : surface(center, normal), radius(radius) {}
+
+    [[nodiscard]] constexpr const vec3<F>& center() const noexcept {
+        return surface.point;
+    }
+
+    template <bool backface_culling, F eps>
+    constexpr std::optional<F> intersect(const ray3<F>& ray) const noexcept {
+        const auto t = surface.template intersect<backface_culling, eps>(ray);
+        if (!t) {
+            return std::nullopt;
+        }
+
+        const vec3<F> offset = ray.origin + (*t * ray.direction) - center();
+        if (radius * radius < dot(offset, offset)) {
+            return std::nullopt;
+        }
+
+        return t;
+    }
+
+    [[nodiscard]] constexpr std::array<F, 7> parameters() const noexcept {
+        const auto [x, y, z, n_x, n_y, n_z] = surface.parameters();
+
+        return {x, y, z, n_x, n_y, n_z, radius};
+    }
+
+    [[nodiscard]] constexpr vec3<F> normal_at(const vec3<F>& point) const noexcept {
+        return surface.normal_at(point);
+    }
+
+    // The disk is mapped into the unit square of uv space, centered on
+    // (0.5, 0.5).
+    [[nodiscard]] constexpr vec2<F> uv_at(const vec3<F>& point) const noexcept {
+        const vec3<F> offset = point - center();
+        const F scale = static_cast<F>(.5) / radius;
+
+        return {
+            static_cast<F>(.5) + scale * dot(offset, surface.frame.tangent),
+            static_cast<F>(.5) + scale * dot(offset, surface.frame.bitangent)
+        };
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <optional>
+
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/core/math/vec2.hpp>
+#include <raytracer/core/math/vec3.hpp>
+
+// Two unit vectors completing the unit normal to an orthonormal basis (after
+// Duff et al., without the singularity of the cross product with a fixed
+// axis).
+template <typename F>
+struct tangent_frame {
+    vec3<F> tangent;
+    vec3<F> bitangent;
+
+    constexpr explicit tangent_frame(const vec3<F>& normal) noexcept {
+        const F sign = std::copysign(static_cast<F>(1.), normal.z);
+        const F a = static_cast<F>(-1.) / (sign + normal.z);
+        const F b = normal.x * normal.y * a;
+
+        tangent = {static_cast<F>(1.) + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+        bitangent = {b, sign + normal.y * normal.y * a, -normal.y};
+    }
+};
+
+// Analytic infinite plane through point, facing along normal. As it has no
+// bounds, the acceleration structures test planes next to their trees
+// instead of inside them.
+template <typename F>
+struct plane {
+    vec3<F> point;
+    vec3<F> normal;
+    F offset;
+    tangent_frame<F> frame;
+
+    constexpr plane(const vec3<F>& point, const vec3<F>& normal) noexcept
+        : point(point), normal(normalized(normal)), offset(dot(this->normal, point)), frame(this->normal) {}
+
+    // A ray hits the front face if it runs against the normal. Only rays
+    // exactly parallel to the plane are rejected, like the packet kernels
+    // do.
+    template <bool backface_culling, F eps>
+    constexpr std::optional<F> intersect(const ray3<F>& ray) const noexcept {
+        const F direction_n = dot(normal, ray.direction);
+
+        if constexpr (backface_culling) {
+            if (!(direction_n < static_cast<F>(0.))) {
+                return std::nullopt;
+            }
+        } else {
+            if (direction_n == static_cast<F>(0.)) {
+                return std::nullopt;
+            }
+        }
+
+        const F t = (offset - dot(normal, ray.origin)) / direction_n;
+        if (!(eps < t)) {
+            return std::nullopt;
+        }
+
+        return t;
+    }
+
+    [[nodiscard]] constexpr std::array<F, 6> parameters() const noexcept {
+        return {point.x, point.y, point.z, normal.x, normal.y, normal.z};
+    }
+
+    [[nodiscard]] constexpr vec3<F> normal_at([[maybe_unused]] const vec3<F>& point) const noexcept {
+        return normal;
+    }
+
+    // The plane is tiled with the unit square of uv space, so every unit
+    // along the tangents repeats the texture.
+    [[nodiscard]] constexpr vec2<F> uv_at(const vec3<F>& hit_point) const noexcept {
+        const vec3<F> offset = hit_point - point;
+        const F u = dot(offset, frame.tangent);
+        const F v = dot(offset, frame.bitangent);
+
+        return {u - std::floor(u), v - std::floor(v)};
+    }
+};
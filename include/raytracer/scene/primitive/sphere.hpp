@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numbers>
+#include <optional>
+
+#include <raytracer/core/math/ray3.hpp>
+#include <raytracer/core/math/vec2.hpp>
+#include <raytracer/core/math/vec3.hpp>
+
+// Analytic sphere. Its outside is the front face, so a culled sphere is only
+// hit where rays enter it, not from the inside.
+template <typename F>
+struct sphere {
+    vec3<F> center;
+    F radius;
+
+    // Solves |o + t d - c|^2 = r^2 with the half b coefficient, returning the
+    // nearer root beyond eps, or the farther one (the exit) if the origin is
+    // inside and back faces aren't culled.
+    template <bool backface_culling, F eps>
+    constexpr std::optional<F> intersect(const ray3<F>& ray) const noexcept {
+        const vec3<F> oc = ray.origin - center;
+        const F a = dot(ray.direction, ray.direction);
+        const F b = dot(oc, ray.direction);
+        const F c = dot(oc, oc) - radius * radius;
+
+        const F discriminant = b * b - a * c;
+        if (discriminant < static_cast<F>(0.)) {
+            return std::nullopt;
+        }
+
+        const F root = std::sqrt(discriminant);
+        const F t_near = (-b - root) / a;
+        if (eps < t_near) {
+            return t_near;
+        }
+
+        if constexpr (!backface_culling) {
+            const F t_far = (-b + root) / a;
+            if (eps < t_far) {
+                return t_far;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    // The values defining the shape, e.g. for hashing it.
+    [[nodiscard]] constexpr std::array<F, 4> parameters() const noexcept {
+        return {center.x, center.y, center.z, radius};
+    }
+
+    [[nodiscard]] constexpr vec3<F> normal_at(const vec3<F>& point) const noexcept {
+        return normalized(point - center);
+    }
+
+    // Longitude and latitude, both mapped to [0, 1], with v = 1 at the top
+    // (+y) pole.
+    [[nodiscard]] constexpr vec2<F> uv_at(const vec3<F>& point) const noexcept {
+        const vec3<F> n = normal_at(point);
+        const F longitude = std::atan2(n.z, n.x);
+        const F latitude = std::asin(std::clamp(n.y, static_cast<F>(-1.), static_cast<F>(1.)));
+
+        return {
+            static_cast<F>(.5) + longitude / (static_cast<F>(2.) * std::numbers::pi_v<F>),
+            static_cast<F>(.5) + latitude / std::numbers::pi_v<F>
+        };
+    }
+};
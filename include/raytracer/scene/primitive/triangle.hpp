@@ -1,33 +1,28 @@
 #pragma once
 
-#include <array>
+#include <cmath>
+#include <cstdint>
+#include <optional>
 
-#include <raytracer/core/math/vec2.hpp>
+#include <raytracer/core/math/ray3.hpp>
 #include <raytracer/core/math/vec3.hpp>
-#include <raytracer/core/math/aabb3.hpp>
 #include <raytracer/scene/primitive/hit.hpp>
 
+// Index into a mesh's vertex buffers. 32 bits are plenty for a single mesh
+// and halve the size of the index buffers.
+using vertex_index = std::uint32_t;
+
+// Intersection data of a triangle: a vertex and the two edges from it. The
+// vertices and shading attributes are only stored once, indexed, in the
+// triangle's mesh, which builds these where they are needed (see
+// mesh_object::triangle_at).
 template <typename F>
 struct triangle {
-    vec3<F> v0, v1, v2;
+    vec3<F> v0;
     vec3<F> e1, e2;
-    vec3<F> normal;
-    std::array<std::size_t, 3> vertex_indices;
-    std::size_t mesh_idx;
-    aabb3<F> box;
-    vec3<vec2<F>> uvs;
-
-    constexpr triangle(const vec3<F>& v0, const vec3<F>& v1, const vec3<F>& v2, const std::array<std::size_t, 3>& vertex_indices, const std::size_t mesh_idx, const vec3<vec2<F>>& uvs)
-        : v0(v0), v1(v1), v2(v2), vertex_indices(vertex_indices), mesh_idx(mesh_idx), uvs(uvs) {
-        normal = normalized(cross(v1 - v0, v2 - v0));
 
-        e1 = v1 - v0;
-        e2 = v2 - v0;
-        
-        box.expand(v0);
-        box.expand(v1);
-        box.expand(v2);
-    }
+    constexpr triangle(const vec3<F>& v0, const vec3<F>& v1, const vec3<F>& v2) noexcept
+        : v0(v0), e1(v1 - v0), e2(v2 - v0) {}
 
     template <bool backface_culling, F eps>
     constexpr std::optional<triangle_hit<F>> intersect(const ray3<F>& ray) const noexcept {
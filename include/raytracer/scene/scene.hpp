@@ -1,11 +1,19 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <numeric>
+#include <span>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include <raytracer/scene/object/mesh.hpp>
+#include <raytracer/scene/object/instance.hpp>
+#include <raytracer/scene/object/primitive.hpp>
+#include <raytracer/scene/object/visibility.hpp>
 #include <raytracer/scene/material/material.hpp>
+#include <raytracer/scene/material/queries.hpp>
 #include <raytracer/scene/texture/texture.hpp>
 #include <raytracer/scene/camera.hpp>
 #include <raytracer/scene/light.hpp>
@@ -19,4 +27,119 @@ struct scene {
     std::unordered_map<std::string, texture_variant<F>> textures;
     std::vector<material_variant<F>> materials;
     std::vector<mesh_object<F>> meshes;
+    std::vector<mesh_instance<F>> instances;
+    std::vector<primitive_object<F>> primitives;
 };
+
+// The surface flags of a mesh or primitive: its visibility, except that
+// transmissive surfaces never block shadow rays, and its material's back face
+// culling.
+template <typename F>
+constexpr surface_flags resolve_surface_flags(const scene<F>& scene, const std::size_t material_idx, ray_type_mask visible_to) {
+    const auto& material = scene.materials[material_idx];
+
+    if (is_transmissive(material)) {
+        visible_to &= static_cast<ray_type_mask>(~ray_type_bit(ray_type::shadow));
+    }
+
+    return {visible_to, back_face_culling_of(material)};
+}
+
+template <typename F>
+constexpr surface_flags surface_flags_of(const scene<F>& scene, const std::size_t mesh_idx) {
+    const auto& mesh = scene.meshes[mesh_idx];
+
+    return resolve_surface_flags(scene, mesh.material_idx, mesh.visibility);
+}
+
+template <typename F>
+constexpr surface_flags primitive_surface_flags(const scene<F>& scene, const std::size_t primitive_idx) {
+    const auto& primitive = scene.primitives[primitive_idx];
+
+    return resolve_surface_flags(scene, primitive.material_idx, primitive.visibility);
+}
+
+// surface_flags_of every mesh, for resolving the flags once before rendering.
+template <typename F>
+std::vector<surface_flags> mesh_surface_flags(const scene<F>& scene) {
+    std::vector<surface_flags> flags(scene.meshes.size());
+    for (std::size_t mesh_idx = 0; mesh_idx < scene.meshes.size(); ++mesh_idx) {
+        flags[mesh_idx] = surface_flags_of(scene, mesh_idx);
+    }
+
+    return flags;
+}
+
+// A triangle of the scene, by the index of its mesh and its index in the mesh.
+// The acceleration structures keep these instead of copies of the triangles.
+struct triangle_ref {
+    std::uint32_t mesh_idx;
+    std::uint32_t triangle_idx;
+};
+
+// The triangles of the given meshes, in order.
+template <typename F>
+std::vector<triangle_ref> gather_triangle_refs(const scene<F>& scene, std::span<const std::size_t> mesh_indices) {
+    std::size_t triangle_count = 0;
+    for (const std::size_t mesh_idx : mesh_indices) {
+        triangle_count += scene.meshes[mesh_idx].triangles.size();
+    }
+
+    std::vector<triangle_ref> refs;
+    refs.reserve(triangle_count);
+    for (const std::size_t mesh_idx : mesh_indices) {
+        const auto& mesh = scene.meshes[mesh_idx];
+        for (std::size_t triangle_idx = 0; triangle_idx < mesh.triangles.size(); ++triangle_idx) {
+            refs.push_back({static_cast<std::uint32_t>(mesh_idx), static_cast<std::uint32_t>(triangle_idx)});
+        }
+    }
+
+    return refs;
+}
+
+template <typename F>
+constexpr std::array<vec3<F>, 3> triangle_vertices(const scene<F>& scene, const triangle_ref ref) noexcept {
+    return scene.meshes[ref.mesh_idx].triangle_vertices(ref.triangle_idx);
+}
+
+template <typename F>
+constexpr triangle<F> triangle_at(const scene<F>& scene, const triangle_ref ref) noexcept {
+    return scene.meshes[ref.mesh_idx].triangle_at(ref.triangle_idx);
+}
+
+template <typename F>
+constexpr aabb3<F> triangle_box(const scene<F>& scene, const triangle_ref ref) noexcept {
+    return scene.meshes[ref.mesh_idx].triangle_box(ref.triangle_idx);
+}
+
+template <typename F>
+std::vector<std::size_t> all_mesh_indices(const scene<F>& scene) {
+    std::vector<std::size_t> mesh_indices(scene.meshes.size());
+    std::iota(mesh_indices.begin(), mesh_indices.end(), 0uz);
+
+    return mesh_indices;
+}
+
+// Copies the instanced meshes into the scene as new meshes with world space
+// vertices, for the acceleration structures which only trace world space
+// triangles. Only the vertices are transformed, the index and uv buffers and
+// the visibility are copied unchanged.
+template <typename F>
+scene<F> bake_instances(scene<F> scene) {
+    for (const auto& instance : scene.instances) {
+        const auto& mesh = scene.meshes[instance.mesh_idx];
+
+        std::vector<vec3<F>> vertices;
+        vertices.reserve(mesh.vertices.size());
+        for (const auto& vertex : mesh.vertices) {
+            vertices.push_back(instance.point_to_world(vertex));
+        }
+
+        mesh_object<F> baked_mesh(mesh.material_idx, std::move(vertices), mesh.uvs, mesh.triangles, mesh.visibility);
+        scene.meshes.push_back(std::move(baked_mesh));
+    }
+
+    scene.instances.clear();
+
+    return scene;
+}
@@ -10,16 +10,15 @@
 
 template <typename F>
 image<F> load_bitmap(const std::string& file_path) {
-    std::vector<std::vector<color<F>>> buffer;
+    std::vector<color<F>> buffer;
     int32_t width, height, channels_in_file;
     unsigned char* data = stbi_load(file_path.c_str(), &width, &height, &channels_in_file, 0);
 
-    buffer.resize(height);
+    buffer.resize(static_cast<std::size_t>(height) * static_cast<std::size_t>(width));
 
     const auto color_scale = F(1.0 / 255.0);
 
     for (int j = 0; j < height; ++j) {
-        buffer[j].resize(width);
         for (int i = 0; i < width; ++i) {
             const auto pixel_offset = (j * width + i) * channels_in_file;
 
@@ -27,7 +26,7 @@ image<F> load_bitmap(const std::string& file_path) {
             auto g = static_cast<F>(data[pixel_offset + 1]) * color_scale;
             auto b = static_cast<F>(data[pixel_offset + 2]) * color_scale;
 
-            buffer[j][i] = color<F>(r, g, b);
+            buffer[static_cast<std::size_t>(j * width + i)] = color<F>(r, g, b);
         }
     }
 
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Heap allocation counting of the RAYTRACER_COUNT_ALLOCATIONS build mode, in
+// which src/allocation_count.cpp replaces the global operator new with one
+// that counts the allocations of every thread. The render path includes this
+// header before its instruction set namespace (see render_isa.hpp), so all
+// levels share the counter with operator new.
+#ifdef RAYTRACER_COUNT_ALLOCATIONS
+constexpr bool count_heap_allocations = true;
+
+// The heap allocations the calling thread has made so far.
+[[nodiscard]] std::uint64_t thread_heap_allocations() noexcept;
+#else
+constexpr bool count_heap_allocations = false;
+
+[[nodiscard]] inline std::uint64_t thread_heap_allocations() noexcept {
+    return 0;
+}
+#endif
+
+// The heap allocations made while tracing the tiles of the last frame, which
+// should be none, as the traversals and the shading only use the stack.
+struct allocation_stats {
+    static inline std::atomic<std::uint64_t> frame_allocations{0};
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+// Instruction set levels the render path is compiled for. The baseline is
+// whatever the whole program is compiled for, the others are x86 levels
+// which are only used if the CPU supports them.
+enum class isa_level {
+    baseline,
+    avx2,
+    avx512,
+};
+
+[[nodiscard]] constexpr std::string_view isa_level_name(const isa_level level) noexcept {
+    switch (level) {
+        case isa_level::avx2:
+            return "avx2";
+        case isa_level::avx512:
+            return "avx512";
+        default:
+            return "baseline";
+    }
+}
+
+[[nodiscard]] constexpr std::optional<isa_level> parse_isa_level(const std::string_view name) noexcept {
+    for (const isa_level level : {isa_level::baseline, isa_level::avx2, isa_level::avx512}) {
+        if (name == isa_level_name(level)) {
+            return level;
+        }
+    }
+
+    return std::nullopt;
+}
+
+// The highest level the CPU supports. The compiler's CPUID helpers also check
+// that the OS saves the wider registers, so a level is only reported if it
+// can actually be used.
+[[nodiscard]] inline isa_level detect_isa_level() noexcept {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw")) {
+        return isa_level::avx512;
+    }
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return isa_level::avx2;
+    }
+#endif
+
+    return isa_level::baseline;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+
+// Stack with a fixed capacity, stored inline (on the stack, when it is a
+// local), for the traversal stacks of the acceleration structures, which
+// would otherwise allocate on every ray. The capacity has to bound the depth
+// of the traversal, which the structures derive from the depth of their
+// trees. Pushing beyond it is a bug, only checked by an assertion.
+template <typename T, std::size_t capacity>
+struct fixed_stack {
+    std::array<T, capacity> entries;
+    std::size_t count = 0;
+
+    [[nodiscard]] constexpr bool empty() const noexcept {
+        return count == 0;
+    }
+
+    [[nodiscard]] constexpr std::size_t size() const noexcept {
+        return count;
+    }
+
+    constexpr void push(const T& entry) noexcept {
+        assert(count < capacity);
+        entries[count++] = entry;
+    }
+
+    constexpr void pop() noexcept {
+        assert(count != 0);
+        --count;
+    }
+
+    [[nodiscard]] constexpr const T& top() const noexcept {
+        assert(count != 0);
+        return entries[count - 1];
+    }
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+
+// 64-bit FNV-1a hash, fed value by value. Only meant for cache keys, not for
+// anything security related.
+struct content_hasher {
+    std::uint64_t state = 14695981039346656037ull;
+
+    template <typename T>
+    requires std::is_arithmetic_v<T>
+    constexpr void add(const T value) noexcept {
+        const auto bytes = std::bit_cast<std::array<std::byte, sizeof(T)>>(value);
+
+        for (const std::byte byte : bytes) {
+            state ^= static_cast<std::uint64_t>(byte);
+            state *= 1099511628211ull;
+        }
+    }
+
+    // Adds the raw bytes of the values, e.g. to checksum a file's payload.
+    template <typename T>
+    requires std::is_trivially_copyable_v<T>
+    void add_bytes(std::span<const T> values) noexcept {
+        for (const std::byte byte : std::as_bytes(values)) {
+            state ^= static_cast<std::uint64_t>(byte);
+            state *= 1099511628211ull;
+        }
+    }
+};
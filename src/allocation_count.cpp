@@ -0,0 +1,109 @@
+// The global allocation functions of the RAYTRACER_COUNT_ALLOCATIONS build
+// mode (see CMakeLists.txt), which count the heap allocations of every thread
+// before forwarding them to malloc. The nothrow forms of the standard library
+// call these, so they are counted as well.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include <raytracer/utils/allocation_count.hpp>
+
+namespace {
+    thread_local std::uint64_t allocation_count = 0;
+
+    void* allocate(std::size_t size) {
+        ++allocation_count;
+
+        if (size == 0) {
+            size = 1;
+        }
+
+        while (true) {
+            if (void* ptr = std::malloc(size); ptr != nullptr) {
+                return ptr;
+            }
+
+            const std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr) {
+                throw std::bad_alloc();
+            }
+
+            handler();
+        }
+    }
+
+    // aligned_alloc needs the size to be a multiple of the alignment.
+    void* allocate_aligned(const std::size_t size, const std::align_val_t alignment) {
+        ++allocation_count;
+
+        const auto align = static_cast<std::size_t>(alignment);
+        const std::size_t aligned_size = size == 0 ? align : (size + align - 1) / align * align;
+
+        while (true) {
+            if (void* ptr = std::aligned_alloc(align, aligned_size); ptr != nullptr) {
+                return ptr;
+            }
+
+            const std::new_handler handler = std::get_new_handler();
+            if (handler == nullptr) {
+                throw std::bad_alloc();
+            }
+
+            handler();
+        }
+    }
+}
+
+std::uint64_t thread_heap_allocations() noexcept {
+    return allocation_count;
+}
+
+void* operator new(const std::size_t size) {
+    return allocate(size);
+}
+
+void* operator new[](const std::size_t size) {
+    return allocate(size);
+}
+
+void* operator new(const std::size_t size, const std::align_val_t alignment) {
+    return allocate_aligned(size, alignment);
+}
+
+void* operator new[](const std::size_t size, const std::align_val_t alignment) {
+    return allocate_aligned(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
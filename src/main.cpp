@@ -1,46 +1,87 @@
+#include <algorithm>
+#include <cstdlib>
 #include <filesystem>
-#include <fstream>
 #include <print>
-#include <iostream>
-
-#include <raytracer/config.hpp>
-#include <raytracer/io/image/ppm.hpp>
-#include <raytracer/io/json/loader.hpp>
-#include <raytracer/scene/scene.hpp>
-#include <raytracer/render/render.hpp>
-#include <raytracer/render/accel/kd_tree_simd.hpp>
-
-template <typename A, typename F>
-void render_still(const A& accel)
-requires accelerator<A, F> {
-    auto render_start = std::chrono::high_resolution_clock::now();
-    auto image = render_frame<A, F>(accel, scheduling_type::BUCKET_TILES);
-    auto render_end = std::chrono::high_resolution_clock::now();
-
-    auto duration = duration_cast<std::chrono::milliseconds>(render_end - render_start);
-    std::println("Rendering took {} seconds.", duration.count() / 1'000.);
-
-    std::ofstream output_file_stream("image.ppm", std::ios::out | std::ios::binary);
-    write_ppm(image, output_file_stream);
-}
+#include <string_view>
+#include <vector>
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        std::println("Usage: ./raytracer FILE");
+#include <raytracer/utils/cpu.hpp>
 
-        return 1;
+#include "render_dispatch.hpp"
+
+// The level used unless RAYTRACER_ISA asks for another. The AVX-512 path
+// rendered slower than the AVX2 one wherever it was measured (e.g. 0.96s
+// against 0.81s on hw15/scene2 and 2.66s against 2.50s on hw11/scene8), so it
+// is only used on request.
+constexpr isa_level default_isa_level = isa_level::avx2;
+
+// Renders with the default instruction set level, or the one the
+// RAYTRACER_ISA environment variable names, e.g. to compare them on the same
+// machine, as far as the CPU supports it.
+int render_with_best_isa(const std::filesystem::path& scene_file_path, const std::string_view accel_name, const render_options& options) {
+    isa_level level = default_isa_level;
+
+    if (const char* requested = std::getenv("RAYTRACER_ISA"); requested != nullptr && *requested != '\0') {
+        const auto requested_level = parse_isa_level(requested);
+        if (!requested_level) {
+            std::println("Unknown instruction set level: {}", requested);
+
+            return 1;
+        }
+
+        level = *requested_level;
     }
 
-    const std::filesystem::path& scene_file_path = argv[1];
+    level = std::min(level, detect_isa_level());
+
+#ifdef RAYTRACER_ISA_AVX512
+    if (level == isa_level::avx512) {
+        std::println("Using the {} render path with {} floats per SIMD vector.", isa_level_name(level), isa_avx512::simd_width());
 
-    using F = float;
-    using A = kd_tree_simd_accel<F, static_cast<F>(epsilon)>;
+        return isa_avx512::render_scene_file(scene_file_path, accel_name, options);
+    }
+#endif
+
+#ifdef RAYTRACER_ISA_AVX2
+    if (level >= isa_level::avx2) {
+        std::println("Using the {} render path with {} floats per SIMD vector.", isa_level_name(isa_level::avx2), isa_avx2::simd_width());
 
-    const auto scene = parse_scene_file<F>(scene_file_path);
+        return isa_avx2::render_scene_file(scene_file_path, accel_name, options);
+    }
+#endif
 
-    auto accelerator = A(std::make_shared<decltype(scene)>(scene));
+    std::println("Using the {} render path with {} floats per SIMD vector.", isa_level_name(isa_level::baseline), isa_baseline::simd_width());
+
+    return isa_baseline::render_scene_file(scene_file_path, accel_name, options);
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string_view> arguments;
+    render_options options;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view argument = argv[i];
+        if (argument == "--accel-stats") {
+            options.accel_stats = true;
+        } else if (argument.starts_with("--integrator=")) {
+            options.integrator = argument.substr(std::string_view("--integrator=").size());
+        } else if (argument.starts_with("--")) {
+            std::println("Unknown option: {}", argument);
+
+            return 1;
+        } else {
+            arguments.push_back(argument);
+        }
+    }
+
+    if (arguments.size() != 1 && arguments.size() != 2) {
+        std::println("Usage: ./raytracer FILE [list|kd_tree|kd_tree_simd|kd_tree_simd_mailbox|kd_tree_simd_woop|kd_tree_simd_plucker|kd_tree_simd_auto|bvh4|bvh8|sbvh4|sbvh8|lbvh4|lbvh8|grid|two_level|two_level_bvh8] [--accel-stats] [--integrator=whitted|path]");
+
+        return 1;
+    }
 
-    render_still<decltype(accelerator), F>(accelerator);
+    const std::filesystem::path scene_file_path = arguments[0];
+    const std::string_view accel_name = arguments.size() == 2 ? arguments[1] : "kd_tree_simd";
 
-    return 0;
+    return render_with_best_isa(scene_file_path, accel_name, options);
 }
@@ -0,0 +1,2 @@
+#define RAYTRACER_ISA isa_avx2
+#include "render_isa.hpp"
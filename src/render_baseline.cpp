@@ -0,0 +1,2 @@
+#define RAYTRACER_ISA isa_baseline
+#include "render_isa.hpp"
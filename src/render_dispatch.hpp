@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string_view>
+
+// Entry points of the render path, which is compiled once per instruction set
+// level (see render_isa.hpp). Only the baseline is always compiled in, the
+// others are built on x86 only, where RAYTRACER_ISA_AVX2 and
+// RAYTRACER_ISA_AVX512 are defined.
+
+// Options of a render given on the command line, which are passed to the
+// level as is, so it may only hold standard types.
+struct render_options {
+    // Writes the build stats of the acceleration structure to
+    // accel_stats.json (--accel-stats).
+    bool accel_stats = false;
+
+    // The integrator computing the colors of the camera hits, whitted or
+    // path (--integrator=NAME).
+    std::string_view integrator = "whitted";
+};
+
+namespace isa_baseline {
+    [[nodiscard]] std::size_t simd_width() noexcept;
+    int render_scene_file(const std::filesystem::path& scene_file_path, std::string_view accel_name, const render_options& options);
+}
+
+namespace isa_avx2 {
+    [[nodiscard]] std::size_t simd_width() noexcept;
+    int render_scene_file(const std::filesystem::path& scene_file_path, std::string_view accel_name, const render_options& options);
+}
+
+namespace isa_avx512 {
+    [[nodiscard]] std::size_t simd_width() noexcept;
+    int render_scene_file(const std::filesystem::path& scene_file_path, std::string_view accel_name, const render_options& options);
+}
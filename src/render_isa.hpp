@@ -0,0 +1,303 @@
+// The render path of one instruction set level. Every src/render_<level>.cpp
+// defines RAYTRACER_ISA as the level's namespace and includes this file, and
+// is compiled with the level's flags (see CMakeLists.txt).
+//
+// All of the raytracer's headers are included into that namespace, so every
+// level has its own copy of every function, down to the vector math, which
+// the linker can't mix up with another level's copy. Only the standard
+// library, the third party headers and the allocation counter, which is
+// shared with the global operator new, are included outside of it (first, so
+// their include guards keep them out of the namespace), which is why the
+// levels only exchange standard types and each level parses the scene
+// itself. The copies of those headers' templates a wider level instantiates
+// do have the same names as the baseline's, so the build makes them local to
+// the level's object.
+
+#ifndef RAYTRACER_ISA
+#error "RAYTRACER_ISA must be defined as the namespace of the instruction set level"
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <print>
+#include <queue>
+#include <random>
+#include <ranges>
+#include <span>
+#include <stack>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <experimental/simd>
+#include <simdjson.h>
+#include <stb_image.h>
+
+#include <raytracer/utils/allocation_count.hpp>
+
+#include "render_dispatch.hpp"
+
+namespace RAYTRACER_ISA {
+
+#include <raytracer/config.hpp>
+#include <raytracer/io/image/ppm.hpp>
+#include <raytracer/io/json/accel_stats.hpp>
+#include <raytracer/io/json/loader.hpp>
+#include <raytracer/scene/scene.hpp>
+#include <raytracer/render/render.hpp>
+#include <raytracer/render/tuning.hpp>
+#include <raytracer/render/accel/list.hpp>
+#include <raytracer/render/accel/kd_tree.hpp>
+#include <raytracer/render/accel/kd_tree_simd.hpp>
+#include <raytracer/render/accel/bvh_wide.hpp>
+#include <raytracer/render/accel/grid.hpp>
+#include <raytracer/render/accel/instance.hpp>
+#include <raytracer/render/accel/mailbox.hpp>
+#include <raytracer/render/accel/lod.hpp>
+#include <raytracer/render/accel/stats.hpp>
+#include <raytracer/scene/object/simplify.hpp>
+
+template <typename A, typename F>
+void render_still(const A& accel, const integrator_type integrator)
+requires accelerator<A, F> {
+    auto render_start = std::chrono::high_resolution_clock::now();
+    auto image = render_frame<A, F>(accel, scheduling_type::BUCKET_TILES, integrator);
+    auto render_end = std::chrono::high_resolution_clock::now();
+
+    auto duration = duration_cast<std::chrono::milliseconds>(render_end - render_start);
+    std::println("Rendering took {} seconds.", duration.count() / 1'000.);
+
+    if constexpr (count_heap_allocations) {
+        std::println("Tracing the tiles made {} heap allocations.", allocation_stats::frame_allocations.load());
+    }
+
+    std::ofstream output_file_stream("image.ppm", std::ios::out | std::ios::binary);
+    write_ppm(image, output_file_stream);
+}
+
+// The names of the scene and the structure in the build stats report, which
+// is only written if it was asked for (--accel-stats).
+struct accel_stats_report {
+    std::string scene_name;
+    std::string structure_name;
+};
+
+// Writes the build stats of the structure to accel_stats.json, next to the
+// image, for the structures which gather them.
+template <typename A, typename F>
+void write_accel_stats_report(const A& accel, const accel_stats_report& report)
+requires accelerator<A, F> {
+    if constexpr (stats_accelerator<A, F>) {
+        std::ofstream output_file_stream("accel_stats.json");
+        write_accel_stats(accel.build_stats(), report.scene_name, report.structure_name, output_file_stream);
+        std::println("Wrote the build stats of the acceleration structure to accel_stats.json.");
+    } else {
+        std::println("The {} acceleration structure doesn't report build stats.", report.structure_name);
+    }
+}
+
+// Builds the structure over the scene and, if the level of detail is on, a
+// second one over its simplified copy.
+template <typename A, typename F>
+void build_and_render(const scene<F>& scene, const integrator_type integrator, const std::optional<accel_stats_report>& report)
+requires accelerator<A, F> {
+    auto build_start = std::chrono::high_resolution_clock::now();
+    auto accelerator = make_accelerator<A, F>(std::make_shared<const RAYTRACER_ISA::scene<F>>(scene));
+    auto build_end = std::chrono::high_resolution_clock::now();
+
+    auto duration = duration_cast<std::chrono::milliseconds>(build_end - build_start);
+    std::println("Building the acceleration structure took {} seconds.", duration.count() / 1'000.);
+
+    if constexpr (requires { accelerator.sah_cost(); }) {
+        std::println("SAH cost of the acceleration structure is {}.", accelerator.sah_cost());
+    }
+
+    if (report) {
+        write_accel_stats_report<A, F>(accelerator, *report);
+    }
+
+    if constexpr (use_lod) {
+        auto lod_start = std::chrono::high_resolution_clock::now();
+        auto coarse_scene = simplify_scene(scene, lod_triangle_ratio, lod_min_triangle_count, std::filesystem::path(accel_cache_directory));
+        std::size_t coarse_triangle_count = 0;
+        for (const auto& mesh : coarse_scene.meshes) {
+            coarse_triangle_count += mesh.triangles.size();
+        }
+
+        lod_accel<A, F> detailed_and_coarse(std::move(accelerator), make_accelerator<A, F>(std::make_shared<const RAYTRACER_ISA::scene<F>>(std::move(coarse_scene))));
+        auto lod_end = std::chrono::high_resolution_clock::now();
+
+        auto lod_duration = duration_cast<std::chrono::milliseconds>(lod_end - lod_start);
+        std::println("Simplifying the meshes to {} triangles and building their acceleration structure took {} seconds.", coarse_triangle_count, lod_duration.count() / 1'000.);
+
+        render_still<lod_accel<A, F>, F>(detailed_and_coarse, integrator);
+    } else {
+        render_still<A, F>(accelerator, integrator);
+    }
+
+    if constexpr (collect_mailbox_stats) {
+        const auto tests = mailbox_stats::tests.load();
+        const auto skipped = mailbox_stats::skipped.load();
+        const double percentage = tests == 0 ? 0. : 100. * static_cast<double>(skipped) / static_cast<double>(tests);
+        std::println("Mailboxing skipped {} of {} intersection tests ({}%).", skipped, tests, percentage);
+    }
+}
+
+// Renders with the kd_tree_simd parameters and leaf packet format which
+// traced a sample of the scene's rays the fastest. The choice is read from
+// (or written to) the sidecar file, so only the first render of a scene
+// builds every candidate.
+template <typename F, F eps>
+void tune_and_render(const scene<F>& scene, const std::filesystem::path& sidecar_path, const integrator_type integrator, std::optional<accel_stats_report> report) {
+    constexpr std::size_t N = stdx::native_simd<F>::size();
+    constexpr std::size_t H = N / 2;
+
+    const accel_tuner<F,
+                      kd_tree_simd_accel<F, eps, 24, N, N>,
+                      kd_tree_simd_accel<F, eps, 32, N, N>,
+                      kd_tree_simd_accel<F, eps, 48, N, N>,
+                      kd_tree_simd_accel<F, eps, 32, 2 * N, N>,
+                      kd_tree_simd_accel<F, eps, 32, H, H>,
+                      kd_tree_simd_accel<F, eps, 48, H, H>,
+                      kd_tree_simd_accel<F, eps, 32, N, N, false, woop_triangle_packet>,
+                      kd_tree_simd_accel<F, eps, 32, N, N, false, plucker_triangle_packet>> tuner{{
+        std::format("max_depth=24 max_leaf_size={} W={}", N, N),
+        std::format("max_depth=32 max_leaf_size={} W={}", N, N),
+        std::format("max_depth=48 max_leaf_size={} W={}", N, N),
+        std::format("max_depth=32 max_leaf_size={} W={}", 2 * N, N),
+        std::format("max_depth=32 max_leaf_size={} W={}", H, H),
+        std::format("max_depth=48 max_leaf_size={} W={}", H, H),
+        std::format("max_depth=32 max_leaf_size={} W={} packets=woop", N, N),
+        std::format("max_depth=32 max_leaf_size={} W={} packets=plucker", N, N),
+    }};
+
+    const std::uint64_t key = tuner.tuning_key(scene);
+    auto choice = tuner.read_choice(sidecar_path, key);
+
+    if (!choice) {
+        auto tuning_start = std::chrono::high_resolution_clock::now();
+        const auto timings = tuner.time_candidates(std::make_shared<const RAYTRACER_ISA::scene<F>>(scene));
+        auto tuning_end = std::chrono::high_resolution_clock::now();
+
+        for (std::size_t candidate_idx = 0; candidate_idx < timings.size(); ++candidate_idx) {
+            std::println("Tracing the tuning rays with {} took {} ms.", tuner.names[candidate_idx], timings[candidate_idx] * 1'000.);
+        }
+
+        choice = static_cast<std::size_t>(std::ranges::min_element(timings) - timings.begin());
+        tuner.write_choice(sidecar_path, key, *choice);
+
+        auto duration = duration_cast<std::chrono::milliseconds>(tuning_end - tuning_start);
+        std::println("Tuning took {} seconds.", duration.count() / 1'000.);
+    }
+
+    std::println("Using kd_tree_simd with {}.", tuner.names[*choice]);
+
+    if (report) {
+        report->structure_name = std::format("{} ({})", report->structure_name, tuner.names[*choice]);
+    }
+
+    tuner.visit(*choice, [&]<typename A>() {
+        build_and_render<A, F>(scene, integrator, report);
+    });
+}
+
+std::size_t simd_width() noexcept {
+    return stdx::native_simd<float>::size();
+}
+
+int render_scene_file(const std::filesystem::path& scene_file_path, const std::string_view accel_name, const render_options& options) {
+    using F = float;
+    constexpr F eps = static_cast<F>(epsilon);
+
+    const auto integrator = parse_integrator_type(options.integrator);
+    if (!integrator) {
+        std::println("Unknown integrator: {}", options.integrator);
+
+        return 1;
+    }
+
+    const auto scene = parse_scene_file<F>(scene_file_path);
+
+    std::optional<accel_stats_report> report;
+    if (options.accel_stats) {
+        report = accel_stats_report{scene_file_path.string(), std::string(accel_name)};
+    }
+
+    // Only the two-level structures trace the instances directly, for all
+    // the others the instanced meshes are copied into world space first.
+    if (accel_name == "list") {
+        build_and_render<list_accel<F, eps>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "kd_tree") {
+        build_and_render<kd_tree_accel<F, eps>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "kd_tree_simd") {
+        build_and_render<kd_tree_simd_accel<F, eps>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "kd_tree_simd_mailbox") {
+        build_and_render<kd_tree_simd_accel<F, eps, 32, stdx::native_simd<F>::size(), stdx::native_simd<F>::size(), true>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "kd_tree_simd_woop") {
+        build_and_render<kd_tree_simd_accel<F, eps, 32, stdx::native_simd<F>::size(), stdx::native_simd<F>::size(), false, woop_triangle_packet>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "kd_tree_simd_plucker") {
+        build_and_render<kd_tree_simd_accel<F, eps, 32, stdx::native_simd<F>::size(), stdx::native_simd<F>::size(), false, plucker_triangle_packet>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "kd_tree_simd_auto") {
+        tune_and_render<F, eps>(bake_instances(scene), std::filesystem::path(scene_file_path).concat(".tuning"), *integrator, report);
+    } else if (accel_name == "bvh4") {
+        build_and_render<bvh_wide_accel<F, eps, 4>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "bvh8") {
+        build_and_render<bvh_wide_accel<F, eps, 8>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "sbvh4") {
+        build_and_render<sbvh_wide_accel<F, eps, 4>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "sbvh8") {
+        build_and_render<sbvh_wide_accel<F, eps, 8>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "lbvh4") {
+        build_and_render<lbvh_wide_accel<F, eps, 4>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "lbvh8") {
+        build_and_render<lbvh_wide_accel<F, eps, 8>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "grid") {
+        build_and_render<grid_accel<F, eps>, F>(bake_instances(scene), *integrator, report);
+    } else if (accel_name == "two_level") {
+        build_and_render<instance_accel<F, eps>, F>(scene, *integrator, report);
+    } else if (accel_name == "two_level_bvh8") {
+        build_and_render<instance_accel<F, eps, bvh_wide_accel<F, eps, 8>>, F>(scene, *integrator, report);
+    } else {
+        std::println("Unknown acceleration structure: {}", accel_name);
+
+        return 1;
+    }
+
+    // The allocation counting build fails the run if the render loop
+    // allocated.
+    if constexpr (count_heap_allocations) {
+        if (allocation_stats::frame_allocations.load() != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+}
@@ -0,0 +1,123 @@
+// Checks kd_tree_simd_accel::update against fresh builds: the vertices of the
+// scene are moved over a few frames, the tree built for the first frame is
+// updated for every following one, and each updated tree has to render the
+// same image as a tree built from scratch for the same frame. The motion
+// moves triangles across the split planes and, in the last frame, a mesh
+// partly out of the root box of the first one.
+//
+// ./build/refit_check scenes/hw11/scene8.crtscene
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <print>
+#include <string_view>
+#include <vector>
+
+#include <raytracer/config.hpp>
+#include <raytracer/io/json/loader.hpp>
+#include <raytracer/render/accel/kd_tree_simd.hpp>
+#include <raytracer/render/render.hpp>
+#include <raytracer/scene/scene.hpp>
+
+using F = float;
+constexpr F eps = static_cast<F>(epsilon);
+using accel = kd_tree_simd_accel<F, eps>;
+
+constexpr std::size_t FRAME_COUNT = 5;
+
+// Every mesh is shifted along its own direction by a growing fraction of the
+// scene's extent, and its vertices wobble, so the triangles change shape as
+// well. In the last frame, the first mesh is additionally shifted by a third
+// of the extent, which moves it (partly) out of the original root box.
+scene<F> move_vertices(const scene<F>& original, const aabb3<F>& bounds, const std::size_t frame) {
+    const vec3<F> extent = bounds.max - bounds.min;
+    const F size = std::max({extent.x, extent.y, extent.z});
+
+    scene<F> moved = original;
+    for (std::size_t mesh_idx = 0; mesh_idx < original.meshes.size(); ++mesh_idx) {
+        const auto& mesh = original.meshes[mesh_idx];
+
+        const F angle = static_cast<F>(mesh_idx);
+        vec3<F> shift = (static_cast<F>(0.002 * static_cast<double>(frame)) * size) * vec3<F>{std::cos(angle), static_cast<F>(0.5), std::sin(angle)};
+        if (mesh_idx == 0 && frame + 1 == FRAME_COUNT) {
+            shift += static_cast<F>(1. / 3.) * extent;
+        }
+
+        std::vector<vec3<F>> vertices;
+        vertices.reserve(mesh.vertices.size());
+        for (std::size_t vertex_idx = 0; vertex_idx < mesh.vertices.size(); ++vertex_idx) {
+            const F phase = static_cast<F>(vertex_idx + frame);
+            const vec3<F> wobble = (static_cast<F>(0.0005) * size) * vec3<F>{std::sin(phase), std::cos(phase), std::sin(2 * phase)};
+            vertices.push_back(mesh.vertices[vertex_idx] + shift + wobble);
+        }
+
+        moved.meshes[mesh_idx] = mesh_object<F>(mesh.material_idx, std::move(vertices), mesh.uvs, mesh.triangles, mesh.visibility);
+    }
+
+    return moved;
+}
+
+[[nodiscard]] bool same_pixels(const image<F>& lhs, const image<F>& rhs) {
+    for (std::size_t row = 0; row < lhs.get_height(); ++row) {
+        for (std::size_t column = 0; column < lhs.get_width(); ++column) {
+            const auto& lhs_pixel = lhs.get_pixel(row, column);
+            const auto& rhs_pixel = rhs.get_pixel(row, column);
+            if (lhs_pixel.red != rhs_pixel.red || lhs_pixel.green != rhs_pixel.green || lhs_pixel.blue != rhs_pixel.blue) {
+                std::println("Pixel ({}, {}) differs.", row, column);
+
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::println("Usage: ./refit_check FILE");
+
+        return 1;
+    }
+
+    const auto original = bake_instances(parse_scene_file<F>(std::filesystem::path(argv[1])));
+
+    aabb3<F> bounds;
+    for (const auto& mesh : original.meshes) {
+        bounds.unite(mesh.box);
+    }
+
+    accel updated(std::make_shared<const scene<F>>(move_vertices(original, bounds, 0)));
+    bool passed = true;
+    std::size_t refit_count = 0;
+
+    for (std::size_t frame = 1; frame < FRAME_COUNT; ++frame) {
+        const auto frame_scene = std::make_shared<const scene<F>>(move_vertices(original, bounds, frame));
+
+        const bool refitted = updated.update(frame_scene);
+        const accel built(frame_scene);
+
+        const auto updated_image = render_frame<accel, F>(updated, scheduling_type::BUCKET_TILES);
+        const auto built_image = render_frame<accel, F>(built, scheduling_type::BUCKET_TILES);
+        const bool same = same_pixels(updated_image, built_image);
+
+        std::println("Frame {}: {} with SAH cost {} against {} of a fresh build, {}.",
+                     frame, refitted ? "refitted" : "rebuilt", updated.sah_cost(), built.sah_cost(),
+                     same ? "same image" : "DIFFERENT IMAGE");
+
+        passed &= same;
+        refit_count += refitted ? 1 : 0;
+    }
+
+    // A run which rebuilt every frame didn't check the refit at all.
+    if (refit_count == 0) {
+        std::println("No frame was refitted.");
+
+        return 1;
+    }
+
+    return passed ? 0 : 1;
+}